@@ -31,10 +31,12 @@
 #include "hue_dtls.h"
 #include "hue_entertainment.h"
 #include "hue_rest.h"
+#include "hue_stream.h"
 
 
 #define DTLS_PORT 2100
 #define SSL_PORT  443
+#define STREAM_FRAMERATE 50
 
 void print_usage(const char* name)
 {
@@ -56,12 +58,9 @@ int main (int argc, char **argv)
   const char *ip_address = NULL;
   int c;
   int debug_level = HUE_MSG_ERR;
-  struct hue_dtls_ctx ctx_dtls;
-  struct hue_ent_ctx ctx_ent;
+  struct hue_stream stream;
   struct hue_rest_ctx ctx_hr;
   struct hue_entertainment_area *ent_areas;
-  void *msg_buf;
-  int buf_len;
   int ent_areas_count;
   int framerate = 80;
   int interval_ms;
@@ -151,31 +150,50 @@ int main (int argc, char **argv)
     return -2;
   }
 
+  /* A v1 stream message can only address HUE_ENT_MAX_LIGHTS_V1 lights; control the first ones */
+  if (light_count > HUE_ENT_MAX_LIGHTS_V1)
+  {
+    printf("Entertainment area [%s] has %d lights; only the first %d will be controlled.\n",
+           ent_areas->area_name, light_count, HUE_ENT_MAX_LIGHTS_V1);
+    light_count = HUE_ENT_MAX_LIGHTS_V1;
+  }
+
   /* Activate the entertainment area */
   printf("Enabling entertainment area [%s]\n", ent_areas->area_name);
   hue_rest_activate_stream(&ctx_hr, ent_areas->area_id);
 
-  /* Initialise hue entertainment context */
-  hue_ent_init(&ctx_ent, light_count);
+  /* Initialise stream; this owns the entertainment context & DTLS connection, and sends
+   * messages to the bridge from its own thread */
+  if (hue_stream_init(&stream, light_count, NULL, STREAM_FRAMERATE, identity, psk, NULL, debug_level))
+  {
+    printf("Failed to initialise stream\n");
+    hue_rest_cleanup_ctx(&ctx_hr);
+    hue_rest_cleanup();
+    return -1;
+  }
 
   /* Assign the light ID (as returned by the bridge) to each light to be controlled (0..n) */
   for (int n = 0; n < light_count; n++)
-    hue_ent_set_light_id(&ctx_ent, n, ent_areas->light_ids[n]);
+    hue_stream_set_light_id(&stream, n, ent_areas->light_ids[n]);
+
+  /* If the connection drops (e.g. bridge reboot), re-activate the area and reconnect */
+  if (hue_stream_set_recovery(&stream, &ctx_hr, ent_areas->area_id))
+    printf("Failed to enable recovery; the stream will stop if the connection drops\n");
 
   /* Connect to bridge using DTLS */
   printf("Making DTLS connection to bridge\n");
-  hue_dtls_init(&ctx_dtls, identity, psk, NULL, debug_level);
-  int retval = hue_dtls_connect(&ctx_dtls, ip_address, DTLS_PORT);
+  int retval = hue_stream_connect(&stream, ip_address, DTLS_PORT);
   if (retval)
   {
     printf("Failed to make DTLS connection to bridge (retval=%d)\n", retval);
+    hue_stream_cleanup(&stream);
     hue_rest_cleanup_ctx(&ctx_hr);
     hue_rest_cleanup();
-    hue_dtls_cleanup(&ctx_dtls);
-    hue_ent_cleanup(&ctx_ent);
     return -3;
   }
 
+  hue_stream_start(&stream);
+
   interval_ms = 1000 / framerate;
 
   printf("Running...\n");
@@ -211,31 +229,30 @@ int main (int argc, char **argv)
 
     if (b == 0 && g == 0)
     {
-      hue_ent_set_light(&ctx_ent, light, 0, 0, 0);
+      hue_stream_set_light(&stream, light, 0, 0, 0);
       if (++light >= light_count)
         light = 0;
       printf("Light = %d (id = %d)\n", light, ent_areas->light_ids[light]);
     }
 
-    /* hue_ent_set_light expects the values for r/g/b to be 0..65535, but the generated values
+    /* hue_stream_set_light expects the values for r/g/b to be 0..65535, but the generated values
      * are 0..255. So shift values left by 8 bits to get 0..65535 */
-    hue_ent_set_light(&ctx_ent, light, r << 8, g << 8, b << 8);
+    hue_stream_set_light(&stream, light, r << 8, g << 8, b << 8);
 
-    /* Generate message */
-    hue_ent_get_message(&ctx_ent, &msg_buf, &buf_len);
+    /* Hand the new values to the sender thread */
+    hue_stream_publish(&stream);
 
-    /* Send message */
-    if (hue_dtls_send_data(&ctx_dtls, msg_buf, buf_len))
+    if (hue_stream_get_state(&stream) == HUE_STREAM_STATE_FAILED)
     {
       printf("Connection lost, exiting...\n");
       break;
     }
   }
 
+  /* The stream uses ctx_hr (and curl) for recovery, so goes first */
+  hue_stream_cleanup(&stream);
   hue_rest_cleanup_ctx(&ctx_hr);
   hue_rest_cleanup();
-  hue_dtls_cleanup(&ctx_dtls);
-  hue_ent_cleanup(&ctx_ent);
 
   return 0;
 }
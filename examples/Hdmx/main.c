@@ -31,6 +31,7 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <ifaddrs.h>
+#include <time.h>
 
 
 #include "hue_dtls.h"
@@ -50,7 +51,7 @@
 void print_usage(const char* name)
 {
   printf("\nArt-Net to Hue lights Bridge\n");
-  printf("Usage: %s -a <ip address> -e <area> -i <identity> -p <psk> [-d <debug level>]\n\n", name);
+  printf("Usage: %s -a <ip address> -e <area> -i <identity> -p <psk> [-d <debug level>] [-c <cache file> [-o]]\n\n", name);
 
   printf("Parameters:\n");
   printf("    -a <ip address>  IP address of Hue Bridge\n");
@@ -58,6 +59,8 @@ void print_usage(const char* name)
   printf("    -i <identity>    Identity to use when connecting to bridge\n");
   printf("    -p <psk>         Pre Shared Key to use when connecting to bridge\n");
   printf("    -d <level>       Debug level 0-3. Default: 1 (errors only)\n");
+  printf("    -c <file>        Cache the bridge's entertainment areas in file, to start faster next time\n");
+  printf("    -o               Offline start: trust the cache without checking it with the bridge\n");
   printf("\n");
 }
 
@@ -141,6 +144,8 @@ int main (int argc, char **argv)
   int area=0;
   int c;
   int debug_level = HUE_MSG_ERR;
+  const char *cache_file = NULL;
+  int cache_mode = HUE_REST_CACHE_VALIDATE;
   struct hue_dtls_ctx ctx_dtls;
   struct hue_ent_ctx ctx_ent;
   struct hue_rest_ctx ctx_hr;
@@ -151,7 +156,7 @@ int main (int argc, char **argv)
   int framerate = 80;
   int interval_ms;
 
-  while ((c = getopt (argc, argv, "i:p:a:d:e:")) != -1)
+  while ((c = getopt (argc, argv, "i:p:a:d:e:c:o")) != -1)
   {
     switch (c)
       {
@@ -175,6 +180,14 @@ int main (int argc, char **argv)
         area = atoi(optarg);
         break;
 
+      case 'c': /* Topology cache */
+        cache_file = optarg;
+        break;
+
+      case 'o': /* Offline start */
+        cache_mode = HUE_REST_CACHE_TRUST;
+        break;
+
       case 'h':
       case 'H':
         print_usage(argv[0]);
@@ -214,6 +227,8 @@ int main (int argc, char **argv)
 
   hue_rest_init();
   hue_rest_init_ctx(&ctx_hr, NULL, ip_address, SSL_PORT, identity, debug_level);
+  if (cache_file)
+    hue_rest_set_cache(&ctx_hr, cache_file, cache_mode);
 
   printf("Getting entertainment areas\n");
   hue_rest_get_ent_groups(&ctx_hr, &ent_areas, &ent_areas_count);
@@ -249,12 +264,26 @@ int main (int argc, char **argv)
   }
   printf("%d lights found in entertainment area [%s].\n", light_count,ent_areas[area].area_name);
 
+  /* A v1 stream message can only address HUE_ENT_MAX_LIGHTS_V1 lights; control the first ones */
+  if (light_count > HUE_ENT_MAX_LIGHTS_V1)
+  {
+    printf("Entertainment area [%s] has %d lights; only the first %d will be controlled.\n",
+           ent_areas[area].area_name, light_count, HUE_ENT_MAX_LIGHTS_V1);
+    light_count = HUE_ENT_MAX_LIGHTS_V1;
+  }
+
   /* Activate the entertainment area */
   printf("Enabling entertainment area [%s]\n", ent_areas[area].area_name);
   hue_rest_activate_stream(&ctx_hr, ent_areas[area].area_id);
 
   /* Initialise hue entertainment context */
-  hue_ent_init(&ctx_ent, light_count);
+  if (hue_ent_init(&ctx_ent, light_count))
+  {
+    printf("Failed to initialise entertainment context\n");
+    hue_rest_cleanup_ctx(&ctx_hr);
+    hue_rest_cleanup();
+    return -1;
+  }
 
   /* Assign the light ID (as returned by the bridge) to each light to be controlled (0..n) */
   for (int n = 0; n < light_count; n++)
@@ -311,6 +340,7 @@ int main (int argc, char **argv)
 
    printf("Listening For Art-Net Data...\n");
    unsigned char sequence;
+   time_t last_send = 0;
     while(1)
 	    {
 	    int upd_len = sizeof(cliaddr);  //len is value/resuslt 
@@ -384,19 +414,8 @@ int main (int argc, char **argv)
 				if(dmx_count>3*light_count)
 					dmx_count=3*light_count;
 
-				unsigned char *data=buffer+18;
-				    int light;
-
-				    for(light=0;light<dmx_count/3;light++)
-				    {
-				    int r,b,g;
-				    r=data[0];
-				    g=data[1];
-				    b=data[2];
-
-				    hue_ent_set_light(&ctx_ent, light, r << 8, g << 8, b << 8);
-				    data+=3;
-				    }
+				/* 3 channels (R/G/B) per light */
+				hue_ent_set_lights_8bit(&ctx_ent, 0, dmx_count/3, buffer+18);
 				}
 			    break;
 		    default:
@@ -404,6 +423,12 @@ int main (int argc, char **argv)
 			}
 		}
 		
+	    /* Only send if something has changed, or if nothing has been sent for a while
+	     * to stop the bridge from disabling streaming */
+	    if (!hue_ent_is_changed(&ctx_ent) && (time(NULL) - last_send) < 2)
+	      continue;
+	    last_send = time(NULL);
+
 	    /* Generate message */
 	    hue_ent_get_message(&ctx_ent, &msg_buf, &buf_len);
 
@@ -0,0 +1,330 @@
+/*
+ * Copyright (c) 2019, Daniel Swann <github@dswann.co.uk>
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * HueBench - times the library's hot paths without a bridge.
+ *
+ * setters: sets every light in an entertainment context with hue_ent_set_light (one call per light) and with
+ * the batch setter hue_ent_set_lights (one call for all of them), for 16-bit and 8-bit values, and reports the
+ * time per call and per light. The values change on every iteration, so nothing is skipped as unchanged.
+ *
+ * send: encodes and sends messages over hue_dtls's in-memory transport, flat out or at a fixed rate, and reports
+ * the send rate and hue_dtls's write timings. Every message received by the sink is checked (header and sequence
+ * number), so a long run at a high rate doubles as a soak test; the exit status is non-zero if anything was lost
+ * or malformed.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "hue_dtls.h"
+#include "hue_entertainment.h"
+
+#define DEFAULT_ITERATIONS 1000000
+#define BENCH_CONFIG_ID    "00000000-0000-0000-0000-000000000000"
+#define BENCH_PSK          "0123456789abcdef0123456789abcdef"
+#define NSEC_PER_SEC       1000000000L
+
+/* What the memory transport's sink has seen */
+struct sink_check
+{
+  uint64_t frames;
+  uint64_t bad_frames;
+  uint64_t sequence_gaps;
+  int last_sequence;
+};
+
+void print_usage(const char* name)
+{
+  printf("\nLibHueEnt benchmarks\n");
+  printf("Usage: %s [-m <mode>] [-n <lights>] [-i <iterations>] [-f <fps>] [-2]\n\n", name);
+
+  printf("Parameters:\n");
+  printf("    -m <mode>        What to time. One of:\n");
+  printf("                       setters - per light vs batch light setters (default)\n");
+  printf("                       send    - encode and send messages over the in-memory transport\n");
+  printf("    -n <lights>      Number of lights (or channels). Default: %d\n", HUE_ENT_MAX_LIGHTS_V1);
+  printf("    -i <iterations>  Number of times to set every light (and send, in send mode). Default: %d\n", DEFAULT_ITERATIONS);
+  printf("    -f <fps>         Send mode: messages per second, or 0 for as fast as possible. Default: 0\n");
+  printf("    -2               Use a HueStream v2 context (up to %d channels) rather than v1\n", HUE_ENT_MAX_CHANNELS_V2);
+  printf("\n");
+}
+
+static uint64_t monotonic_ns(void)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return ((uint64_t)now.tv_sec * 1000000000) + now.tv_nsec;
+}
+
+static int init_ctx(struct hue_ent_ctx *ctx, int light_count, int v2)
+{
+  if (v2)
+    return hue_ent_init_v2(ctx, BENCH_CONFIG_ID, light_count);
+
+  return hue_ent_init(ctx, light_count);
+}
+
+static void report(const char *name, uint64_t elapsed_ns, int iterations, int calls_per_iteration, int light_count)
+{
+  printf("  %-28s %8.1f ns/call %7.2f ns/light\n", name,
+         (double)elapsed_ns / ((double)iterations * calls_per_iteration),
+         (double)elapsed_ns / ((double)iterations * light_count));
+}
+
+static int bench_setters(int light_count, int iterations, int v2)
+{
+  struct hue_ent_ctx ctx;
+  uint16_t rgb[HUE_ENT_MAX_CHANNELS_V2 * 3];
+  uint8_t rgb_8bit[HUE_ENT_MAX_CHANNELS_V2 * 3];
+  uint64_t start;
+
+  if (init_ctx(&ctx, light_count, v2))
+  {
+    printf("Failed to initialise entertainment context for %d lights\n", light_count);
+    return -1;
+  }
+
+  printf("Setting %d lights, %d times (HueStream v%d):\n", light_count, iterations, v2 ? 2 : 1);
+
+  start = monotonic_ns();
+  for (int i = 0; i < iterations; i++)
+    for (int n = 0; n < light_count; n++)
+      hue_ent_set_light(&ctx, n, i + n, i + n + 1, i + n + 2);
+  report("hue_ent_set_light", monotonic_ns() - start, iterations, light_count, light_count);
+
+  start = monotonic_ns();
+  for (int i = 0; i < iterations; i++)
+  {
+    for (int n = 0; n < light_count * 3; n++)
+      rgb[n] = i + n;
+    hue_ent_set_lights(&ctx, 0, light_count, rgb);
+  }
+  report("hue_ent_set_lights", monotonic_ns() - start, iterations, 1, light_count);
+
+  start = monotonic_ns();
+  for (int i = 0; i < iterations; i++)
+    for (int n = 0; n < light_count; n++)
+      hue_ent_set_light_8bit(&ctx, n, i + n, i + n + 1, i + n + 2);
+  report("hue_ent_set_light_8bit", monotonic_ns() - start, iterations, light_count, light_count);
+
+  start = monotonic_ns();
+  for (int i = 0; i < iterations; i++)
+  {
+    for (int n = 0; n < light_count * 3; n++)
+      rgb_8bit[n] = i + n;
+    hue_ent_set_lights_8bit(&ctx, 0, light_count, rgb_8bit);
+  }
+  report("hue_ent_set_lights_8bit", monotonic_ns() - start, iterations, 1, light_count);
+
+  hue_ent_cleanup(&ctx);
+  return 0;
+}
+
+static void sink_cb(const void *buf, int length, void *user_data)
+{
+  const struct hue_ent_message_header *header = buf;
+  struct sink_check *check = user_data;
+
+  check->frames++;
+  if (length < (int)sizeof(struct hue_ent_message_header) || memcmp(header->protocol_name, "HueStream", 9))
+  {
+    check->bad_frames++;
+    return;
+  }
+
+  if (check->last_sequence >= 0 && header->sequence_number != (uint8_t)(check->last_sequence + 1))
+    check->sequence_gaps++;
+  check->last_sequence = header->sequence_number;
+}
+
+static int bench_send(int light_count, int iterations, int framerate, int v2)
+{
+  struct hue_ent_ctx ctx;
+  struct hue_dtls_ctx dtls;
+  struct hue_dtls_stats stats;
+  struct sink_check check = { 0, 0, 0, -1 };
+  uint8_t rgb[HUE_ENT_MAX_CHANNELS_V2 * 3];
+  struct timespec deadline;
+  uint64_t send_errors = 0;
+  uint64_t start;
+  uint64_t elapsed_ns;
+  void *msg_buf;
+  int buf_len;
+  int retval = 0;
+
+  if (init_ctx(&ctx, light_count, v2))
+  {
+    printf("Failed to initialise entertainment context for %d lights\n", light_count);
+    return -1;
+  }
+  for (int n = 0; n < light_count; n++)
+    hue_ent_set_light_id(&ctx, n, n + 1);
+
+  hue_dtls_init(&dtls, "huebench", BENCH_PSK, NULL, HUE_MSG_ERR);
+  hue_dtls_set_transport(&dtls, &hue_dtls_transport_memory);
+  hue_dtls_set_sink_callback(&dtls, sink_cb, &check);
+  if (hue_dtls_connect(&dtls, "127.0.0.1", 2100))
+  {
+    printf("Failed to connect memory transport\n");
+    hue_dtls_cleanup(&dtls);
+    hue_ent_cleanup(&ctx);
+    return -1;
+  }
+
+  if (framerate)
+    printf("Sending %d messages of %d lights at %d fps (HueStream v%d, %s transport):\n", iterations, light_count,
+           framerate, v2 ? 2 : 1, hue_dtls_transport_memory.name);
+  else
+    printf("Sending %d messages of %d lights (HueStream v%d, %s transport):\n", iterations, light_count,
+           v2 ? 2 : 1, hue_dtls_transport_memory.name);
+
+  clock_gettime(CLOCK_MONOTONIC, &deadline);
+  start = monotonic_ns();
+  for (int i = 0; i < iterations; i++)
+  {
+    for (int n = 0; n < light_count * 3; n++)
+      rgb[n] = i + n;
+    hue_ent_set_lights_8bit(&ctx, 0, light_count, rgb);
+
+    if (hue_ent_get_message(&ctx, &msg_buf, &buf_len) || hue_dtls_send_data(&dtls, msg_buf, buf_len))
+      send_errors++;
+
+    if (framerate)
+    {
+      deadline.tv_nsec += NSEC_PER_SEC / framerate;
+      while (deadline.tv_nsec >= NSEC_PER_SEC)
+      {
+        deadline.tv_nsec -= NSEC_PER_SEC;
+        deadline.tv_sec++;
+      }
+      clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL);
+    }
+  }
+  elapsed_ns = monotonic_ns() - start;
+
+  hue_dtls_get_stats(&dtls, &stats);
+  printf("  %.0f messages/s, %.2f MB/s\n", (double)iterations * NSEC_PER_SEC / elapsed_ns,
+         (double)stats.bytes_sent * 1000.0 / elapsed_ns);
+  if (!framerate)
+    printf("  %.1f ns/message (set lights, encode and send)\n", (double)elapsed_ns / iterations);
+  printf("  write: p50 %llu ns, p99 %llu ns, p99.9 %llu ns, max %llu ns\n",
+         (unsigned long long)stats.write.p50, (unsigned long long)stats.write.p99,
+         (unsigned long long)stats.write.p999, (unsigned long long)stats.write.max);
+  if (framerate)
+    printf("  interval: p50 %llu ns, p99 %llu ns, max %llu ns\n", (unsigned long long)stats.interval.p50,
+           (unsigned long long)stats.interval.p99, (unsigned long long)stats.interval.max);
+  printf("  sent %llu, received %llu, bad %llu, sequence gaps %llu, send errors %llu\n",
+         (unsigned long long)stats.frames_sent, (unsigned long long)check.frames,
+         (unsigned long long)check.bad_frames, (unsigned long long)check.sequence_gaps,
+         (unsigned long long)send_errors);
+
+  if (send_errors || check.frames != (uint64_t)iterations || check.bad_frames || check.sequence_gaps)
+  {
+    printf("FAILED\n");
+    retval = 1;
+  }
+
+  hue_dtls_cleanup(&dtls);
+  hue_ent_cleanup(&ctx);
+  return retval;
+}
+
+int main (int argc, char **argv)
+{
+  const char *mode = "setters";
+  int light_count = HUE_ENT_MAX_LIGHTS_V1;
+  int iterations = DEFAULT_ITERATIONS;
+  int framerate = 0;
+  int v2 = 0;
+  int c;
+
+  while ((c = getopt (argc, argv, "m:n:i:f:2h")) != -1)
+  {
+    switch (c)
+      {
+      case 'm': /* Mode */
+        mode = optarg;
+        break;
+
+      case 'n': /* Light count */
+        light_count = atoi(optarg);
+        break;
+
+      case 'i': /* Iterations */
+        iterations = atoi(optarg);
+        break;
+
+      case 'f': /* Send rate */
+        framerate = atoi(optarg);
+        break;
+
+      case '2': /* HueStream v2 */
+        v2 = 1;
+        break;
+
+      case 'h':
+        print_usage(argv[0]);
+        exit(0);
+        break;
+
+      default:
+        print_usage(argv[0]);
+        exit(-1);
+      }
+  }
+
+  if (light_count < 1 || light_count > (v2 ? HUE_ENT_MAX_CHANNELS_V2 : HUE_ENT_MAX_LIGHTS_V1))
+  {
+    printf("\nERROR: Number of lights must be 1-%d\n", v2 ? HUE_ENT_MAX_CHANNELS_V2 : HUE_ENT_MAX_LIGHTS_V1);
+    return -1;
+  }
+
+  if (iterations < 1)
+  {
+    printf("\nERROR: Number of iterations must be at least 1\n");
+    return -1;
+  }
+
+  if (framerate < 0)
+  {
+    printf("\nERROR: Send rate must not be negative\n");
+    return -1;
+  }
+
+  if (!strcmp(mode, "setters"))
+    return bench_setters(light_count, iterations, v2);
+
+  if (!strcmp(mode, "send"))
+    return bench_send(light_count, iterations, framerate, v2);
+
+  printf("\nERROR: Unknown mode [%s]\n", mode);
+  print_usage(argv[0]);
+  return -1;
+}
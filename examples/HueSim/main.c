@@ -0,0 +1,807 @@
+/*
+ * Copyright (c) 2019, Daniel Swann <github@dswann.co.uk>
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * HueSim - stands in for a Hue bridge, so the examples can be run end to end without hardware.
+ *
+ * Accepts DTLS-PSK sessions (one at a time, like the bridge) on port 2100, checks and decodes the HueStream
+ * v1/v2 messages received, and records each light's values with the time (CLOCK_MONOTONIC) they arrived. It
+ * also answers the REST requests made by hue_rest (over HTTPS, with a generated self-signed certificate),
+ * reporting one entertainment area containing the simulated lights.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <signal.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+#include <openssl/x509.h>
+
+#include "hue_entertainment.h"
+
+#define DTLS_PORT 2100
+#define SSL_PORT  443
+
+#define MAX_LIGHTS          32
+#define MAX_PSK_LEN         64
+#define SESSION_IDLE_S      10   /* the bridge ends a session after 10s without a message */
+#define MAX_REQUEST_LEN     8192
+#define MAX_RESPONSE_LEN    4096
+#define HUESTREAM_V2_ID_LEN 36
+
+struct light
+{
+  uint16_t id;       /* light id (v1) or channel id (v2) */
+  uint16_t r;        /* or x, in XY Brightness mode */
+  uint16_t g;        /* or y */
+  uint16_t b;        /* or brightness */
+  uint64_t updated_us;
+};
+
+struct sim_stats
+{
+  uint64_t sessions;
+  uint64_t frames;
+  uint64_t bad_frames;
+  uint64_t sequence_gaps;
+  uint64_t min_interval_us;
+  uint64_t max_interval_us;
+  uint64_t total_interval_us;
+  uint64_t intervals;
+};
+
+static volatile sig_atomic_t running = 1;
+
+static const char *identity;
+static const char *psk_hex;
+static unsigned char psk[MAX_PSK_LEN];
+static int psk_len;
+static int light_count = 3;
+static int verbose;
+static FILE *log_file;
+
+static struct light lights[MAX_LIGHTS];
+static int lights_seen;
+static struct sim_stats stats;       /* since the last report */
+static struct sim_stats total_stats;
+static uint64_t last_frame_us;
+static int last_sequence = -1;
+
+void print_usage(const char* name)
+{
+  printf("\nHue bridge simulator\n");
+  printf("Usage: %s -i <identity> -p <psk> [-n <lights>] [-P <dtls port>] [-r <rest port>] [-l <log file>] [-v]\n\n", name);
+
+  printf("Parameters:\n");
+  printf("    -i <identity>    Identity clients must connect with\n");
+  printf("    -p <psk>         Pre Shared Key (hex) clients must connect with\n");
+  printf("    -n <lights>      Number of lights in the entertainment area. Default: 3\n");
+  printf("    -P <port>        DTLS port. Default: %d\n", DTLS_PORT);
+  printf("    -r <port>        HTTPS (REST API) port, or 0 for none. Default: %d\n", SSL_PORT);
+  printf("    -l <file>        Log every light value received as CSV: time_us,sequence,id,r,g,b\n");
+  printf("    -v               Print every message received\n");
+  printf("\n");
+}
+
+static void stop(int sig)
+{
+  running = 0;
+}
+
+static uint64_t monotonic_us(void)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return ((uint64_t)now.tv_sec * 1000000) + (now.tv_nsec / 1000);
+}
+
+static int hex2bin(const char *str, unsigned char *out, int max_len)
+{
+  int len = strlen(str);
+  int n;
+
+  if (len == 0 || len % 2 || len / 2 > max_len)
+    return -1;
+
+  for (n = 0; n < len / 2; n++)
+  {
+    unsigned int byte;
+    if (sscanf(str + (n * 2), "%2x", &byte) != 1)
+      return -1;
+    out[n] = byte;
+  }
+
+  return len / 2;
+}
+
+static unsigned int psk_server_cb(SSL *ssl, const char *client_identity, unsigned char *out_psk, unsigned int max_psk_len)
+{
+  if (strcmp(client_identity, identity))
+  {
+    printf("Rejected unknown identity [%s]\n", client_identity);
+    return 0;
+  }
+
+  if ((unsigned int)psk_len > max_psk_len)
+    return 0;
+
+  memcpy(out_psk, psk, psk_len);
+  return psk_len;
+}
+
+static struct light *find_light(uint16_t id)
+{
+  for (int n = 0; n < lights_seen; n++)
+    if (lights[n].id == id)
+      return &lights[n];
+
+  if (lights_seen >= MAX_LIGHTS)
+    return NULL;
+
+  lights[lights_seen].id = id;
+  return &lights[lights_seen++];
+}
+
+static int bad_frame(const char *reason, int len)
+{
+  printf("Bad message (%d bytes): %s\n", len, reason);
+  stats.bad_frames++;
+  return -1;
+}
+
+/* Check a HueStream message, and record the light values in it */
+static int handle_frame(const uint8_t *buf, int len, uint64_t now_us)
+{
+  const struct hue_ent_message_header *header = (const struct hue_ent_message_header *)buf;
+  int header_len = sizeof(struct hue_ent_message_header);
+  int record_len;
+
+  if (len < header_len)
+    return bad_frame("shorter than the header", len);
+
+  if (memcmp(header->protocol_name, "HueStream", sizeof(header->protocol_name)))
+    return bad_frame("protocol name isn't HueStream", len);
+
+  if (header->colour_space != HUE_ENT_COLOUR_SPACE_RGB && header->colour_space != HUE_ENT_COLOUR_SPACE_XY)
+    return bad_frame("unknown colour space", len);
+
+  if (header->reserved1[0] || header->reserved1[1] || header->reserved2[0])
+    return bad_frame("reserved bytes aren't 0", len);
+
+  switch (header->version_major)
+  {
+    case HUE_ENT_VERSION_1:
+      record_len = sizeof(struct hue_ent_message_data);
+      break;
+
+    case HUE_ENT_VERSION_2:
+      /* Followed by the entertainment configuration id */
+      header_len += HUESTREAM_V2_ID_LEN;
+      if (len < header_len)
+        return bad_frame("shorter than the v2 header", len);
+      record_len = sizeof(struct hue_ent_message_data_v2);
+      break;
+
+    default:
+      return bad_frame("unknown version", len);
+  }
+
+  if ((len - header_len) % record_len)
+    return bad_frame("partial light record", len);
+
+  /* Senders increment the sequence number for every message */
+  if (last_sequence >= 0 && header->sequence_number != (uint8_t)(last_sequence + 1))
+    stats.sequence_gaps++;
+  last_sequence = header->sequence_number;
+
+  if (last_frame_us)
+  {
+    uint64_t interval_us = now_us - last_frame_us;
+    if (!stats.intervals || interval_us < stats.min_interval_us)
+      stats.min_interval_us = interval_us;
+    if (interval_us > stats.max_interval_us)
+      stats.max_interval_us = interval_us;
+    stats.total_interval_us += interval_us;
+    stats.intervals++;
+  }
+  last_frame_us = now_us;
+  stats.frames++;
+
+  if (verbose)
+    printf("%llu: v%d seq %3d %s %d light(s)\n", (unsigned long long)now_us, header->version_major, header->sequence_number,
+           header->colour_space == HUE_ENT_COLOUR_SPACE_XY ? "XY" : "RGB", (len - header_len) / record_len);
+
+  for (const uint8_t *record = buf + header_len; record < buf + len; record += record_len)
+  {
+    const struct hue_ent_message_colour *colour;
+    struct light *light;
+    uint16_t id;
+
+    if (header->version_major == HUE_ENT_VERSION_1)
+    {
+      const struct hue_ent_message_data *data = (const struct hue_ent_message_data *)record;
+      id = ntohs(data->id);
+      colour = &data->colour;
+    }
+    else
+    {
+      const struct hue_ent_message_data_v2 *data = (const struct hue_ent_message_data_v2 *)record;
+      id = data->channel_id;
+      colour = &data->colour;
+    }
+
+    light = find_light(id);
+    if (!light)
+      continue;
+
+    light->r = ntohs(colour->R);
+    light->g = ntohs(colour->G);
+    light->b = ntohs(colour->B);
+    light->updated_us = now_us;
+
+    if (log_file)
+      fprintf(log_file, "%llu,%d,%d,%d,%d,%d\n", (unsigned long long)now_us, header->sequence_number,
+              light->id, light->r, light->g, light->b);
+  }
+
+  return 0;
+}
+
+static void add_stats(struct sim_stats *total, const struct sim_stats *s)
+{
+  if (s->intervals && (!total->intervals || s->min_interval_us < total->min_interval_us))
+    total->min_interval_us = s->min_interval_us;
+  if (s->max_interval_us > total->max_interval_us)
+    total->max_interval_us = s->max_interval_us;
+  total->frames            += s->frames;
+  total->bad_frames        += s->bad_frames;
+  total->sequence_gaps     += s->sequence_gaps;
+  total->total_interval_us += s->total_interval_us;
+  total->intervals         += s->intervals;
+}
+
+static void print_stats(const char *label, const struct sim_stats *s, double seconds)
+{
+  printf("%s: %llu messages (%.1f/s), %llu bad, %llu sequence gaps", label, (unsigned long long)s->frames,
+         seconds > 0 ? s->frames / seconds : 0.0, (unsigned long long)s->bad_frames, (unsigned long long)s->sequence_gaps);
+
+  if (s->intervals)
+    printf(", interval min/avg/max %.2f/%.2f/%.2f ms", s->min_interval_us / 1000.0,
+           (double)s->total_interval_us / s->intervals / 1000.0, s->max_interval_us / 1000.0);
+  printf("\n");
+}
+
+/* Print the last second's stats and the latest light values, unless nothing was received */
+static void report(uint64_t period_us)
+{
+  if (!stats.frames && !stats.bad_frames)
+    return;
+
+  print_stats("Last second", &stats, period_us / 1000000.0);
+  for (int n = 0; n < lights_seen; n++)
+    printf("  light %3d: %5d %5d %5d\n", lights[n].id, lights[n].r, lights[n].g, lights[n].b);
+
+  add_stats(&total_stats, &stats);
+  memset(&stats, 0, sizeof(stats));
+  if (log_file)
+    fflush(log_file);
+}
+
+static int open_socket(int type, int port)
+{
+  struct sockaddr_in addr;
+  int on = 1;
+  int fd;
+
+  fd = socket(AF_INET, type, 0);
+  if (fd < 0)
+  {
+    perror("socket");
+    return -1;
+  }
+
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_ANY);
+  addr.sin_port = htons(port);
+  if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)))
+  {
+    printf("Failed to bind to port %d: %s\n", port, strerror(errno));
+    close(fd);
+    return -1;
+  }
+
+  return fd;
+}
+
+/* Wait up to timeout_ms for fd to become readable; 1 if it has, 0 if not */
+static int wait_readable(int fd, int timeout_ms)
+{
+  struct pollfd pfd = { fd, POLLIN, 0 };
+  return poll(&pfd, 1, timeout_ms) > 0;
+}
+
+/* Run one DTLS session, from the first datagram received on fd until the client closes it or goes quiet */
+static void dtls_session(SSL_CTX *ssl_ctx, int fd)
+{
+  uint8_t buf[2048];
+  struct sockaddr_in client;
+  socklen_t client_len = sizeof(client);
+  struct timeval timeout = { 1, 0 };
+  uint64_t report_us;
+  uint64_t last_rx_us;
+  BIO *bio;
+  SSL *ssl;
+  int len;
+
+  if (recvfrom(fd, buf, sizeof(buf), MSG_PEEK, (struct sockaddr *)&client, &client_len) < 0)
+    return;
+
+  /* Only talk to this client until the session ends */
+  if (connect(fd, (struct sockaddr *)&client, sizeof(client)))
+  {
+    perror("connect");
+    return;
+  }
+
+  bio = BIO_new_dgram(fd, BIO_NOCLOSE);
+  BIO_ctrl(bio, BIO_CTRL_DGRAM_SET_CONNECTED, 0, &client);
+  BIO_ctrl(bio, BIO_CTRL_DGRAM_SET_RECV_TIMEOUT, 0, &timeout);
+
+  ssl = SSL_new(ssl_ctx);
+  SSL_set_bio(ssl, bio, bio);
+
+  /* Blocking, with retransmissions driven by the receive timeout */
+  last_rx_us = monotonic_us();
+  while ((len = SSL_accept(ssl)) <= 0)
+  {
+    if (SSL_get_error(ssl, len) != SSL_ERROR_WANT_READ || !running ||
+        monotonic_us() - last_rx_us > SESSION_IDLE_S * 1000000ULL)
+    {
+      printf("Handshake with %s:%d failed: %s\n", inet_ntoa(client.sin_addr), ntohs(client.sin_port),
+             ERR_error_string(ERR_get_error(), (char *)buf));
+      SSL_free(ssl);
+      return;
+    }
+    DTLSv1_handle_timeout(ssl);
+  }
+
+  stats.sessions++;
+  total_stats.sessions++;
+  last_sequence = -1;
+  last_frame_us = 0;
+  printf("Session %llu from %s:%d (%s%s)\n", (unsigned long long)total_stats.sessions, inet_ntoa(client.sin_addr),
+         ntohs(client.sin_port), SSL_CIPHER_get_name(SSL_get_current_cipher(ssl)), SSL_session_reused(ssl) ? ", resumed" : "");
+
+  report_us = monotonic_us();
+  while (running)
+  {
+    uint64_t now_us;
+
+    len = SSL_read(ssl, buf, sizeof(buf));
+    now_us = monotonic_us();
+
+    if (len > 0)
+    {
+      last_rx_us = now_us;
+      handle_frame(buf, len, now_us);
+    }
+    else
+    {
+      int err = SSL_get_error(ssl, len);
+      if (err == SSL_ERROR_ZERO_RETURN)
+      {
+        printf("Session closed by client\n");
+        break;
+      }
+      if (err != SSL_ERROR_WANT_READ)
+      {
+        printf("Session error: %s\n", ERR_error_string(ERR_get_error(), (char *)buf));
+        break;
+      }
+      if (now_us - last_rx_us > SESSION_IDLE_S * 1000000ULL)
+      {
+        printf("No messages for %ds, closing session\n", SESSION_IDLE_S);
+        break;
+      }
+    }
+
+    if (now_us - report_us >= 1000000)
+    {
+      report(now_us - report_us);
+      report_us = now_us;
+    }
+  }
+
+  SSL_shutdown(ssl);
+  SSL_free(ssl);
+  report(monotonic_us() - report_us);
+}
+
+static void serve_dtls(SSL_CTX *ssl_ctx, int port)
+{
+  int fd;
+
+  printf("Waiting for DTLS sessions on port %d\n", port);
+  while (running)
+  {
+    /* A fresh (unconnected) socket for each session */
+    fd = open_socket(SOCK_DGRAM, port);
+    if (fd < 0)
+      return;
+
+    while (running && !wait_readable(fd, 500))
+      ;
+
+    if (running)
+      dtls_session(ssl_ctx, fd);
+    close(fd);
+  }
+}
+
+/* Self-signed certificate for the REST API; hue_rest doesn't verify the bridge's certificate */
+static int set_certificate(SSL_CTX *ssl_ctx)
+{
+  EVP_PKEY *pkey = NULL;
+  EVP_PKEY_CTX *pctx;
+  X509 *cert;
+  X509_NAME *name;
+  int retval = -1;
+
+  pctx = EVP_PKEY_CTX_new_id(EVP_PKEY_EC, NULL);
+  if (!pctx || EVP_PKEY_keygen_init(pctx) <= 0 ||
+      EVP_PKEY_CTX_set_ec_paramgen_curve_nid(pctx, NID_X9_62_prime256v1) <= 0 ||
+      EVP_PKEY_keygen(pctx, &pkey) <= 0)
+  {
+    EVP_PKEY_CTX_free(pctx);
+    return -1;
+  }
+  EVP_PKEY_CTX_free(pctx);
+
+  cert = X509_new();
+  ASN1_INTEGER_set(X509_get_serialNumber(cert), 1);
+  X509_gmtime_adj(X509_getm_notBefore(cert), 0);
+  X509_gmtime_adj(X509_getm_notAfter(cert), 365L * 24 * 60 * 60);
+  X509_set_pubkey(cert, pkey);
+  name = X509_get_subject_name(cert);
+  X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC, (const unsigned char *)"huesim", -1, -1, 0);
+  X509_set_issuer_name(cert, name);
+
+  if (X509_sign(cert, pkey, EVP_sha256()) > 0 &&
+      SSL_CTX_use_certificate(ssl_ctx, cert) == 1 &&
+      SSL_CTX_use_PrivateKey(ssl_ctx, pkey) == 1)
+    retval = 0;
+
+  X509_free(cert);
+  EVP_PKEY_free(pkey);
+  return retval;
+}
+
+/* Build the response to a REST request */
+static void rest_response(const char *method, const char *path, const char *body, char *out, int out_len)
+{
+  char user[128];
+  const char *resource;
+  int group;
+
+  /* Unauthenticated requests */
+  if (!strcmp(path, "/api/config") && !strcmp(method, "GET"))
+  {
+    snprintf(out, out_len, "{\"name\":\"HueSim\",\"datastoreversion\":\"1\",\"swversion\":\"1943185030\","
+             "\"apiversion\":\"1.43.0\",\"mac\":\"00:00:00:00:00:00\",\"bridgeid\":\"000000FFFE000000\","
+             "\"factorynew\":false,\"replacesbridgeid\":null,\"modelid\":\"BSB002\",\"starterkitid\":\"\"}");
+    return;
+  }
+
+  if ((!strcmp(path, "/api") || !strcmp(path, "/api/")) && !strcmp(method, "POST"))
+  {
+    /* As if the link button had been pressed */
+    snprintf(out, out_len, "[{\"success\":{\"username\":\"%s\",\"clientkey\":\"%s\"}}]", identity, psk_hex);
+    return;
+  }
+
+  if (sscanf(path, "/api/%127[^/]", user) != 1 || strcmp(user, identity))
+  {
+    snprintf(out, out_len, "[{\"error\":{\"type\":1,\"address\":\"%s\",\"description\":\"unauthorized user\"}}]", path);
+    return;
+  }
+  resource = path + strlen("/api/") + strlen(user);
+
+  if (!strcmp(resource, "/groups") && !strcmp(method, "GET"))
+  {
+    int pos = snprintf(out, out_len, "{\"1\":{\"name\":\"HueSim area\",\"type\":\"Entertainment\",\"lights\":[");
+    for (int n = 0; n < light_count && pos < out_len; n++)
+      pos += snprintf(out + pos, out_len - pos, "%s\"%d\"", n ? "," : "", n + 1);
+    if (pos < out_len)
+      snprintf(out + pos, out_len - pos, "],\"stream\":{\"proxymode\":\"auto\",\"active\":false}}}");
+    return;
+  }
+
+  if (sscanf(resource, "/groups/%d", &group) == 1 && !strcmp(method, "PUT"))
+  {
+    int active = body && strstr(body, "true") != NULL;
+    printf("Entertainment area %d streaming %s\n", group, active ? "activated" : "deactivated");
+    snprintf(out, out_len, "[{\"success\":{\"/groups/%d/stream/active\":%s}}]", group, active ? "true" : "false");
+    return;
+  }
+
+  if (!strcmp(resource, "/config") && !strcmp(method, "GET"))
+  {
+    snprintf(out, out_len, "{\"name\":\"HueSim\",\"apiversion\":\"1.43.0\",\"swversion\":\"1943185030\",\"whitelist\":{"
+             "\"%s\":{\"last use date\":\"2019-01-01T00:00:00\",\"create date\":\"2019-01-01T00:00:00\",\"name\":\"huesim#client\"}}}",
+             identity);
+    return;
+  }
+
+  if (!strncmp(resource, "/config/whitelist/", strlen("/config/whitelist/")) && !strcmp(method, "DELETE"))
+  {
+    snprintf(out, out_len, "[{\"success\":\"%s deleted\"}]", resource);
+    return;
+  }
+
+  snprintf(out, out_len, "[{\"error\":{\"type\":3,\"address\":\"%s\",\"description\":\"resource, %s, not available\"}}]",
+           resource, resource);
+}
+
+/* Read one HTTP request, and answer it */
+static void rest_request(SSL *ssl)
+{
+  char request[MAX_REQUEST_LEN];
+  char response[MAX_RESPONSE_LEN];
+  char header[256];
+  char method[16];
+  char path[256];
+  char *body = NULL;
+  int content_length = 0;
+  int received = 0;
+  int len;
+
+  /* Headers */
+  while (!body)
+  {
+    if (received >= (int)sizeof(request) - 1)
+      return;
+    len = SSL_read(ssl, request + received, sizeof(request) - 1 - received);
+    if (len <= 0)
+      return;
+    received += len;
+    request[received] = '\0';
+
+    if ((body = strstr(request, "\r\n\r\n")))
+      body += 4;
+  }
+
+  if (sscanf(request, "%15s %255s", method, path) != 2)
+    return;
+
+  for (char *line = strstr(request, "\r\n"); line && line + 2 < body; line = strstr(line + 2, "\r\n"))
+  {
+    if (!strncasecmp(line + 2, "Content-Length:", strlen("Content-Length:")))
+      content_length = atoi(line + 2 + strlen("Content-Length:"));
+
+    /* curl waits (up to a second) for this before sending a PUT/POST body */
+    if (!strncasecmp(line + 2, "Expect: 100-continue", strlen("Expect: 100-continue")))
+      SSL_write(ssl, "HTTP/1.1 100 Continue\r\n\r\n", strlen("HTTP/1.1 100 Continue\r\n\r\n"));
+  }
+
+  /* Body */
+  if (content_length > (int)sizeof(request) - 1 - (body - request))
+    return;
+  while ((request + received) - body < content_length)
+  {
+    len = SSL_read(ssl, request + received, sizeof(request) - 1 - received);
+    if (len <= 0)
+      return;
+    received += len;
+    request[received] = '\0';
+  }
+
+  if (verbose)
+    printf("REST: %s %s %s\n", method, path, body);
+
+  rest_response(method, path, body, response, sizeof(response));
+
+  len = snprintf(header, sizeof(header), "HTTP/1.1 200 OK\r\nContent-Type: application/json\r\n"
+                 "Content-Length: %d\r\nConnection: close\r\n\r\n", (int)strlen(response));
+  SSL_write(ssl, header, len);
+  SSL_write(ssl, response, strlen(response));
+}
+
+static void *rest_main(void *arg)
+{
+  int listen_fd = *(int *)arg;
+  SSL_CTX *ssl_ctx;
+
+  ssl_ctx = SSL_CTX_new(TLS_server_method());
+  if (!ssl_ctx || set_certificate(ssl_ctx))
+  {
+    printf("Failed to set up HTTPS\n");
+    SSL_CTX_free(ssl_ctx);
+    return NULL;
+  }
+
+  while (running)
+  {
+    struct timeval timeout = { 2, 0 };
+    SSL *ssl;
+    int fd;
+
+    if (!wait_readable(listen_fd, 500))
+      continue;
+
+    fd = accept(listen_fd, NULL, NULL);
+    if (fd < 0)
+      continue;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    ssl = SSL_new(ssl_ctx);
+    SSL_set_fd(ssl, fd);
+    if (SSL_accept(ssl) == 1)
+    {
+      rest_request(ssl);
+      SSL_shutdown(ssl);
+    }
+    SSL_free(ssl);
+    close(fd);
+  }
+
+  SSL_CTX_free(ssl_ctx);
+  return NULL;
+}
+
+int main (int argc, char **argv)
+{
+  const char *log_filename = NULL;
+  int dtls_port = DTLS_PORT;
+  int rest_port = SSL_PORT;
+  int rest_fd = -1;
+  pthread_t rest_thread;
+  uint64_t start_us;
+  SSL_CTX *ssl_ctx;
+  int c;
+
+  while ((c = getopt (argc, argv, "i:p:n:P:r:l:vh")) != -1)
+  {
+    switch (c)
+      {
+      case 'i': /* Identity */
+        identity = optarg;
+        break;
+
+      case 'p': /* Pre-shared key */
+        psk_hex = optarg;
+        break;
+
+      case 'n': /* Light count */
+        light_count = atoi(optarg);
+        break;
+
+      case 'P': /* DTLS port */
+        dtls_port = atoi(optarg);
+        break;
+
+      case 'r': /* REST port */
+        rest_port = atoi(optarg);
+        break;
+
+      case 'l': /* Log file */
+        log_filename = optarg;
+        break;
+
+      case 'v':
+        verbose = 1;
+        break;
+
+      case 'h':
+        print_usage(argv[0]);
+        exit(0);
+        break;
+
+      default:
+        print_usage(argv[0]);
+        exit(-1);
+      }
+  }
+
+  if (!identity || !psk_hex)
+  {
+    printf("\nERROR: Identity and psk must be provided\n");
+    print_usage(argv[0]);
+    return -1;
+  }
+
+  psk_len = hex2bin(psk_hex, psk, sizeof(psk));
+  if (psk_len <= 0)
+  {
+    printf("\nERROR: psk must be a hex string of up to %d bytes\n", MAX_PSK_LEN);
+    return -1;
+  }
+
+  if (light_count < 1 || light_count > MAX_LIGHTS)
+  {
+    printf("\nERROR: Number of lights must be 1-%d\n", MAX_LIGHTS);
+    return -1;
+  }
+
+  if (log_filename)
+  {
+    log_file = fopen(log_filename, "w");
+    if (!log_file)
+    {
+      printf("Failed to open %s: %s\n", log_filename, strerror(errno));
+      return -1;
+    }
+    fprintf(log_file, "time_us,sequence,id,r,g,b\n");
+  }
+
+  signal(SIGINT, stop);
+  signal(SIGTERM, stop);
+  signal(SIGPIPE, SIG_IGN);
+
+  if (rest_port)
+  {
+    rest_fd = open_socket(SOCK_STREAM, rest_port);
+    if (rest_fd < 0 || listen(rest_fd, 8))
+      return -1;
+    pthread_create(&rest_thread, NULL, rest_main, &rest_fd);
+    printf("Answering REST requests on port %d\n", rest_port);
+  }
+
+  ssl_ctx = SSL_CTX_new(DTLS_server_method());
+  SSL_CTX_set_min_proto_version(ssl_ctx, DTLS1_2_VERSION);
+  SSL_CTX_set_cipher_list(ssl_ctx, "PSK-AES128-GCM-SHA256");
+  SSL_CTX_set_psk_server_callback(ssl_ctx, psk_server_cb);
+
+  start_us = monotonic_us();
+  serve_dtls(ssl_ctx, dtls_port);
+
+  print_stats("Total", &total_stats, (monotonic_us() - start_us) / 1000000.0);
+  printf("%llu session(s)\n", (unsigned long long)total_stats.sessions);
+
+  if (rest_port)
+  {
+    pthread_join(rest_thread, NULL);
+    close(rest_fd);
+  }
+  SSL_CTX_free(ssl_ctx);
+  if (log_file)
+    fclose(log_file);
+
+  return 0;
+}
@@ -264,6 +264,20 @@ int get_audio_input(config_t *cfg, struct audio_input **ai)
   return -1;
 }
 
+void set_topology_cache(config_t *cfg, struct hue_rest_ctx *ctx_hr)
+{
+  config_setting_t *cfg_root;
+  const char *cache_file = NULL;
+  int offline_start = 0;
+
+  cfg_root = config_root_setting(cfg);
+  config_setting_lookup_string(cfg_root, "topology_cache", &cache_file);
+  config_setting_lookup_int(cfg_root, "offline_start", &offline_start);
+
+  if (cache_file && strlen(cache_file))
+    hue_rest_set_cache(ctx_hr, cache_file, (offline_start ? HUE_REST_CACHE_TRUST : HUE_REST_CACHE_VALIDATE));
+}
+
 int main (int argc, char **argv)
 {
   struct audio_input *ai;
@@ -349,6 +363,7 @@ int main (int argc, char **argv)
 
   hue_rest_init();
   hue_rest_init_ctx(&ctx_hr, NULL, connection_ip, SSL_PORT, connection_username, HUE_MSG_ERR);
+  set_topology_cache(&cfg_config, &ctx_hr);
 
   printf("Getting entertainment areas\n");
   hue_rest_get_ent_groups(&ctx_hr, &ent_areas, &ent_areas_count);
@@ -381,6 +396,14 @@ int main (int argc, char **argv)
     return -2;
   }
 
+  /* A v1 stream message can only address HUE_ENT_MAX_LIGHTS_V1 lights; control the first ones */
+  if (light_count > HUE_ENT_MAX_LIGHTS_V1)
+  {
+    printf("Entertainment area [%s] has %d lights; only the first %d will be controlled.\n",
+           ent_areas->area_name, light_count, HUE_ENT_MAX_LIGHTS_V1);
+    light_count = HUE_ENT_MAX_LIGHTS_V1;
+  }
+
   /* Activate the entertainment area */
   printf("Enabling entertainment area [%s]\n", ent_areas->area_name);
   hue_rest_activate_stream(&ctx_hr, ent_areas->area_id);
@@ -388,7 +411,14 @@ int main (int argc, char **argv)
   /* Big assumption: light IDs are in an order that makes sense (e.g. left to right). 
    * This probably isn't the case. TODO: the brige does provide x/y position information
    * for the bulbs, so should use that to figure out a better order */
-  hue_ent_init(&ctx_ent, light_count);
+  if (hue_ent_init(&ctx_ent, light_count))
+  {
+    printf("Failed to initialise entertainment context\n");
+    config_destroy(&cfg_config);
+    hue_rest_cleanup_ctx(&ctx_hr);
+    hue_rest_cleanup();
+    return -1;
+  }
   for (int n = 0; n < light_count; n++)
     hue_ent_set_light_id(&ctx_ent, n, ent_areas->light_ids[n]);
 
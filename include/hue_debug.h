@@ -1,8 +1,86 @@
 #pragma once
 
+#include <stdarg.h>
+#include <stdint.h>
+
 typedef void (*hue_debug_cb_t)(const char *message, void *user_data);
 
 #define HUE_MSG_DEBUG  3
 #define HUE_MSG_INFO   2
 #define HUE_MSG_ERR    1
 #define HUE_MSG_OFF    0
+
+/* Most verbose level compiled in; messages above it are removed at compile time, whatever the
+ * run time debug_level. Set with -DHUE_DEBUG_MAX_LEVEL=n (cmake -DHUE_DEBUG_MAX_LEVEL=n) */
+#ifndef HUE_DEBUG_MAX_LEVEL
+#define HUE_DEBUG_MAX_LEVEL HUE_MSG_DEBUG
+#endif
+
+/* True if a message at level should be logged, given the run time debug_level. Used to guard
+ * each debug call, so messages that won't be logged cost a compare, and their arguments aren't
+ * evaluated */
+#define HUE_DEBUG_ENABLED(debug_level, level) ((level) <= HUE_DEBUG_MAX_LEVEL && (debug_level) >= (level))
+
+/* Call fn(obj, fmt, ...) if a message at level would be logged, given obj->debug_level. Each hue_* object's
+ * debug macro is defined with this */
+#define HUE_DEBUG_CALL(fn, obj, level, ...) \
+  do { if (HUE_DEBUG_ENABLED((obj)->debug_level, level)) fn(obj, __VA_ARGS__); } while (0)
+
+#define HUE_DEBUG_ASYNC_DEFAULT_SLOTS 1024
+#define HUE_DEBUG_ASYNC_MSG_LEN       512 /* longer messages are truncated */
+
+struct hue_debug_async_stats
+{
+  uint64_t queued;
+  uint64_t dropped;  /* ring was full */
+};
+
+/* Function: hue_debug_async_start
+
+   Send debug messages from all hue_* objects via a lock-free ring buffer, drained by a background thread
+   into each object's debug callback (or STDOUT), instead of calling the callback on the thread that logged
+   the message. Formatting still happens on the calling thread, but nothing blocks, so DEBUG logging can be
+   left on without disturbing frame timing. If the ring is full, messages are dropped (and counted).
+
+   Parameters:
+
+      slots - number of messages the ring can hold (rounded up to a power of 2), or 0 for
+              HUE_DEBUG_ASYNC_DEFAULT_SLOTS
+
+   Returns:
+
+      0 on success, non-zero otherwise
+*/
+int  hue_debug_async_start(int slots);
+
+/* Function: hue_debug_async_stop
+
+   Deliver any queued messages, stop the background thread, and go back to calling debug callbacks directly.
+   Don't log from other threads while this is running.
+*/
+void hue_debug_async_stop(void);
+
+/* Function: hue_debug_async_get_stats
+
+   Get counts of messages queued and dropped since <hue_debug_async_start>.
+
+   Parameters:
+
+      out_stats - (output) statistics
+*/
+void hue_debug_async_get_stats(struct hue_debug_async_stats *out_stats);
+
+/* Function: hue_debug_vmessage
+
+   Deliver a debug message to callback (or, if NULL, STDOUT with prefix), directly or via the ring buffer
+   if <hue_debug_async_start> has been called. Used by the hue_* objects' debug functions.
+
+   Parameters:
+
+      callback - debug callback, or NULL for STDOUT
+      user_data - passed to callback
+      prefix - prefix for STDOUT, e.g. "[dtls] "
+      fmt - printf format
+      args - arguments for fmt
+*/
+void hue_debug_vmessage(hue_debug_cb_t callback, void *user_data, const char *prefix, const char *fmt, va_list args);
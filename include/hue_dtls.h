@@ -2,6 +2,7 @@
 
 #include <stdio.h>
 #include <stdint.h>
+#include <stdatomic.h>
 
 #include <sys/types.h>
 #include <sys/socket.h>
@@ -23,21 +24,169 @@
 #include "hue_debug.h"
 
 #define HUE_DTLS_MAX_PAYLOAD_SIZE 1350
-#define HUE_DTLS_STATE_INIT      10
-#define HUE_DTLS_STATE_CONNECTED 20
-#define HUE_DTLS_STATE_CLEANEDUP 30
+#define HUE_DTLS_STATE_INIT       10
+#define HUE_DTLS_STATE_CONNECTING 15
+#define HUE_DTLS_STATE_CONNECTED  20
+#define HUE_DTLS_STATE_CLOSED     25 /* closed by the bridge */
+#define HUE_DTLS_STATE_CLEANEDUP  30
+
+/* Non-blocking connect status */
+#define HUE_DTLS_CONNECT_DONE       0
+#define HUE_DTLS_CONNECT_WANT_READ  1
+#define HUE_DTLS_CONNECT_WANT_WRITE 2
+
+/* hue_dtls_poll status */
+#define HUE_DTLS_POLL_OK     0
+#define HUE_DTLS_POLL_CLOSED 1
+
+/* DiffServ code point for Expedited Forwarding; Wi-Fi (WMM) maps it to the voice access category */
+#define HUE_DTLS_DSCP_EF 46
+
+#define HUE_DTLS_DEFAULT_CONNECT_TIMEOUT_MS 5000
+#define HUE_DTLS_MAX_PSK_LEN 64
+
+struct hue_dtls_handshake_stats
+{
+  uint64_t full_handshakes;
+  uint64_t resumed_handshakes;
+  uint64_t last_handshake_us;
+  uint64_t avg_full_us;
+  uint64_t avg_resumed_us;
+  uint64_t time_saved_us;    /* estimated total, from the difference between the averages */
+};
+
+/* Counters are written by the connecting / sending thread only, and read from any thread */
+struct hue_dtls_handshake_counters
+{
+  atomic_ullong full_handshakes;
+  atomic_ullong full_total_us;
+  atomic_ullong resumed_handshakes;
+  atomic_ullong resumed_total_us;
+  atomic_ullong last_handshake_us;
+};
+
+/* Log-linear histogram: values below 2^HUE_DTLS_HISTOGRAM_SUB_BITS have a bucket each, then each power of 2
+ * is split into 2^HUE_DTLS_HISTOGRAM_SUB_BITS buckets, so a bucket is within 12.5% of its values. Values of
+ * 2^HUE_DTLS_HISTOGRAM_MAX_BITS ns (about 68s) and over go in the last bucket */
+#define HUE_DTLS_HISTOGRAM_SUB_BITS 3
+#define HUE_DTLS_HISTOGRAM_MAX_BITS 36
+#define HUE_DTLS_HISTOGRAM_BUCKETS  ((HUE_DTLS_HISTOGRAM_MAX_BITS - HUE_DTLS_HISTOGRAM_SUB_BITS + 1) << HUE_DTLS_HISTOGRAM_SUB_BITS)
+
+struct hue_dtls_histogram
+{
+  atomic_ullong count;
+  atomic_ullong sum;
+  atomic_ullong min;
+  atomic_ullong max;
+  atomic_uint buckets[HUE_DTLS_HISTOGRAM_BUCKETS];
+};
+
+/* Summary of a hue_dtls_histogram; all in ns. Percentiles are accurate to within 12.5% */
+struct hue_dtls_latency
+{
+  uint64_t count;
+  uint64_t min;
+  uint64_t mean;
+  uint64_t p50;
+  uint64_t p90;
+  uint64_t p99;
+  uint64_t p999;
+  uint64_t max;
+};
+
+struct hue_dtls_send_counters
+{
+  atomic_ullong frames_sent;
+  atomic_ullong bytes_sent;
+  atomic_ullong want_write;
+  atomic_ullong want_read;
+  atomic_ullong errors;
+  int64_t  last_send_ns;                 /* sending thread only */
+  struct hue_dtls_histogram write_ns;    /* time to encrypt and write each frame */
+  struct hue_dtls_histogram interval_ns; /* time between the starts of consecutive writes */
+};
+
+struct hue_dtls_stats
+{
+  uint64_t frames_sent;
+  uint64_t bytes_sent;
+  uint64_t want_write;  /* SSL_write wanted to write again */
+  uint64_t want_read;   /* SSL_write wanted to read first (e.g. renegotiation) */
+  uint64_t errors;
+  struct hue_dtls_latency write;     /* high with a steady interval suggests CPU stalls */
+  struct hue_dtls_latency interval;  /* jitter here, with fast writes, points at the sending thread/network */
+  struct hue_dtls_handshake_stats handshake;
+};
+
+/* Socket options for a lower latency path to the bridge. See <hue_dtls_socket_options_init> */
+struct hue_dtls_socket_options
+{
+  int dscp;           /* DiffServ code point (0-63) to mark packets with (IP_TOS), e.g. HUE_DTLS_DSCP_EF; -1 to leave alone */
+  int priority;       /* SO_PRIORITY (0-6; Linux only), picking the queue in the kernel / driver; -1 to leave alone */
+  int sndbuf;         /* SO_SNDBUF in bytes; 0 to leave alone. A small buffer stops stale frames queueing up */
+  int txtime_lead_us; /* SO_TXTIME (Linux only, fq qdisc); stream groups send each batch to launch at exactly this
+                       * long after its tick, taking out the sender thread's wake up jitter. 0 for off */
+};
+
+struct hue_dtls_ctx;
+
+/* Transport under hue_dtls_send_data; one of hue_dtls_transport_dtls (the default),
+ * hue_dtls_transport_udp or hue_dtls_transport_memory. See <hue_dtls_set_transport> */
+struct hue_dtls_transport
+{
+  const char *name;
+  int  (*connect_start)(struct hue_dtls_ctx *ctx);
+  int  (*connect_continue)(struct hue_dtls_ctx *ctx);  /* NULL if connect_start always completes */
+  int  (*send)(struct hue_dtls_ctx *ctx, void *buf, int length);     /* 0 sent, 1 try again later, -1 error */
+  int  (*poll)(struct hue_dtls_ctx *ctx);
+  int  (*set_write_buffered)(struct hue_dtls_ctx *ctx); /* NULL if not supported */
+  int  (*write_record)(struct hue_dtls_ctx *ctx, void *buf, int length, const void **out_record, int *out_record_len);
+  void (*close)(struct hue_dtls_ctx *ctx);
+};
+
+extern const struct hue_dtls_transport hue_dtls_transport_dtls;   /* DTLS 1.2 PSK, as the bridge expects */
+extern const struct hue_dtls_transport hue_dtls_transport_udp;    /* plaintext UDP to the same address */
+extern const struct hue_dtls_transport hue_dtls_transport_memory; /* no network; records what's sent */
+
+typedef void (*hue_dtls_sink_cb_t)(const void *buf, int length, void *user_data);
+
+/* What the memory transport has been sent */
+struct hue_dtls_sink
+{
+  hue_dtls_sink_cb_t callback;
+  void *user_data;
+  uint64_t frames;
+  uint64_t bytes;
+  unsigned char last[HUE_DTLS_MAX_PAYLOAD_SIZE];
+  int  last_len;
+};
 
 struct hue_dtls_ctx
 {
-  SSL_CTX *ssl_ctx;
+  const struct hue_dtls_transport *transport;
+  SSL_CTX *ssl_ctx; /* shared by all hue_dtls_ctx objects */
   SSL  *ssl;
   BIO  *bio;
+  BIO  *wbio;      /* memory BIO holding the last record, after hue_dtls_set_write_buffered */
+  int  write_buffered;
   struct sockaddr_in remote_addr;
   struct sockaddr_in local_addr;
   int  port;
   int  fd;
+  int  local_port; /* port to bind before connecting, shared with other sockets; 0 for any */
+  int  connect_timeout_ms;
+  int64_t connect_deadline_ms; /* CLOCK_MONOTONIC; 0 for no overall timeout */
+  int64_t handshake_start_us;
+  SSL_SESSION *session;        /* from the last successful connect, offered for resumption on the next */
+  struct sockaddr_in session_addr;
+  int  session_offered;
+  struct hue_dtls_handshake_counters handshake_stats;
+  struct hue_dtls_send_counters send_stats;
+  struct hue_dtls_sink sink;
+  struct hue_dtls_socket_options socket_options;
   char *psk_identity;
-  char *psk_key;
+  unsigned char psk[HUE_DTLS_MAX_PSK_LEN]; /* binary key */
+  int  psk_len;
   int  state;
   void *user_data;
   int  debug_level;
@@ -46,13 +195,15 @@ struct hue_dtls_ctx
 
 /* Function: hue_dtls_init
 
-   Initialise a new hue_dtls_ctx object. Be sure to call dtls_cleanup when finished with ctx.
+   Initialise a new hue_dtls_ctx object. Be sure to call dtls_cleanup when finished with ctx. All hue_dtls_ctx
+   objects in the process share one SSL_CTX, which is created on first use and freed when the last one is
+   cleaned up.
 
    Parameters:
 
       ctx - hue_dtls_ctx object to initialise
       psk_identity - Pre-shared key identity for the session
-      psk_key - Pre-shared key for the session
+      psk_key - Pre-shared key for the session, as a hex string (up to HUE_DTLS_MAX_PSK_LEN bytes once decoded)
       debug_callback - (optional) debug callback to receive debug messages. Set to NULL to print to STDOUT.
       debug_level - about of debugging output to generate. One of: MSG_OFF, MSG_ERR, MSG_INFO or MSG_DEBUG.
 
@@ -62,9 +213,95 @@ struct hue_dtls_ctx
 */
 int  hue_dtls_init(struct hue_dtls_ctx *ctx, const char *psk_identity, const char *psk_key, hue_debug_cb_t debug_callback, int debug_level);
 
+/* Function: hue_dtls_set_transport
+
+   Choose what hue_dtls_send_data sends over, before connecting. hue_dtls_transport_udp sends the same
+   messages unencrypted to the same address and port (e.g. to a simulator, or to measure the cost of the
+   crypto); hue_dtls_transport_memory sends nothing, recording messages in ctx->sink instead (see
+   <hue_dtls_set_sink_callback>), so streaming can be tested without a bridge. For a hue_stream, call this on
+   the stream's dtls member before <hue_stream_start>.
+
+   Parameters:
+
+      ctx - Initialised (unconnected) hue_dtls_ctx object
+      transport - hue_dtls_transport_dtls, hue_dtls_transport_udp or hue_dtls_transport_memory
+
+   Returns:
+
+      0 on success, non-zero otherwise
+*/
+int  hue_dtls_set_transport(struct hue_dtls_ctx *ctx, const struct hue_dtls_transport *transport);
+
+/* Function: hue_dtls_set_sink_callback
+
+   Set a callback to receive each message sent over hue_dtls_transport_memory. It's called on the sending
+   thread, so should be quick.
+
+   Parameters:
+
+      ctx - Initialised hue_dtls_ctx object
+      callback - callback, or NULL for none
+      user_data - passed to the callback
+*/
+void hue_dtls_set_sink_callback(struct hue_dtls_ctx *ctx, hue_dtls_sink_cb_t callback, void *user_data);
+
+/* Function: hue_dtls_socket_options_init
+
+   Initialise socket options to leave everything at the system defaults.
+
+   Parameters:
+
+      options - options to initialise
+*/
+void hue_dtls_socket_options_init(struct hue_dtls_socket_options *options);
+
+/* Function: hue_dtls_socket_options_apply
+
+   Apply socket options to a UDP socket, e.g. one sending for several sessions (see <hue_dtls_bind_shared>).
+
+   Parameters:
+
+      options - options to apply
+      fd - UDP socket
+
+   Returns:
+
+      0 on success, or -1 (with errno set) if an option couldn't be set
+*/
+int  hue_dtls_socket_options_apply(const struct hue_dtls_socket_options *options, int fd);
+
+/* Function: hue_dtls_set_socket_options
+
+   Set the options for the connection's socket: applied now if connected, otherwise when the socket is
+   created. txtime_lead_us is ignored, as each datagram sent would need a launch time; it only applies to
+   stream groups (see <hue_stream_group_set_socket_options>).
+
+   Parameters:
+
+      ctx - Initialised hue_dtls_ctx object
+      options - socket options
+
+   Returns:
+
+      0 on success, non-zero otherwise
+*/
+int  hue_dtls_set_socket_options(struct hue_dtls_ctx *ctx, const struct hue_dtls_socket_options *options);
+
+/* Function: hue_dtls_set_connect_timeout
+
+   Set the overall time allowed for the handshake, after which connecting fails. Retransmissions of lost
+   handshake messages happen within this time. Default is HUE_DTLS_DEFAULT_CONNECT_TIMEOUT_MS.
+
+   Parameters:
+
+      ctx - Initialised hue_dtls_ctx object
+      timeout_ms - timeout in ms, or 0 for none
+*/
+void hue_dtls_set_connect_timeout(struct hue_dtls_ctx *ctx, int timeout_ms);
+
 /* Function: hue_dtls_connect
 
-   Start dtls connection
+   Start dtls connection, and wait until the handshake completes or times out (see <hue_dtls_set_connect_timeout>)
 
    Parameters:
 
@@ -78,6 +315,162 @@ int  hue_dtls_init(struct hue_dtls_ctx *ctx, const char *psk_identity, const cha
 */
 int  hue_dtls_connect(struct hue_dtls_ctx *ctx, const char *address, int port);
 
+/* Function: hue_dtls_bind_shared
+
+   Bind a UDP socket to a local port that other sockets can bind too. A connected socket on the port only
+   receives datagrams from its own peer, so several sessions (to different bridges) can each read their own
+   socket, while an unconnected socket on the same port sends for all of them, e.g. in one sendmmsg call
+   (see <hue_dtls_set_local_port>).
+
+   Parameters:
+
+      fd - UDP socket, not yet bound
+      port - local port, or 0 for any
+
+   Returns:
+
+      The bound port, or -1 (with errno set) on error
+*/
+int  hue_dtls_bind_shared(int fd, int port);
+
+/* Function: hue_dtls_set_local_port
+
+   Bind the connection's socket to a shared local port before connecting (see <hue_dtls_bind_shared>), so
+   datagrams sent on another socket bound to the port come from the same address as the session's own.
+   Takes effect from the next connect.
+
+   Parameters:
+
+      ctx - Initialised hue_dtls_ctx object
+      port - local port, or 0 for any (the default)
+*/
+void hue_dtls_set_local_port(struct hue_dtls_ctx *ctx, int port);
+
+/* Function: hue_dtls_connect_start
+
+   Start a dtls connection without blocking, so several handshakes can be run in parallel from an event loop.
+   While the returned status is HUE_DTLS_CONNECT_WANT_READ or HUE_DTLS_CONNECT_WANT_WRITE, wait for the socket
+   from <hue_dtls_get_fd> to become readable or writable (or for <hue_dtls_get_connect_timeout> to expire),
+   then call <hue_dtls_connect_continue>.
+
+   Parameters:
+
+      ctx - Initialised hue_dtls_ctx object
+      address - IP address to connect to
+      port - port number
+
+   Returns:
+
+      HUE_DTLS_CONNECT_DONE once connected, HUE_DTLS_CONNECT_WANT_READ or HUE_DTLS_CONNECT_WANT_WRITE if the
+      handshake is still in progress, or -1 if it failed
+*/
+int  hue_dtls_connect_start(struct hue_dtls_ctx *ctx, const char *address, int port);
+
+/* Function: hue_dtls_connect_continue
+
+   Continue a handshake started with <hue_dtls_connect_start>, retransmitting if the bridge hasn't answered
+   in time. Call when the socket is ready, or the timeout has expired. If the handshake fails or times out,
+   the ctx is returned to its initialised state, so the connection can be tried again.
+
+   Parameters:
+
+      ctx - hue_dtls_ctx object with a handshake in progress
+
+   Returns:
+
+      As <hue_dtls_connect_start>
+*/
+int  hue_dtls_connect_continue(struct hue_dtls_ctx *ctx);
+
+/* Function: hue_dtls_get_handshake_stats
+
+   Get handshake statistics. The session from each successful connect is kept, and offered to the same bridge
+   on the next connect; if the bridge resumes it, the handshake takes one round trip less. If it doesn't, a full
+   handshake is done as normal.
+
+   Parameters:
+
+      ctx - hue_dtls_ctx object
+      out_stats - (output) statistics
+*/
+void hue_dtls_get_handshake_stats(struct hue_dtls_ctx *ctx, struct hue_dtls_handshake_stats *out_stats);
+
+/* Function: hue_dtls_get_stats
+
+   Get send statistics: counts, and the distribution of how long each write (including encryption) took and
+   of the interval between writes, along with the handshake statistics from <hue_dtls_get_handshake_stats>.
+   Buffered writes (see <hue_dtls_write_record>) are counted as sends. Counts accumulate over reconnects.
+   While another thread is sending, the figures may be slightly inconsistent with each other.
+
+   Parameters:
+
+      ctx - hue_dtls_ctx object
+      out_stats - (output) statistics
+*/
+void hue_dtls_get_stats(struct hue_dtls_ctx *ctx, struct hue_dtls_stats *out_stats);
+
+/* Function: hue_dtls_get_fd
+
+   Get the socket used by the connection, e.g. to add to a poll/epoll set.
+
+   Parameters:
+
+      ctx - hue_dtls_ctx object
+
+   Returns:
+
+      socket, or -1 if not connected
+*/
+int  hue_dtls_get_fd(struct hue_dtls_ctx *ctx);
+
+/* Function: hue_dtls_get_connect_timeout
+
+   Get the time until <hue_dtls_connect_continue> must be called, even if the socket isn't ready: whichever
+   is sooner of the next retransmission and the overall handshake timeout.
+
+   Parameters:
+
+      ctx - hue_dtls_ctx object with a handshake in progress
+
+   Returns:
+
+      timeout in ms (suitable for passing to poll), or -1 for none
+*/
+int  hue_dtls_get_connect_timeout(struct hue_dtls_ctx *ctx);
+
+/* Function: hue_dtls_set_write_buffered
+
+   Stop sending records on the socket, and instead keep each one in memory for <hue_dtls_write_record> to
+   hand back, so the caller can send records for several sessions in one system call.
+
+   Parameters:
+
+      ctx - Connected hue_dtls_ctx object
+
+   Returns:
+
+      0 on success, non-zero otherwise
+*/
+int  hue_dtls_set_write_buffered(struct hue_dtls_ctx *ctx);
+
+/* Function: hue_dtls_write_record
+
+   Encrypt data into a single DTLS record, without sending it. Only valid after <hue_dtls_set_write_buffered>.
+
+   Parameters:
+
+      ctx - Connected hue_dtls_ctx object
+      buf - data to encrypt
+      length - length of data
+      out_record - (output) encrypted record; valid until the next call to this function (do *not* free this buffer)
+      out_record_len - (output) length of the record
+
+   Returns:
+
+      0 on success, non-zero otherwise
+*/
+int  hue_dtls_write_record(struct hue_dtls_ctx *ctx, void *buf, int length, const void **out_record, int *out_record_len);
+
 /* Function: hue_dtls_send_data
 
    Send data on connecion
@@ -94,6 +487,33 @@ int  hue_dtls_connect(struct hue_dtls_ctx *ctx, const char *address, int port);
 */
 int  hue_dtls_send_data(struct hue_dtls_ctx *ctx, void *buf, int length);
 
+/* Function: hue_dtls_poll
+
+   Without blocking, handle anything received from the bridge, and check for socket errors. UDP writes keep
+   "succeeding" after the bridge has gone, so call this regularly (e.g. before each send) to find out straight
+   away if the bridge has closed the session (close notify or fatal alert), or the socket has had an error
+   (e.g. ICMP port unreachable).
+
+   Parameters:
+
+      ctx - Connected hue_dtls_ctx object
+
+   Returns:
+
+      HUE_DTLS_POLL_OK if the connection is fine, HUE_DTLS_POLL_CLOSED if the bridge has closed it, or -1 on error
+*/
+int  hue_dtls_poll(struct hue_dtls_ctx *ctx);
+
+/* Function: hue_dtls_disconnect
+
+   Close the connection (or abandon a handshake in progress), keeping the PSK so the ctx can be connected again.
+
+   Parameters:
+
+      ctx - hue_dtls_ctx object
+*/
+void hue_dtls_disconnect(struct hue_dtls_ctx *ctx);
+
 /* Function: hue_dtls_cleanup
 
    Disconnect if connected, and free any memory associated with dtls context.
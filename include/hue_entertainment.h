@@ -3,15 +3,50 @@
 #include <stdint.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stdatomic.h>
 #include <arpa/inet.h> /* for htons */
 
+#define HUE_ENT_COLOUR_SPACE_RGB 0x00
+#define HUE_ENT_COLOUR_SPACE_XY  0x01
+
+#define HUE_ENT_VERSION_1 1
+#define HUE_ENT_VERSION_2 2
+
+#define HUE_ENT_MAX_LIGHTS_V1   10
+#define HUE_ENT_MAX_CHANNELS_V2 20
+#define HUE_ENT_CONFIG_ID_LEN   36 /* Entertainment configuration UUID, e.g. "1a8d99cc-967b-44f2-9202-43f976c0fa6b" */
+
+/* Transfer curves for input values */
+#define HUE_ENT_CURVE_LINEAR  0
+#define HUE_ENT_CURVE_SRGB    1
+#define HUE_ENT_CURVE_GAMMA22 2
+#define HUE_ENT_CURVE_COUNT   3
+
+/* Colour gamuts of the various hue bulbs */
+#define HUE_ENT_GAMUT_A 0
+#define HUE_ENT_GAMUT_B 1
+#define HUE_ENT_GAMUT_C 2
+
+struct hue_ent_message_colour
+{
+  uint16_t  R;  /* x in XY Brightness mode */
+  uint16_t  G;  /* y in XY Brightness mode */
+  uint16_t  B;  /* brightness in XY Brightness mode */
+} __attribute__((packed));
+
+/* Light record - HueStream v1 */
 struct hue_ent_message_data
 {
   uint8_t   type;
   uint16_t  id;
-  uint16_t  R;
-  uint16_t  G;
-  uint16_t  B;
+  struct hue_ent_message_colour colour;
+} __attribute__((packed));
+
+/* Channel record - HueStream v2 */
+struct hue_ent_message_data_v2
+{
+  uint8_t   channel_id;
+  struct hue_ent_message_colour colour;
 } __attribute__((packed));
 
 
@@ -20,21 +55,75 @@ struct hue_ent_message_header
   char protocol_name[9];
   uint8_t version_major;
   uint8_t version_minor;
-  uint8_t sequence_number; /* not used */
+  uint8_t sequence_number; /* incremented for every message */
   uint8_t reserved1[2];
   uint8_t colour_space;    /* 0x00 = RGB; 0x01 = XY Brightness */
   uint8_t reserved2[1];
 } __attribute__((packed));
 
+/* Metadata for a frame (one set of light values) */
+struct hue_ent_frame_info
+{
+  uint8_t sequence;       /* sequence number of the latest message for the frame */
+  uint64_t created_us;    /* CLOCK_MONOTONIC time of the first change in the frame (0 if unknown) */
+  int lights_changed;     /* number of lights changed from the previous frame */
+  int send_attempts;      /* number of messages generated for the frame */
+};
+
 struct hue_ent_ctx
 {
+  int version;            /* HUE_ENT_VERSION_1 or HUE_ENT_VERSION_2 */
   int light_count;
-  struct hue_ent_message_header header;
-  struct hue_ent_message_data   *data;
+  struct hue_ent_message_header *header; /* points into msg_buf */
+  uint8_t *lights;        /* points into msg_buf; first light (v1) or channel (v2) record */
+  int light_size;         /* size of each record in lights */
+  int colour_offset;      /* offset of the struct hue_ent_message_colour in each record */
   int buf_size;
   void *msg_buf;
+  uint8_t *light_changed; /* per light; non-zero if light has changed since the last hue_ent_get_message */
+  int changed;            /* non-zero if any light has changed since the last hue_ent_get_message */
+  uint8_t sequence;       /* sequence number of the last message */
+  struct hue_ent_frame_info pending; /* frame being built by the set functions */
+  struct hue_ent_frame_info frame;   /* frame returned by the last hue_ent_get_message */
+  int colour_space;       /* HUE_ENT_COLOUR_SPACE_RGB or HUE_ENT_COLOUR_SPACE_XY */
+  float *xy_planes;       /* XY mode only: planar R/G/B input, gamut triangles and x/y/brightness output, one entry per light */
+  const uint16_t *curve_lut8;  /* input transfer curve for 8-bit values, or NULL for linear */
+  const uint16_t *curve_lut16; /* input transfer curve for 16-bit values, or NULL for linear */
+  struct hue_ent_fade *fades; /* per light; allocated on first use of hue_ent_fade_light */
+  int fades_active;       /* number of lights currently fading */
+};
+
+struct hue_ent_fade
+{
+  uint16_t from[3];
+  uint16_t to[3];
+  uint64_t start_us;
+  uint64_t end_us;
+  int active;
+};
+
+struct hue_ent_frame_light
+{
+  uint16_t R;
+  uint16_t G;
+  uint16_t B;
+  uint16_t fade_ms; /* 0 to set the light immediately, otherwise time taken to fade from the current value to R/G/B */
 };
 
+/* Triple (or more) buffered frames for handing light values from producer thread(s) to a sender thread */
+struct hue_ent_frame_buffer
+{
+  int light_count;
+  int producer_count;
+  struct hue_ent_frame_light *frames; /* (producer_count * 2) + 2 frames, light_count lights each */
+  uint64_t *frame_us;                 /* per frame; CLOCK_MONOTONIC time of the first change in the frame */
+  int *back;                          /* per producer; frame that will be published next */
+  int front;                          /* frame last picked up by the consumer */
+  atomic_uint latest;                 /* newest published frame, ORed with HUE_ENT_FRAME_FRESH if not yet picked up */
+};
+
+#define HUE_ENT_FRAME_FRESH 0x8000
+
 
 /* Function: hue_ent_init
 
@@ -43,7 +132,7 @@ struct hue_ent_ctx
    Parameters:
 
       ctx - Context to initialise
-      light_count - number of lights in entertainment area to be controlled
+      light_count - number of lights in entertainment area to be controlled (up to HUE_ENT_MAX_LIGHTS_V1)
 
    Returns:
 
@@ -51,9 +140,27 @@ struct hue_ent_ctx
 */
 int hue_ent_init(struct hue_ent_ctx *ctx, int light_count);
 
+/* Function: hue_ent_init_v2
+
+   Initialise hue entertainment context to generate HueStream v2 messages. Be sure to call hue_ent_cleanup when
+   finished with the context. Once initialised, the context is used in exactly the same way as a v1 context,
+   except that <hue_ent_set_light_id> sets the channel id. Channel ids default to 0..channel_count-1.
+
+   Parameters:
+
+      ctx - Context to initialise
+      ent_config_id - Entertainment configuration ID (36 character UUID)
+      channel_count - number of channels in the entertainment configuration (up to HUE_ENT_MAX_CHANNELS_V2)
+
+   Returns:
+
+      0 on success, non-zero otherwise
+*/
+int hue_ent_init_v2(struct hue_ent_ctx *ctx, const char *ent_config_id, int channel_count);
+
 /* Function: hue_ent_set_light_id
 
-   Set the light id (as known to the hue bridge) for each light
+   Set the light id (as known to the hue bridge) for each light. For v2 contexts, this is the channel id (0 - 255).
 
    Parameters:
 
@@ -67,9 +174,60 @@ int hue_ent_init(struct hue_ent_ctx *ctx, int light_count);
 */
 int hue_ent_set_light_id(struct hue_ent_ctx *ctx, int index, uint16_t hue_light_id);
 
+/* Function: hue_ent_set_colour_space
+
+   Select the colour space used for the message sent to the bridge. The default is HUE_ENT_COLOUR_SPACE_RGB.
+   In HUE_ENT_COLOUR_SPACE_XY mode, the R/G/B values passed to <hue_ent_set_light> are treated as linear RGB
+   and converted to gamut corrected XY + brightness for all lights in one pass by <hue_ent_get_message>.
+
+   Parameters:
+
+      ctx - hue_ent_ctx object
+      colour_space - HUE_ENT_COLOUR_SPACE_RGB or HUE_ENT_COLOUR_SPACE_XY
+
+   Returns:
+
+      0 on success, non-zero otherwise
+*/
+int hue_ent_set_colour_space(struct hue_ent_ctx *ctx, int colour_space);
+
+/* Function: hue_ent_set_light_gamut
+
+   Set the colour gamut of a light, used when converting to XY. Defaults to HUE_ENT_GAMUT_C.
+
+   Parameters:
+
+      ctx - hue_ent_ctx object
+      index - light index (0 to light_count passed to hue_ent_init)
+      gamut - HUE_ENT_GAMUT_A, HUE_ENT_GAMUT_B or HUE_ENT_GAMUT_C
+
+   Returns:
+
+      0 on success, non-zero otherwise
+*/
+int hue_ent_set_light_gamut(struct hue_ent_ctx *ctx, int index, int gamut);
+
+/* Function: hue_ent_set_input_curve
+
+   Select the transfer curve applied to all R/G/B values passed to the set functions, to convert them to linear
+   light. The curves are precomputed lookup tables (built once per process, the first time each curve is used),
+   so the conversion costs a single table lookup per value. The default is HUE_ENT_CURVE_LINEAR (no conversion).
+
+   Parameters:
+
+      ctx - hue_ent_ctx object
+      curve - HUE_ENT_CURVE_LINEAR, HUE_ENT_CURVE_SRGB or HUE_ENT_CURVE_GAMMA22
+
+   Returns:
+
+      0 on success, non-zero otherwise
+*/
+int hue_ent_set_input_curve(struct hue_ent_ctx *ctx, int curve);
+
 /* Function: hue_ent_set_light
 
-   Set light R/G/B values
+   Set light R/G/B values. The values are written directly into the message buffer (in RGB mode), and the
+   light is only flagged as changed if the new values differ from those already set.
 
    Parameters:
 
@@ -85,9 +243,136 @@ int hue_ent_set_light_id(struct hue_ent_ctx *ctx, int index, uint16_t hue_light_
 */
 int hue_ent_set_light(struct hue_ent_ctx *ctx, int index, uint16_t R, uint16_t G, uint16_t B);
 
+/* Function: hue_ent_set_light_8bit
+
+   As <hue_ent_set_light>, but with 8-bit R/G/B values (0 - 255), which are scaled to the full 0 - 65,535 range.
+
+   Parameters:
+
+      ctx - hue_ent_ctx object
+      index - light index (0 to light_count passed to hue_ent_init) to set
+      R - Red value   (0 - 255)
+      G - Green value (0 - 255)
+      B - Blue value  (0 - 255)
+
+   Returns:
+
+      0 on success, non-zero otherwise
+*/
+int hue_ent_set_light_8bit(struct hue_ent_ctx *ctx, int index, uint8_t R, uint8_t G, uint8_t B);
+
+/* Function: hue_ent_set_light_float
+
+   As <hue_ent_set_light>, but with floating point R/G/B values (0.0 - 1.0). Values outside of this range are clamped.
+
+   Parameters:
+
+      ctx - hue_ent_ctx object
+      index - light index (0 to light_count passed to hue_ent_init) to set
+      R - Red value   (0.0 - 1.0)
+      G - Green value (0.0 - 1.0)
+      B - Blue value  (0.0 - 1.0)
+
+   Returns:
+
+      0 on success, non-zero otherwise
+*/
+int hue_ent_set_light_float(struct hue_ent_ctx *ctx, int index, float R, float G, float B);
+
+/* Function: hue_ent_set_lights
+
+   Set R/G/B values for a range of lights in one go. Faster than calling <hue_ent_set_light> for each light, as
+   the values are converted to network byte order for all lights at once (using SSE2 or NEON where available).
+
+   Parameters:
+
+      ctx - hue_ent_ctx object
+      first - index of first light to set
+      count - number of lights to set
+      rgb - count * 3 values; R, G, B for each light in turn (0 - 65,535)
+
+   Returns:
+
+      0 on success, non-zero otherwise (e.g. if the range goes past the last light)
+*/
+int hue_ent_set_lights(struct hue_ent_ctx *ctx, int first, int count, const uint16_t *rgb);
+
+/* Function: hue_ent_set_lights_8bit
+
+   As <hue_ent_set_lights>, but with 8-bit R/G/B values (0 - 255), which are scaled to the full 0 - 65,535 range.
+
+   Parameters:
+
+      ctx - hue_ent_ctx object
+      first - index of first light to set
+      count - number of lights to set
+      rgb - count * 3 values; R, G, B for each light in turn (0 - 255)
+
+   Returns:
+
+      0 on success, non-zero otherwise
+*/
+int hue_ent_set_lights_8bit(struct hue_ent_ctx *ctx, int first, int count, const uint8_t *rgb);
+
+/* Function: hue_ent_set_lights_float
+
+   As <hue_ent_set_lights>, but with floating point R/G/B values (0.0 - 1.0). Values outside of this range are clamped.
+
+   Parameters:
+
+      ctx - hue_ent_ctx object
+      first - index of first light to set
+      count - number of lights to set
+      rgb - count * 3 values; R, G, B for each light in turn (0.0 - 1.0)
+
+   Returns:
+
+      0 on success, non-zero otherwise
+*/
+int hue_ent_set_lights_float(struct hue_ent_ctx *ctx, int first, int count, const float *rgb);
+
+/* Function: hue_ent_fade_light
+
+   Start fading a light from its current value to new R/G/B values. The intermediate values are set by
+   calling <hue_ent_update_fades> before each message is generated. Calling <hue_ent_set_light> on a light
+   cancels any fade in progress.
+
+   Parameters:
+
+      ctx - hue_ent_ctx object
+      index - light index (0 to light_count passed to hue_ent_init) to set
+      R - Target red value   (0 - 65,535)
+      G - Target green value (0 - 65,535)
+      B - Target blue value  (0 - 65,535)
+      now_us - current time in microseconds, from any monotonic clock (the same clock must be used for <hue_ent_update_fades>)
+      duration_ms - time to take to reach the target values. If 0, the light is set immediately.
+
+   Returns:
+
+      0 on success, non-zero otherwise
+*/
+int hue_ent_fade_light(struct hue_ent_ctx *ctx, int index, uint16_t R, uint16_t G, uint16_t B, uint64_t now_us, uint32_t duration_ms);
+
+/* Function: hue_ent_update_fades
+
+   Set the values of all lights that are fading, based on the current time.
+
+   Parameters:
+
+      ctx - hue_ent_ctx object
+      now_us - current time in microseconds, from the clock used for <hue_ent_fade_light>
+
+   Returns:
+
+      Number of lights still fading
+*/
+int hue_ent_update_fades(struct hue_ent_ctx *ctx, uint64_t now_us);
+
 /* Function: hue_ent_get_message
 
-   Generate message to be sent to the hue bridge
+   Get the message to be sent to the hue bridge. The message buffer is kept up to date by the set functions,
+   so no copying is done here; this just stamps the next sequence number, returns the buffer and clears the
+   changed flags.
 
    Parameters:
 
@@ -101,6 +386,50 @@ int hue_ent_set_light(struct hue_ent_ctx *ctx, int index, uint16_t R, uint16_t G
 */
 int hue_ent_get_message(struct hue_ent_ctx *ctx, void **out_msg_buf, int *out_buf_len);
 
+/* Function: hue_ent_is_changed
+
+   Check if anything has changed since the last call to <hue_ent_get_message>. Can be used to skip sending
+   identical frames - but note that the bridge will disable streaming if no message is received for 10 seconds,
+   so an unchanged frame should still be sent periodically.
+
+   Parameters:
+
+      ctx - hue_ent_ctx object
+
+   Returns:
+
+      non-zero if the frame has changed, 0 otherwise
+*/
+int hue_ent_is_changed(struct hue_ent_ctx *ctx);
+
+/* Function: hue_ent_is_light_changed
+
+   Check if a light has changed since the last call to <hue_ent_get_message>.
+
+   Parameters:
+
+      ctx - hue_ent_ctx object
+      index - light index (0 to light_count passed to hue_ent_init)
+
+   Returns:
+
+      non-zero if the light has changed, 0 if it hasn't (or index is invalid)
+*/
+int hue_ent_is_light_changed(struct hue_ent_ctx *ctx, int index);
+
+/* Function: hue_ent_get_frame_info
+
+   Get the metadata of the frame returned by the last call to <hue_ent_get_message>: its sequence number, when
+   it was first changed, how many lights changed and how many messages have been generated for it (resends
+   of an unchanged frame each get a new sequence number, but count as further attempts of the same frame).
+
+   Parameters:
+
+      ctx - hue_ent_ctx object
+      out_info - populated with the frame metadata
+*/
+void hue_ent_get_frame_info(struct hue_ent_ctx *ctx, struct hue_ent_frame_info *out_info);
+
 /* Function: hue_ent_cleanup
 
    Free any memory allocated when hue_ent_init was called.
@@ -110,3 +439,118 @@ int hue_ent_get_message(struct hue_ent_ctx *ctx, void **out_msg_buf, int *out_bu
       ctx - hue_ent_ctx object
 */
 void hue_ent_cleanup(struct hue_ent_ctx *ctx);
+
+/* Function: hue_ent_frame_buffer_init
+
+   Initialise a frame buffer, used to pass complete frames of light values from one or more producer threads
+   to the thread sending messages, without locking. Each producer fills its own frame, then publishes it
+   with a single atomic swap; the consumer always picks up the newest complete frame. If more than one producer
+   is used, each publishes complete frames, so the most recently published frame wins.
+   Be sure to call <hue_ent_frame_buffer_cleanup> when finished.
+
+   Parameters:
+
+      fb - hue_ent_frame_buffer object to initialise
+      light_count - number of lights in each frame
+      producer_count - number of threads that will be publishing frames
+
+   Returns:
+
+      0 on success, non-zero otherwise
+*/
+int hue_ent_frame_buffer_init(struct hue_ent_frame_buffer *fb, int light_count, int producer_count);
+
+/* Function: hue_ent_frame_buffer_back
+
+   Get the frame being filled by a producer. Only to be called from the producer's own thread. The frame
+   keeps its values after being published, so only the lights that change need to be set.
+
+   Parameters:
+
+      fb - hue_ent_frame_buffer object
+      producer - producer number (0 to producer_count-1)
+
+   Returns:
+
+      Pointer to light_count lights, or NULL if producer is invalid
+*/
+struct hue_ent_frame_light *hue_ent_frame_buffer_back(struct hue_ent_frame_buffer *fb, int producer);
+
+/* Function: hue_ent_frame_buffer_set_light
+
+   Set light R/G/B values in the frame being filled by a producer. Only to be called from the producer's own thread.
+
+   Parameters:
+
+      fb - hue_ent_frame_buffer object
+      producer - producer number (0 to producer_count-1)
+      index - light index (0 to light_count-1)
+      R - Red value   (0 - 65,535)
+      G - Green value (0 - 65,535)
+      B - Blue value  (0 - 65,535)
+
+   Returns:
+
+      0 on success, non-zero otherwise
+*/
+int hue_ent_frame_buffer_set_light(struct hue_ent_frame_buffer *fb, int producer, int index, uint16_t R, uint16_t G, uint16_t B);
+
+/* Function: hue_ent_frame_buffer_fade_light
+
+   Set target R/G/B values in the frame being filled by a producer, to be faded to over fade_ms once the frame
+   is applied (see <hue_ent_fade_light>). Only to be called from the producer's own thread.
+
+   Parameters:
+
+      fb - hue_ent_frame_buffer object
+      producer - producer number (0 to producer_count-1)
+      index - light index (0 to light_count-1)
+      R - Target red value   (0 - 65,535)
+      G - Target green value (0 - 65,535)
+      B - Target blue value  (0 - 65,535)
+      fade_ms - time to take to reach the target values
+
+   Returns:
+
+      0 on success, non-zero otherwise
+*/
+int hue_ent_frame_buffer_fade_light(struct hue_ent_frame_buffer *fb, int producer, int index, uint16_t R, uint16_t G, uint16_t B, uint16_t fade_ms);
+
+/* Function: hue_ent_frame_buffer_publish
+
+   Publish the frame being filled by a producer as the newest frame. Only to be called from the producer's own thread.
+
+   Parameters:
+
+      fb - hue_ent_frame_buffer object
+      producer - producer number (0 to producer_count-1)
+*/
+void hue_ent_frame_buffer_publish(struct hue_ent_frame_buffer *fb, int producer);
+
+/* Function: hue_ent_frame_buffer_apply
+
+   If a new frame has been published since the last call, pick it up and set the lights in ctx to match it.
+   Lights with a fade time start fading, unless they are already at (or fading to) the target values.
+   Only to be called from a single (consumer) thread.
+
+   Parameters:
+
+      fb - hue_ent_frame_buffer object
+      ctx - hue_ent_ctx object to update
+      now_us - current time in microseconds, used for fades (see <hue_ent_fade_light>)
+
+   Returns:
+
+      1 if a new frame was applied, 0 if there was no new frame
+*/
+int hue_ent_frame_buffer_apply(struct hue_ent_frame_buffer *fb, struct hue_ent_ctx *ctx, uint64_t now_us);
+
+/* Function: hue_ent_frame_buffer_cleanup
+
+   Free any memory allocated when hue_ent_frame_buffer_init was called.
+
+   Parameters:
+
+      fb - hue_ent_frame_buffer object
+*/
+void hue_ent_frame_buffer_cleanup(struct hue_ent_frame_buffer *fb);
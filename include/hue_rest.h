@@ -7,6 +7,8 @@
 #include "hue_rest.h"
 
 #include <curl/curl.h>
+#include <poll.h>
+#include <stdint.h>
 #include <unistd.h>
 #include <string.h>
 #include <stdlib.h>
@@ -16,7 +18,7 @@
 #define HUE_ENTERTAINMENT_API_NEEDED "1.22.0"
 
 #define AREA_NAME_LEN       33
-#define MAX_LIGHTS_PER_AREA 10
+#define MAX_LIGHTS_PER_AREA 20
 
 #define HUE_APP_NAME_SIZE 21
 #define HUE_DEVICE_NAME_SIZE 20
@@ -81,6 +83,39 @@ struct hue_whitelist_entry
   char *name;
 };
 
+/* Modes for <hue_rest_set_cache> */
+#define HUE_REST_CACHE_VALIDATE 0 /* check the cache against the bridge's datastoreversion */
+#define HUE_REST_CACHE_TRUST    1 /* offline start: use the cache without asking the bridge */
+
+struct hue_rest_arena_chunk;
+
+/* Parse results for one kind of request (e.g. the whitelist) are allocated from an arena, and released
+ * together when the next request of that kind is made, or by <hue_rest_cleanup_ctx>. The largest chunk
+ * is kept for reuse, so polling the bridge doesn't keep going back to the heap */
+struct hue_rest_arena
+{
+  struct hue_rest_arena_chunk *chunks; /* newest (and largest) first */
+};
+
+#define HUE_REST_MULTI_MAX_FDS 16
+
+/* Runs asynchronous requests (for any number of hue_rest_ctx objects) from the caller's event loop.
+ * See <hue_rest_multi_init> */
+struct hue_rest_multi
+{
+  CURLM *multi;
+  struct pollfd fds[HUE_REST_MULTI_MAX_FDS]; /* sockets curl is waiting on */
+  int fd_count;
+  int64_t timer_deadline_ms; /* CLOCK_MONOTONIC; -1 for none */
+  int requests;              /* in progress */
+  struct hue_rest_ctx *pending; /* contexts with requests in progress, linked by pending_next */
+};
+
+struct hue_rest_ctx;
+
+/* Called when an asynchronous request completes; result is as returned by the synchronous version */
+typedef void (*hue_rest_cb_t)(struct hue_rest_ctx *ctx, int result, void *user_data);
+
 struct hue_rest_ctx
 {
   hue_debug_cb_t debug_callback;
@@ -97,8 +132,19 @@ struct hue_rest_ctx
   size_t  received_data_length;
   CURL *curl;
   struct hue_entertainment_area *ent_areas;
+  int ent_areas_count;
+  struct hue_rest_arena ent_areas_arena;
+  struct hue_rest_multi *multi;  /* running this ctx's asynchronous request, if any */
+  int pending;                   /* which asynchronous request is in progress, or 0 */
+  struct hue_rest_ctx *pending_next;
+  hue_rest_cb_t callback;
+  void *callback_data;
   struct hue_whitelist_entry *whitelist;
   uint whitelist_count;
+  struct hue_rest_arena whitelist_arena;
+  char *cache_path;              /* topology cache, or NULL; see <hue_rest_set_cache> */
+  int cache_mode;
+  char *datastoreversion;        /* from the last /api/config response; used (once) to check the cache */
   char devicetype[HUE_APP_NAME_SIZE + 1 + HUE_DEVICE_NAME_SIZE];
 };
 
@@ -149,6 +195,112 @@ int hue_rest_init_ctx(struct hue_rest_ctx *ctx, hue_debug_cb_t debug_callback, c
 */
 void hue_rest_cleanup_ctx(struct hue_rest_ctx *ctx);
 
+/* Function: hue_rest_set_cache
+
+   Keep the bridge's entertainment areas (with their light IDs) and API version in a small file, so a warm start
+   doesn't have to fetch them. The file is keyed by the bridge's datastoreversion, which changes whenever the
+   bridge's configuration does, and is written after each successful <hue_rest_get_ent_groups> from the bridge.
+   The file is only readable by its owner, and holds a hash of the username rather than the username itself.
+
+   With HUE_REST_CACHE_VALIDATE, <hue_rest_get_ent_groups> makes one cheap request (the unauthenticated
+   /api/config) and only uses the cache if the datastoreversion matches; if <hue_rest_validate_apiversion> was
+   called just before, the datastoreversion it fetched is used, so no request is needed at all. With
+   HUE_REST_CACHE_TRUST ("offline start"), the cache is used without asking the bridge, by both
+   <hue_rest_get_ent_groups> and <hue_rest_validate_apiversion>, so the first request is
+   <hue_rest_activate_stream>; if the bridge has changed, that (or the DTLS connection) will fail.
+
+   The asynchronous calls don't use the cache.
+
+   Parameters:
+
+      ctx - hue_rest_ctx context
+      path - cache file, or NULL to stop using the cache. The directory must exist.
+      mode - HUE_REST_CACHE_VALIDATE or HUE_REST_CACHE_TRUST
+
+   Returns:
+
+      0 on success, non-zero otherwise
+*/
+int hue_rest_set_cache(struct hue_rest_ctx *ctx, const char *path, int mode);
+
+/* Function: hue_rest_multi_init
+
+   Initialise a hue_rest_multi object, to run asynchronous requests (e.g. <hue_rest_activate_stream_async>)
+   without blocking. Requests to several bridges (one hue_rest_ctx each) run concurrently; each hue_rest_ctx can
+   have one request in progress. Use <hue_rest_multi_fds> to find what to wait for, then call
+   <hue_rest_multi_process>; or just call <hue_rest_multi_wait>. Completion callbacks are called from
+   <hue_rest_multi_process>.
+
+   Parameters:
+
+      multi - object to initialise
+
+   Returns:
+
+      0 on success, non-zero otherwise
+*/
+int  hue_rest_multi_init(struct hue_rest_multi *multi);
+
+/* Function: hue_rest_multi_cleanup
+
+   Free a hue_rest_multi object. Any requests still in progress are cancelled, without calling their callbacks.
+
+   Parameters:
+
+      multi - hue_rest_multi object
+*/
+void hue_rest_multi_cleanup(struct hue_rest_multi *multi);
+
+/* Function: hue_rest_multi_fds
+
+   Get the sockets to wait on (e.g. with poll), and the longest time to wait before calling
+   <hue_rest_multi_process> regardless.
+
+   Parameters:
+
+      multi - hue_rest_multi object
+      out_fds - (output) sockets, with events set
+      max_fds - size of out_fds (HUE_REST_MULTI_MAX_FDS will always be enough)
+      out_timeout_ms - (output) timeout in ms, or -1 if there's nothing to wait for
+
+   Returns:
+
+      Number of sockets in out_fds
+*/
+int  hue_rest_multi_fds(struct hue_rest_multi *multi, struct pollfd *out_fds, int max_fds, int *out_timeout_ms);
+
+/* Function: hue_rest_multi_process
+
+   Handle sockets that are ready, and any timeouts, calling the callbacks of requests that have completed.
+
+   Parameters:
+
+      multi - hue_rest_multi object
+      fds - sockets from <hue_rest_multi_fds>, with revents set
+      count - number of sockets in fds
+
+   Returns:
+
+      Number of requests still in progress
+*/
+int  hue_rest_multi_process(struct hue_rest_multi *multi, const struct pollfd *fds, int count);
+
+/* Function: hue_rest_multi_wait
+
+   Wait up to timeout_ms for something to do, then process it (see <hue_rest_multi_process>), for callers
+   without an event loop. Use a timeout of 0 to poll.
+
+   Parameters:
+
+      multi - hue_rest_multi object
+      timeout_ms - longest time to wait
+
+   Returns:
+
+      Number of requests still in progress
+*/
+int  hue_rest_multi_wait(struct hue_rest_multi *multi, int timeout_ms);
+
 /* Function: hue_rest_activate_stream
 
    Instruct the brige to enable the streaming interface. Once enabled, a DTLS connection must be made
@@ -165,6 +317,25 @@ void hue_rest_cleanup_ctx(struct hue_rest_ctx *ctx);
 */
 int hue_rest_activate_stream(struct hue_rest_ctx *ctx, int group);
 
+/* Function: hue_rest_activate_stream_async
+
+   As <hue_rest_activate_stream>, but without blocking; callback is called from <hue_rest_multi_process> when
+   the request completes.
+
+   Parameters:
+
+      ctx - hue_rest_ctx context, with no request in progress
+      multi - hue_rest_multi object to run the request
+      group - Entertainment group ID to activate stream for
+      callback - completion callback
+      user_data - passed to callback
+
+   Returns:
+
+      0 if the request was started, non-zero otherwise (callback won't be called)
+*/
+int hue_rest_activate_stream_async(struct hue_rest_ctx *ctx, struct hue_rest_multi *multi, int group, hue_rest_cb_t callback, void *user_data);
+
 /* TODO */
 int hue_rest_delete_user(struct hue_rest_ctx *ctx, const char *username);
 
@@ -175,7 +346,7 @@ int hue_rest_delete_user(struct hue_rest_ctx *ctx, const char *username);
    Parameters:
 
       ctx - hue_rest_ctx context
-      out_areas - pointer to pointer of hue_entertainment_area's, which includes group id, area name and a list of light IDs (up to 10). The memory pointed to by out_areas will be free'd either by the next call to <hue_rest_get_ent_groups>, or by <hue_rest_cleanup_ctx>.
+      out_areas - pointer to pointer of hue_entertainment_area's, which includes group id, area name and a list of light IDs (up to MAX_LIGHTS_PER_AREA). The memory pointed to by out_areas is owned by ctx, and released either by the next call to <hue_rest_get_ent_groups>, or by <hue_rest_cleanup_ctx>; don't free it.
       out_areas_count - Number of hue_entertainment_area in out_areas list.
 
    Returns:
@@ -184,6 +355,24 @@ int hue_rest_delete_user(struct hue_rest_ctx *ctx, const char *username);
 */
 int hue_rest_get_ent_groups(struct hue_rest_ctx *ctx, struct hue_entertainment_area **out_areas, int *out_areas_count);
 
+/* Function: hue_rest_get_ent_groups_async
+
+   As <hue_rest_get_ent_groups>, but without blocking. On success, the groups are in ctx->ent_areas and
+   ctx->ent_areas_count when callback is called.
+
+   Parameters:
+
+      ctx - hue_rest_ctx context, with no request in progress
+      multi - hue_rest_multi object to run the request
+      callback - completion callback
+      user_data - passed to callback
+
+   Returns:
+
+      0 if the request was started, non-zero otherwise (callback won't be called)
+*/
+int hue_rest_get_ent_groups_async(struct hue_rest_ctx *ctx, struct hue_rest_multi *multi, hue_rest_cb_t callback, void *user_data);
+
 /* Function: hue_rest_get_whitelist
 
    Get a list of apps registered on the bridge.
@@ -191,7 +380,7 @@ int hue_rest_get_ent_groups(struct hue_rest_ctx *ctx, struct hue_entertainment_a
    Parameters:
 
       ctx - hue_rest_ctx context
-      out_whitelist_entries - pointer to pointer of hue_whitelist_entry's, which includes username, date created, last used and name. The memory pointed to by out_whitelist_entries will be free'd either by the next call to <hue_rest_get_whitelist>, or by <hue_rest_cleanup_ctx>.
+      out_whitelist_entries - pointer to pointer of hue_whitelist_entry's, which includes username, date created, last used and name. The memory pointed to by out_whitelist_entries (including the strings) is owned by ctx, and released either by the next call to <hue_rest_get_whitelist>, or by <hue_rest_cleanup_ctx>; don't free it.
       out_whitelist_count - Number of hue_whitelist_entry in out_whitelist_entries list.
 
    Returns:
@@ -219,6 +408,33 @@ int hue_rest_delete_user(struct hue_rest_ctx *ctx, const char *username);
 */
 int hue_rest_validate_apiversion(struct hue_rest_ctx *ctx);
 
+/* Function: hue_rest_validate_apiversion_async
+
+   As <hue_rest_validate_apiversion>, but without blocking.
+
+   Parameters:
+
+      ctx - hue_rest_ctx context, with no request in progress
+      multi - hue_rest_multi object to run the request
+      callback - completion callback
+      user_data - passed to callback
+
+   Returns:
+
+      0 if the request was started, non-zero otherwise (callback won't be called)
+*/
+int hue_rest_validate_apiversion_async(struct hue_rest_ctx *ctx, struct hue_rest_multi *multi, hue_rest_cb_t callback, void *user_data);
+
+/* Function: hue_rest_cancel
+
+   Cancel the ctx's asynchronous request, if any, without calling its callback.
+
+   Parameters:
+
+      ctx - hue_rest_ctx context
+*/
+void hue_rest_cancel(struct hue_rest_ctx *ctx);
+
 /* Function: hue_rest_register
 
    Create a new user on the bridge. The link button the on the bridge must be pressed within the last 30 seconds before calling this for it to succeed.
@@ -0,0 +1,433 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#include "hue_debug.h"
+#include "hue_dtls.h"
+#include "hue_entertainment.h"
+#include "hue_rest.h"
+
+#define HUE_STREAM_STATE_INIT      10
+#define HUE_STREAM_STATE_CONNECTED 20
+#define HUE_STREAM_STATE_RUNNING   30
+#define HUE_STREAM_STATE_RECOVERING 35
+#define HUE_STREAM_STATE_FAILED    40
+#define HUE_STREAM_STATE_STOPPED   50
+
+#define HUE_STREAM_DEFAULT_RESEND_MS 250
+#define HUE_STREAM_GROUP_MAX_STREAMS 16
+#define HUE_STREAM_RECOVERY_MIN_BACKOFF_MS 250
+#define HUE_STREAM_RECOVERY_MAX_BACKOFF_MS 8000
+
+struct hue_stream_stats
+{
+  uint64_t frames_sent;      /* messages sent to the bridge */
+  uint64_t frames_skipped;   /* ticks where nothing had changed, so nothing was sent */
+  uint64_t missed_deadlines; /* ticks missed because the sender thread woke up too late */
+  uint64_t max_lateness_us;  /* worst wake up time after a deadline */
+  uint64_t send_errors;
+  uint64_t last_latency_us;  /* time from the first change in the last new frame to it being sent */
+  uint64_t max_latency_us;   /* worst change to send time */
+  uint64_t avg_latency_us;   /* mean change to send time */
+  uint8_t  last_sequence;    /* sequence number of the last message sent */
+  uint64_t reconnects;       /* times the connection was lost and recovered */
+};
+
+struct hue_stream
+{
+  struct hue_dtls_ctx dtls;
+  struct hue_ent_ctx ent;
+  struct hue_ent_frame_buffer frames;
+  int framerate;
+  int resend_ms;
+  atomic_int state;
+  atomic_int stop;
+  pthread_t thread;
+  int thread_started;
+  struct timespec last_send; /* sender thread only */
+  struct hue_rest_ctx *rest; /* recovery is enabled if set */
+  int area_id;
+  char address[INET_ADDRSTRLEN];
+  int port;
+  int recover_step;          /* sender thread only */
+  struct timespec recover_at;
+  struct hue_rest_multi rest_multi; /* runs the re-activation request; sender thread only once started */
+  int activate_result;
+  int backoff_ms;
+  atomic_ullong frames_sent;
+  atomic_ullong frames_skipped;
+  atomic_ullong missed_deadlines;
+  atomic_ullong max_lateness_us;
+  atomic_ullong send_errors;
+  atomic_ullong last_latency_us;
+  atomic_ullong max_latency_us;
+  atomic_ullong total_latency_us;
+  atomic_ullong latency_samples;
+  atomic_uint last_sequence;
+  atomic_ullong reconnects;
+  void *user_data;
+  int  debug_level;
+  hue_debug_cb_t debug_callback;
+};
+
+struct hue_stream_group_stats
+{
+  uint64_t batches_sent;     /* ticks where at least one stream had something to send */
+  uint64_t missed_deadlines; /* ticks missed because the sender thread woke up too late */
+  uint64_t max_lateness_us;  /* worst wake up time after a deadline */
+  uint64_t avg_send_us;      /* time to hand a batch to the kernel */
+  uint64_t max_send_us;
+};
+
+struct hue_stream_group
+{
+  struct hue_stream *streams[HUE_STREAM_GROUP_MAX_STREAMS];
+  int stream_count;
+  int fd;                    /* unconnected UDP socket sending the records of all the streams */
+  int port;                  /* local port of fd, shared by each stream's own connected socket */
+  int framerate;
+  atomic_int state;
+  atomic_int stop;
+  pthread_t thread;
+  int thread_started;
+  atomic_ullong batches_sent;
+  atomic_ullong missed_deadlines;
+  atomic_ullong max_lateness_us;
+  atomic_ullong total_send_us;
+  atomic_ullong max_send_us;
+  struct hue_dtls_socket_options socket_options;
+  void *user_data;
+  int  debug_level;
+  hue_debug_cb_t debug_callback;
+};
+
+/* Function: hue_stream_init
+
+   Initialise a hue_stream object, which owns a DTLS connection and entertainment context, and a thread that
+   sends messages to the bridge at a fixed rate. The application just sets light values and publishes them
+   (see <hue_stream_set_light> and <hue_stream_publish>) from its own thread. Be sure to call <hue_stream_cleanup>
+   when finished with the stream.
+
+   Parameters:
+
+      stream - hue_stream object to initialise
+      light_count - number of lights (or v2 channels) in entertainment area to be controlled
+      ent_config_id - Entertainment configuration ID to use HueStream v2, or NULL for HueStream v1
+      framerate - number of messages per second to send to the bridge
+      psk_identity - Pre-shared key identity for the DTLS session
+      psk_key - Pre-shared key for the DTLS session
+      debug_callback - (optional) debug callback to receive debug messages. Set to NULL to print to STDOUT.
+      debug_level - about of debugging output to generate. One of: MSG_OFF, MSG_ERR, MSG_INFO or MSG_DEBUG.
+
+   Returns:
+
+      0 on success, non-zero otherwise
+*/
+int hue_stream_init(struct hue_stream *stream, int light_count, const char *ent_config_id, int framerate,
+                    const char *psk_identity, const char *psk_key, hue_debug_cb_t debug_callback, int debug_level);
+
+/* Function: hue_stream_set_light_id
+
+   Set the light id (as known to the hue bridge) for each light. Must be called before <hue_stream_start>.
+
+   Parameters:
+
+      stream - hue_stream object
+      index - light index (0 to light_count passed to hue_stream_init)
+      hue_light_id - light id repoted by hue bridge (or channel id for HueStream v2)
+
+   Returns:
+
+      0 on success, non-zero otherwise
+*/
+int hue_stream_set_light_id(struct hue_stream *stream, int index, uint16_t hue_light_id);
+
+/* Function: hue_stream_set_resend_interval
+
+   Set how often a message is sent when nothing has changed. Unchanged frames are otherwise skipped, but something
+   must be sent at least every 10 seconds or the bridge disables streaming. Default is HUE_STREAM_DEFAULT_RESEND_MS.
+
+   Parameters:
+
+      stream - hue_stream object
+      resend_ms - interval in ms, or 0 to send every frame whether it has changed or not
+*/
+void hue_stream_set_resend_interval(struct hue_stream *stream, int resend_ms);
+
+/* Function: hue_stream_set_recovery
+
+   Enable automatic recovery. If the connection to the bridge is lost, the sender thread re-activates
+   streaming for the area and redoes the DTLS handshake, backing off from HUE_STREAM_RECOVERY_MIN_BACKOFF_MS to
+   HUE_STREAM_RECOVERY_MAX_BACKOFF_MS between attempts. Neither blocks the sender thread: the request runs on a
+   curl multi handle created here, and the handshake is non-blocking, so other streams in a group keep going.
+   The state is HUE_STREAM_STATE_RECOVERING meanwhile; frames can still be published, and the latest one is sent
+   as soon as the stream is reconnected. Without recovery, the stream fails on the first send error. Must be
+   called before <hue_stream_start>.
+
+   Parameters:
+
+      stream - hue_stream object
+      rest_ctx - REST context for the bridge, or NULL to disable recovery. Used from the sender thread, so must
+                 not be used by anything else while the stream is running.
+      area_id - entertainment area to re-activate
+
+   Returns:
+
+      0 on success, non-zero otherwise
+*/
+int hue_stream_set_recovery(struct hue_stream *stream, struct hue_rest_ctx *rest_ctx, int area_id);
+
+/* Function: hue_stream_connect
+
+   Make the DTLS connection to the bridge. <hue_rest_activate_stream> must have been called first.
+
+   Parameters:
+
+      stream - hue_stream object
+      address - IP address of bridge
+      port - DTLS port, normally 2100
+
+   Returns:
+
+      0 on success, non-zero otherwise
+*/
+int hue_stream_connect(struct hue_stream *stream, const char *address, int port);
+
+/* Function: hue_stream_start
+
+   Start the sender thread. Messages are sent on absolute deadlines at the framerate passed to
+   <hue_stream_init>, so processing time doesn't cause the rate to drift.
+
+   Parameters:
+
+      stream - connected hue_stream object
+
+   Returns:
+
+      0 on success, non-zero otherwise
+*/
+int hue_stream_start(struct hue_stream *stream);
+
+/* Function: hue_stream_set_light
+
+   Set light R/G/B values. The values are sent once <hue_stream_publish> is called. Must only be called from
+   one thread.
+
+   Parameters:
+
+      stream - hue_stream object
+      index - light index (0 to light_count passed to hue_stream_init) to set
+      R - Red value   (0 - 65,535)
+      G - Green value (0 - 65,535)
+      B - Blue value  (0 - 65,535)
+
+   Returns:
+
+      0 on success, non-zero otherwise
+*/
+int hue_stream_set_light(struct hue_stream *stream, int index, uint16_t R, uint16_t G, uint16_t B);
+
+/* Function: hue_stream_fade_light
+
+   Set target R/G/B values for a light, to be reached fade_ms after <hue_stream_publish> is called. The sender
+   thread works out the intermediate values for every message, so the application can update the lights far less
+   often than the stream framerate. Must only be called from the same thread as <hue_stream_set_light>.
+
+   Parameters:
+
+      stream - hue_stream object
+      index - light index (0 to light_count passed to hue_stream_init) to set
+      R - Target red value   (0 - 65,535)
+      G - Target green value (0 - 65,535)
+      B - Target blue value  (0 - 65,535)
+      fade_ms - time to take to reach the target values (0 to set immediately)
+
+   Returns:
+
+      0 on success, non-zero otherwise
+*/
+int hue_stream_fade_light(struct hue_stream *stream, int index, uint16_t R, uint16_t G, uint16_t B, uint16_t fade_ms);
+
+/* Function: hue_stream_publish
+
+   Make the light values set since the last call available to the sender thread. The sender always uses
+   the most recently published values.
+
+   Parameters:
+
+      stream - hue_stream object
+*/
+void hue_stream_publish(struct hue_stream *stream);
+
+/* Function: hue_stream_get_state
+
+   Get the state of the stream. If sending fails, the state is set to HUE_STREAM_STATE_RECOVERING if recovery is
+   enabled (see <hue_stream_set_recovery>); otherwise the sender thread exits and the state is set to
+   HUE_STREAM_STATE_FAILED.
+
+   Parameters:
+
+      stream - hue_stream object
+
+   Returns:
+
+      One of the HUE_STREAM_STATE_* values
+*/
+int hue_stream_get_state(struct hue_stream *stream);
+
+/* Function: hue_stream_get_stats
+
+   Get send statistics. Can be called from any thread while the stream is running.
+
+   Parameters:
+
+      stream - hue_stream object
+      out_stats - (output) statistics
+*/
+void hue_stream_get_stats(struct hue_stream *stream, struct hue_stream_stats *out_stats);
+
+/* Function: hue_stream_stop
+
+   Stop the sender thread, if running.
+
+   Parameters:
+
+      stream - hue_stream object
+*/
+void hue_stream_stop(struct hue_stream *stream);
+
+/* Function: hue_stream_cleanup
+
+   Stop the stream if running, disconnect, and free any memory associated with the stream.
+
+   Parameters:
+
+      stream - hue_stream object
+*/
+void hue_stream_cleanup(struct hue_stream *stream);
+
+/* Function: hue_stream_group_init
+
+   Initialise a stream group, which drives several streams (e.g. entertainment areas on different bridges) from
+   a single thread. Each tick, every stream's latest frame is encoded, then all the messages are sent back to
+   back in one sendmmsg call over a shared socket, so all areas update together. Each stream still has a
+   connected socket of its own, on the same local port, for its handshake and anything the bridge sends. Be
+   sure to call <hue_stream_group_cleanup> when finished with the group.
+
+   Parameters:
+
+      group - hue_stream_group object to initialise
+      framerate - number of messages per second to send to each bridge
+      debug_callback - (optional) debug callback to receive debug messages. Set to NULL to print to STDOUT.
+      debug_level - about of debugging output to generate. One of: MSG_OFF, MSG_ERR, MSG_INFO or MSG_DEBUG.
+
+   Returns:
+
+      0 on success, non-zero otherwise
+*/
+int hue_stream_group_init(struct hue_stream_group *group, int framerate, hue_debug_cb_t debug_callback, int debug_level);
+
+/* Function: hue_stream_group_set_socket_options
+
+   Set options (DSCP marking, priority, send buffer size, launch time pacing) on the group's shared socket.
+   With txtime_lead_us set, each batch is given a launch time that long after its tick, so the kernel (with
+   the fq qdisc on the outgoing interface) sends it at exactly that time, whenever the sender thread woke up;
+   the lead must cover the thread's worst wake up time (see max_lateness_us in <hue_stream_group_get_stats>).
+   Launch times are on CLOCK_MONOTONIC, which fq uses; the etf qdisc needs CLOCK_TAI, so isn't supported.
+   Handshakes go over each stream's own socket, so every datagram on the group's socket has a launch time.
+   Must be called before <hue_stream_group_start>.
+
+   Parameters:
+
+      group - Initialised hue_stream_group object
+      options - socket options; see struct hue_dtls_socket_options
+
+   Returns:
+
+      0 on success, non-zero otherwise
+*/
+int hue_stream_group_set_socket_options(struct hue_stream_group *group, const struct hue_dtls_socket_options *options);
+
+/* Function: hue_stream_group_add
+
+   Connect a stream to its bridge from the group's local port, and add it to the group. The stream must have been
+   initialised with <hue_stream_init>, but not connected; the group is used in place of <hue_stream_connect>
+   and <hue_stream_start>. Light values are still set with <hue_stream_set_light> and <hue_stream_publish>.
+   Streams must be added before <hue_stream_group_start>, and only one stream per bridge can be active.
+
+   Parameters:
+
+      group - hue_stream_group object
+      stream - initialised hue_stream object; must remain valid until the group is cleaned up
+      address - IP address of bridge
+      port - DTLS port, normally 2100
+
+   Returns:
+
+      0 on success, non-zero otherwise
+*/
+int hue_stream_group_add(struct hue_stream_group *group, struct hue_stream *stream, const char *address, int port);
+
+/* Function: hue_stream_group_start
+
+   Start the group's sender thread.
+
+   Parameters:
+
+      group - hue_stream_group object
+
+   Returns:
+
+      0 on success, non-zero otherwise
+*/
+int hue_stream_group_start(struct hue_stream_group *group);
+
+/* Function: hue_stream_group_get_state
+
+   Get the current state of the group. A stream whose messages can't be sent is moved to HUE_STREAM_STATE_FAILED
+   and dropped from the group's ticks, unless it has recovery enabled, in which case it is reconnected while the
+   others carry on. The group itself only fails once all of its streams have.
+
+   Parameters:
+
+      group - hue_stream_group object
+
+   Returns:
+
+      One of the HUE_STREAM_STATE_* values
+*/
+int hue_stream_group_get_state(struct hue_stream_group *group);
+
+/* Function: hue_stream_group_get_stats
+
+   Get the group's tick statistics. Per stream statistics are available from <hue_stream_get_stats>.
+
+   Parameters:
+
+      group - hue_stream_group object
+      out_stats - (output) statistics
+*/
+void hue_stream_group_get_stats(struct hue_stream_group *group, struct hue_stream_group_stats *out_stats);
+
+/* Function: hue_stream_group_stop
+
+   Stop the group's sender thread, if running.
+
+   Parameters:
+
+      group - hue_stream_group object
+*/
+void hue_stream_group_stop(struct hue_stream_group *group);
+
+/* Function: hue_stream_group_cleanup
+
+   Stop the group if running, and close its socket. The streams in the group are not cleaned up; to disconnect
+   cleanly, call <hue_stream_group_stop>, then <hue_stream_cleanup> for each stream, then this.
+
+   Parameters:
+
+      group - hue_stream_group object
+*/
+void hue_stream_group_cleanup(struct hue_stream_group *group);
@@ -0,0 +1,210 @@
+/*
+ * Copyright (c) 2019, Daniel Swann <github@dswann.co.uk>
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "hue_debug.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define DRAIN_INTERVAL_NS 5000000L /* when the ring is empty */
+
+/* Bounded MPSC ring (after Dmitry Vyukov's bounded queue). Each slot's sequence says whose turn it is:
+ * equal to the position for the producer claiming it, position+1 once filled for the consumer */
+struct slot
+{
+  atomic_size_t sequence;
+  hue_debug_cb_t callback;
+  void *user_data;
+  const char *prefix;
+  char message[HUE_DEBUG_ASYNC_MSG_LEN];
+};
+
+static struct slot *ring;
+static size_t ring_mask;
+static atomic_size_t tail;    /* next position to claim */
+static size_t head;           /* next position to drain; consumer only */
+static atomic_int active;
+static atomic_int running;
+static atomic_uint_fast64_t queued;
+static atomic_uint_fast64_t dropped;
+static pthread_t drain_thread;
+
+static void deliver(hue_debug_cb_t callback, void *user_data, const char *prefix, const char *message)
+{
+  if (callback)
+    callback(message, user_data);
+  else
+    printf("%s%s\n", prefix, message);
+}
+
+static int drain(void)
+{
+  struct slot *slot;
+  int count = 0;
+
+  for (;;)
+  {
+    slot = &ring[head & ring_mask];
+    if (atomic_load_explicit(&slot->sequence, memory_order_acquire) != head + 1)
+      return count;
+
+    deliver(slot->callback, slot->user_data, slot->prefix, slot->message);
+
+    /* Hand the slot back for the producer's next lap */
+    atomic_store_explicit(&slot->sequence, head + ring_mask + 1, memory_order_release);
+    head++;
+    count++;
+  }
+}
+
+static void *drain_main(void *arg)
+{
+  struct timespec interval = { 0, DRAIN_INTERVAL_NS };
+
+  (void)arg;
+
+  while (atomic_load(&running))
+  {
+    if (!drain())
+      nanosleep(&interval, NULL);
+  }
+
+  return NULL;
+}
+
+static void post(hue_debug_cb_t callback, void *user_data, const char *prefix, const char *fmt, va_list args)
+{
+  struct slot *slot;
+  size_t pos;
+  intptr_t diff;
+
+  pos = atomic_load_explicit(&tail, memory_order_relaxed);
+  for (;;)
+  {
+    slot = &ring[pos & ring_mask];
+    diff = (intptr_t)atomic_load_explicit(&slot->sequence, memory_order_acquire) - (intptr_t)pos;
+    if (diff == 0)
+    {
+      if (atomic_compare_exchange_weak_explicit(&tail, &pos, pos + 1, memory_order_relaxed, memory_order_relaxed))
+        break;
+    }
+    else if (diff < 0)
+    {
+      /* Full; the drain thread is a whole lap behind */
+      atomic_fetch_add_explicit(&dropped, 1, memory_order_relaxed);
+      return;
+    }
+    else
+    {
+      pos = atomic_load_explicit(&tail, memory_order_relaxed);
+    }
+  }
+
+  slot->callback = callback;
+  slot->user_data = user_data;
+  slot->prefix = prefix;
+  vsnprintf(slot->message, sizeof(slot->message), fmt, args);
+
+  atomic_store_explicit(&slot->sequence, pos + 1, memory_order_release);
+  atomic_fetch_add_explicit(&queued, 1, memory_order_relaxed);
+}
+
+void hue_debug_vmessage(hue_debug_cb_t callback, void *user_data, const char *prefix, const char *fmt, va_list args)
+{
+  char buffer[1024];
+
+  if (atomic_load_explicit(&active, memory_order_acquire))
+  {
+    post(callback, user_data, prefix, fmt, args);
+    return;
+  }
+
+  vsnprintf(buffer, sizeof(buffer), fmt, args);
+  deliver(callback, user_data, prefix, buffer);
+}
+
+int hue_debug_async_start(int slots)
+{
+  size_t size = 1;
+  size_t i;
+
+  if (atomic_load(&active))
+    return -1;
+
+  if (slots <= 0)
+    slots = HUE_DEBUG_ASYNC_DEFAULT_SLOTS;
+  while (size < (size_t)slots)
+    size <<= 1;
+
+  ring = malloc(size * sizeof(struct slot));
+  if (!ring)
+    return -1;
+
+  for (i = 0; i < size; i++)
+    atomic_init(&ring[i].sequence, i);
+  ring_mask = size - 1;
+  atomic_store(&tail, 0);
+  head = 0;
+  atomic_store(&queued, 0);
+  atomic_store(&dropped, 0);
+
+  atomic_store(&running, 1);
+  if (pthread_create(&drain_thread, NULL, drain_main, NULL))
+  {
+    atomic_store(&running, 0);
+    free(ring);
+    ring = NULL;
+    return -1;
+  }
+
+  atomic_store_explicit(&active, 1, memory_order_release);
+  return 0;
+}
+
+void hue_debug_async_stop(void)
+{
+  if (!atomic_load(&active))
+    return;
+
+  atomic_store_explicit(&active, 0, memory_order_release);
+  atomic_store(&running, 0);
+  pthread_join(drain_thread, NULL);
+
+  /* Anything posted after the thread's last pass */
+  drain();
+
+  free(ring);
+  ring = NULL;
+}
+
+void hue_debug_async_get_stats(struct hue_debug_async_stats *out_stats)
+{
+  out_stats->queued = atomic_load_explicit(&queued, memory_order_relaxed);
+  out_stats->dropped = atomic_load_explicit(&dropped, memory_order_relaxed);
+}
@@ -5,33 +5,27 @@
 
 #include "hue_dtls.h"
 
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/ip.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
+
 #define HUE_DTLS_MAX_PAYLOAD_SIZE 1350
 
 static int hue_dtls_ctx_index;
 
-static void debug(struct hue_dtls_ctx *ctx, int level, char *fmt, ...)
+static void debug_message(struct hue_dtls_ctx *ctx, char *fmt, ...)
 {
   va_list args;
   va_start(args, fmt);
-  if (ctx->debug_level >= level)
-  {
-    if (ctx->debug_callback)
-    {
-      char buffer[1024];
-      vsnprintf(buffer, sizeof(buffer)-1, fmt, args);
-      buffer[sizeof(buffer)-1] = '\0';
-      ctx->debug_callback(buffer, ctx->user_data);
-    }
-    else
-    {
-      printf("[dtls] ");
-      vprintf(fmt, args);
-      puts("");
-    }
-  }
+  hue_debug_vmessage(ctx->debug_callback, ctx->user_data, "[dtls] ", fmt, args);
   va_end(args);
 }
 
+#define debug(ctx, level, ...) HUE_DEBUG_CALL(debug_message, ctx, level, __VA_ARGS__)
+
 static int cval(char c)
 {
   if (c>='a') return c-'a'+0x0a;
@@ -39,12 +33,13 @@ static int cval(char c)
   return c-'0';
 }
 
-static int hex2bin(char *str, unsigned char *out)
+/* Returns number of bytes written to out, or -1 if str isn't an even length hex string that fits */
+static int hex2bin(const char *str, unsigned char *out, int max_len)
 {
   int i;
-  for(i = 0; str[i] && str[i+1]; i+=2)
+  for(i = 0; str[i]; i+=2)
   {
-    if (!isxdigit(str[i])&& !isxdigit(str[i+1]))
+    if (!isxdigit(str[i]) || !isxdigit(str[i+1]) || i/2 >= max_len)
       return -1;
     out[i/2] = (cval(str[i])<<4) + cval(str[i+1]);
   }
@@ -71,32 +66,88 @@ static unsigned int psk_cb(SSL *ssl, const char *hint, char *identity,
     return 0;
   }
 
-  if (strlen(ctx->psk_key)>=(max_psk_len*2))
+  if ((unsigned int)ctx->psk_len > max_psk_len)
   {
     debug(ctx, HUE_MSG_ERR,  "Error, psk_key too long");
     return 0;
   }
 
-  /* convert the PSK key to binary */
-  ret = hex2bin(ctx->psk_key,psk);
-  if (ret<=0)
+  /* Decoded once by hue_dtls_init */
+  memcpy(psk, ctx->psk, ctx->psk_len);
+  return ctx->psk_len;
+}
+
+/* Client SSL_CTX shared by every hue_dtls_ctx in the process; created by the first hue_dtls_init, and
+ * freed by the last hue_dtls_cleanup */
+static pthread_mutex_t shared_lock = PTHREAD_MUTEX_INITIALIZER;
+static SSL_CTX *shared_ssl_ctx;
+static int shared_users;
+
+static SSL_CTX *acquire_ssl_ctx(void)
+{
+  SSL_CTX *ssl_ctx;
+
+  pthread_mutex_lock(&shared_lock);
+  if (!shared_ssl_ctx)
   {
-    debug(ctx, HUE_MSG_ERR, "Error, Could not convert PSK key '%s' to binary key", ctx->psk_key);
-    return 0;
+    shared_ssl_ctx = SSL_CTX_new(DTLS_client_method());
+    if (shared_ssl_ctx)
+    {
+      SSL_CTX_set_min_proto_version(shared_ssl_ctx, DTLS1_2_VERSION);
+      SSL_CTX_set_psk_client_callback(shared_ssl_ctx, psk_cb);
+
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L
+      SSL_CTX_set_ciphersuites(shared_ssl_ctx, "TLS_PSK_WITH_AES_128_GCM_SHA256");
+#endif
+
+#ifdef __APPLE__
+      SSL_CTX_set_options(shared_ssl_ctx, SSL_OP_NO_QUERY_MTU);
+#endif
+    }
   }
-  return ret;
+
+  ssl_ctx = shared_ssl_ctx;
+  if (ssl_ctx)
+    shared_users++;
+  pthread_mutex_unlock(&shared_lock);
+
+  return ssl_ctx;
 }
 
-int hue_dtls_send_data(struct hue_dtls_ctx *ctx, void *buf, int length)
+static void release_ssl_ctx(void)
 {
-  int len;
-  int retval=0;
-
-  if (ctx->state != HUE_DTLS_STATE_CONNECTED)
+  pthread_mutex_lock(&shared_lock);
+  if (--shared_users == 0)
   {
-    debug(ctx, HUE_MSG_ERR, "dtls_send_data> hue_dtls_ctx wrong state (%d vs expected %d)", ctx->state, HUE_DTLS_STATE_CONNECTED);
-    return -1;
+    SSL_CTX_free(shared_ssl_ctx);
+    shared_ssl_ctx = NULL;
   }
+  pthread_mutex_unlock(&shared_lock);
+}
+
+static void init_openssl(void)
+{
+  OpenSSL_add_ssl_algorithms();
+  SSL_load_error_strings();
+  hue_dtls_ctx_index = SSL_get_ex_new_index(0, "hue_dtls_ctx index", NULL, NULL, NULL);
+}
+
+/* Statistics are only written by the thread using the ctx, so a relaxed load and store is enough to
+ * keep another thread reading them from seeing a torn value, without a locked instruction per update */
+static void counter_add(atomic_ullong *counter, uint64_t n)
+{
+  atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+static uint64_t counter_get(atomic_ullong *counter)
+{
+  return atomic_load_explicit(counter, memory_order_relaxed);
+}
+
+static int dtls_send(struct hue_dtls_ctx *ctx, void *buf, int length)
+{
+  int len;
+  int retval=0;
 
   debug(ctx, HUE_MSG_DEBUG, "about to write %d bytes", length);
   len = SSL_write(ctx->ssl, buf, length);
@@ -109,10 +160,14 @@ int hue_dtls_send_data(struct hue_dtls_ctx *ctx, void *buf, int length)
 
     case SSL_ERROR_WANT_WRITE:
       /* Just try again later */
+      counter_add(&ctx->send_stats.want_write, 1);
+      retval = 1;
       break;
 
     case SSL_ERROR_WANT_READ:
       /* continue with reading */
+      counter_add(&ctx->send_stats.want_read, 1);
+      retval = 1;
       break;
 
     case SSL_ERROR_SYSCALL:
@@ -138,74 +193,300 @@ int hue_dtls_send_data(struct hue_dtls_ctx *ctx, void *buf, int length)
 
 int hue_dtls_init(struct hue_dtls_ctx *ctx, const char *psk_identity, const char *psk_key, hue_debug_cb_t debug_callback, int debug_level)
 {
-  static int first_run = 1;
+  static pthread_once_t openssl_once = PTHREAD_ONCE_INIT;
   memset(ctx, 0, sizeof(struct hue_dtls_ctx));
   ctx->debug_callback = debug_callback;
   ctx->debug_level = debug_level;
+  ctx->fd = -1;
+
+  debug(ctx, HUE_MSG_INFO, "hue_dtls_init()");
 
-  debug(ctx, HUE_MSG_INFO, "hue_dtls_init() %s", first_run==1 ? "(first run)" : "");
+  pthread_once(&openssl_once, init_openssl);
 
-  if (first_run)
+  /* Convert the PSK key to binary, once, rather than on every handshake */
+  ctx->psk_len = hex2bin(psk_key, ctx->psk, sizeof(ctx->psk));
+  if (ctx->psk_len <= 0)
   {
-    first_run = 0;
-    OpenSSL_add_ssl_algorithms();
-    SSL_load_error_strings();
-    hue_dtls_ctx_index = SSL_get_ex_new_index(0, "hue_dtls_ctx index", NULL, NULL, NULL);
+    debug(ctx, HUE_MSG_ERR, "Error, Could not convert PSK key to binary key");
+    return -1;
+  }
+
+  ctx->ssl_ctx = acquire_ssl_ctx();
+  if (!ctx->ssl_ctx)
+  {
+    debug(ctx, HUE_MSG_ERR, "Failed to create SSL_CTX");
+    return -1;
   }
 
   ctx->psk_identity = malloc(strlen(psk_identity)+1);
-  ctx->psk_key = malloc(strlen(psk_key)+1);
   strcpy(ctx->psk_identity, psk_identity);
-  strcpy(ctx->psk_key, psk_key);
 
-  ctx->fd = -1;
+  ctx->transport = &hue_dtls_transport_dtls;
+  hue_dtls_socket_options_init(&ctx->socket_options);
+  ctx->connect_timeout_ms = HUE_DTLS_DEFAULT_CONNECT_TIMEOUT_MS;
   ctx->state = HUE_DTLS_STATE_INIT;
   return 0;
 }
 
+static void forget_session(struct hue_dtls_ctx *ctx)
+{
+  if (ctx->session)
+  {
+    SSL_SESSION_free(ctx->session);
+    ctx->session = NULL;
+  }
+}
+
+/* Free the transport's session and close the socket (if it's ours), ready for another connect */
+static void free_connection(struct hue_dtls_ctx *ctx)
+{
+  if (ctx->transport)
+    ctx->transport->close(ctx);
+
+  if (ctx->fd != -1)
+  {
+    close(ctx->fd);
+  }
+  ctx->fd = -1;
+  ctx->write_buffered = 0;
+  ctx->send_stats.last_send_ns = 0;
+}
+
 void hue_dtls_cleanup(struct hue_dtls_ctx *ctx)
 {
-  debug(ctx, HUE_MSG_INFO, "dtls_cleanup() %s");
+  debug(ctx, HUE_MSG_INFO, "dtls_cleanup()");
+
+  free_connection(ctx);
+
+  if (ctx->psk_identity)
+  {
+    free(ctx->psk_identity);
+    ctx->psk_identity = NULL;
+  }
+
+  forget_session(ctx);
+  OPENSSL_cleanse(ctx->psk, sizeof(ctx->psk));
+  ctx->psk_len = 0;
 
   if (ctx->ssl_ctx)
   {
-    SSL_CTX_free(ctx->ssl_ctx);
+    release_ssl_ctx();
     ctx->ssl_ctx = NULL;
   }
 
-  if (ctx->ssl)
+  ctx->state = HUE_DTLS_STATE_CLEANEDUP;
+}
+
+int hue_dtls_poll(struct hue_dtls_ctx *ctx)
+{
+  if (ctx->state == HUE_DTLS_STATE_CLOSED)
+    return HUE_DTLS_POLL_CLOSED;
+
+  if (ctx->state != HUE_DTLS_STATE_CONNECTED)
   {
-    SSL_shutdown(ctx->ssl);
-    SSL_free(ctx->ssl);
-    ctx->ssl = NULL;
+    debug(ctx, HUE_MSG_ERR, "hue_dtls_poll> hue_dtls_ctx wrong state (%d vs expected %d)", ctx->state, HUE_DTLS_STATE_CONNECTED);
+    return -1;
   }
 
-  if (ctx->psk_identity)
+  return ctx->transport->poll(ctx);
+}
+
+void hue_dtls_disconnect(struct hue_dtls_ctx *ctx)
+{
+  if (ctx->state != HUE_DTLS_STATE_CONNECTED && ctx->state != HUE_DTLS_STATE_CONNECTING && ctx->state != HUE_DTLS_STATE_CLOSED)
+    return;
+
+  debug(ctx, HUE_MSG_INFO, "Disconnecting");
+  free_connection(ctx);
+  ctx->state = HUE_DTLS_STATE_INIT;
+}
+
+void hue_dtls_set_connect_timeout(struct hue_dtls_ctx *ctx, int timeout_ms)
+{
+  ctx->connect_timeout_ms = timeout_ms;
+}
+
+void hue_dtls_set_local_port(struct hue_dtls_ctx *ctx, int port)
+{
+  ctx->local_port = port;
+}
+
+static int64_t now_us(void)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return ((int64_t)now.tv_sec * 1000000) + (now.tv_nsec / 1000);
+}
+
+static int64_t now_ms(void)
+{
+  return now_us() / 1000;
+}
+
+static int64_t now_ns(void)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return ((int64_t)now.tv_sec * 1000000000L) + now.tv_nsec;
+}
+
+static int histogram_bucket(uint64_t value)
+{
+  int exponent;
+
+  if (value < (1 << HUE_DTLS_HISTOGRAM_SUB_BITS))
+    return value;
+  if (value >= (1ULL << HUE_DTLS_HISTOGRAM_MAX_BITS))
+    return HUE_DTLS_HISTOGRAM_BUCKETS - 1;
+
+  exponent = 63 - __builtin_clzll(value);
+  return ((exponent - HUE_DTLS_HISTOGRAM_SUB_BITS + 1) << HUE_DTLS_HISTOGRAM_SUB_BITS)
+       + ((value >> (exponent - HUE_DTLS_HISTOGRAM_SUB_BITS)) & ((1 << HUE_DTLS_HISTOGRAM_SUB_BITS) - 1));
+}
+
+/* Middle of the range of values in a bucket */
+static uint64_t histogram_bucket_value(int bucket)
+{
+  int shift;
+  uint64_t low;
+
+  if (bucket < (1 << HUE_DTLS_HISTOGRAM_SUB_BITS))
+    return bucket;
+
+  shift = (bucket >> HUE_DTLS_HISTOGRAM_SUB_BITS) - 1;
+  low = (uint64_t)((1 << HUE_DTLS_HISTOGRAM_SUB_BITS) + (bucket & ((1 << HUE_DTLS_HISTOGRAM_SUB_BITS) - 1))) << shift;
+  return low + ((1ULL << shift) >> 1);
+}
+
+static void histogram_record(struct hue_dtls_histogram *hist, uint64_t value)
+{
+  atomic_uint *bucket = &hist->buckets[histogram_bucket(value)];
+
+  if (!counter_get(&hist->count) || value < counter_get(&hist->min))
+    atomic_store_explicit(&hist->min, value, memory_order_relaxed);
+  if (value > counter_get(&hist->max))
+    atomic_store_explicit(&hist->max, value, memory_order_relaxed);
+  counter_add(&hist->sum, value);
+  atomic_store_explicit(bucket, atomic_load_explicit(bucket, memory_order_relaxed) + 1, memory_order_relaxed);
+  counter_add(&hist->count, 1);
+}
+
+/* Copy of a histogram, taken while another thread may still be recording into it */
+struct histogram_snapshot
+{
+  uint64_t count;
+  uint64_t sum;
+  uint64_t min;
+  uint64_t max;
+  uint32_t buckets[HUE_DTLS_HISTOGRAM_BUCKETS];
+};
+
+static void histogram_snapshot(struct hue_dtls_histogram *hist, struct histogram_snapshot *out)
+{
+  /* Count what was copied, so the percentiles at least agree with the buckets */
+  out->count = 0;
+  for (int i = 0; i < HUE_DTLS_HISTOGRAM_BUCKETS; i++)
   {
-    free(ctx->psk_identity);
-    ctx->psk_identity = NULL;
+    out->buckets[i] = atomic_load_explicit(&hist->buckets[i], memory_order_relaxed);
+    out->count += out->buckets[i];
   }
+  out->sum = counter_get(&hist->sum);
+  out->min = counter_get(&hist->min);
+  out->max = counter_get(&hist->max);
+}
+
+static uint64_t histogram_percentile(const struct histogram_snapshot *hist, double percentile)
+{
+  uint64_t target = (uint64_t)(hist->count * percentile / 100.0 + 0.5);
+  uint64_t seen = 0;
+  uint64_t value;
+  int i;
 
-  if (ctx->psk_key)
+  if (target < 1)
+    target = 1;
+
+  for (i = 0; i < HUE_DTLS_HISTOGRAM_BUCKETS; i++)
   {
-    free(ctx->psk_key);
-    ctx->psk_key = NULL;
+    seen += hist->buckets[i];
+    if (seen >= target)
+    {
+      value = histogram_bucket_value(i);
+      return value < hist->min ? hist->min : value > hist->max ? hist->max : value;
+    }
   }
 
-  if (ctx->fd != -1)
+  return hist->max;
+}
+
+static void histogram_summarise(struct hue_dtls_histogram *live, struct hue_dtls_latency *out)
+{
+  struct histogram_snapshot snapshot;
+  const struct histogram_snapshot *hist = &snapshot;
+
+  memset(out, 0, sizeof(struct hue_dtls_latency));
+  histogram_snapshot(live, &snapshot);
+  if (!hist->count)
+    return;
+
+  out->count = hist->count;
+  out->min   = hist->min;
+  out->mean  = hist->sum / hist->count;
+  out->p50   = histogram_percentile(hist, 50.0);
+  out->p90   = histogram_percentile(hist, 90.0);
+  out->p99   = histogram_percentile(hist, 99.0);
+  out->p999  = histogram_percentile(hist, 99.9);
+  out->max   = hist->max;
+}
+
+/* Give up on the handshake, and put the ctx back so it can be connected again. Unless the failure
+ * was down to the network (keep_session), the next attempt is a full handshake, in case the bridge
+ * didn't like being offered the old session */
+static int connect_failed(struct hue_dtls_ctx *ctx, int keep_session)
+{
+  if (ctx->session_offered && !keep_session)
   {
-    close(ctx->fd);
-    ctx->fd = -1;
+    debug(ctx, HUE_MSG_INFO, "Handshake failed while resuming session; next attempt will be a full handshake");
+    forget_session(ctx);
   }
 
-  ctx->state = HUE_DTLS_STATE_CLEANEDUP;
+  free_connection(ctx);
+  ctx->state = HUE_DTLS_STATE_INIT;
+  return -1;
 }
 
-int hue_dtls_connect(struct hue_dtls_ctx *ctx, const char *address, int port)
+/* Record the handshake time, and keep the session for resuming next time */
+static void connect_done(struct hue_dtls_ctx *ctx)
 {
-  int retval;
-  char err_buf[200];
+  int64_t duration_us = now_us() - ctx->handshake_start_us;
+
+  if (SSL_session_reused(ctx->ssl))
+  {
+    counter_add(&ctx->handshake_stats.resumed_handshakes, 1);
+    counter_add(&ctx->handshake_stats.resumed_total_us, duration_us);
+    debug(ctx, HUE_MSG_DEBUG, "Session resumed; handshake took %ld us", (long)duration_us);
+  }
+  else
+  {
+    counter_add(&ctx->handshake_stats.full_handshakes, 1);
+    counter_add(&ctx->handshake_stats.full_total_us, duration_us);
+    debug(ctx, HUE_MSG_DEBUG, "Full handshake took %ld us", (long)duration_us);
+  }
+  atomic_store_explicit(&ctx->handshake_stats.last_handshake_us, duration_us, memory_order_relaxed);
+
+  forget_session(ctx);
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L
+  if (SSL_SESSION_is_resumable(SSL_get_session(ctx->ssl)))
+    ctx->session = SSL_get1_session(ctx->ssl);
+#else
+  /* No SSL_SESSION_is_resumable before 1.1.1; keep whatever session there is, and let the bridge decide */
+  ctx->session = SSL_get1_session(ctx->ssl);
+#endif
+  if (ctx->session)
+    ctx->session_addr = ctx->remote_addr;
+}
 
+int hue_dtls_connect_start(struct hue_dtls_ctx *ctx, const char *address, int port)
+{
   if (ctx->state != HUE_DTLS_STATE_INIT)
   {
     debug(ctx, HUE_MSG_ERR, "hue_dtls_connect> hue_dtls_ctx wrong state (%d vs expected %d)", ctx->state, HUE_DTLS_STATE_INIT);
@@ -225,8 +506,122 @@ int hue_dtls_connect(struct hue_dtls_ctx *ctx, const char *address, int port)
   else
   {
     debug(ctx, HUE_MSG_ERR, "inet_pton failed");
+    return -1;
+  }
+
+  ctx->handshake_start_us = now_us();
+  ctx->connect_deadline_ms = ctx->connect_timeout_ms > 0 ? now_ms() + ctx->connect_timeout_ms : 0;
+
+  return ctx->transport->connect_start(ctx);
+}
+
+void hue_dtls_socket_options_init(struct hue_dtls_socket_options *options)
+{
+  options->dscp = -1;
+  options->priority = -1;
+  options->sndbuf = 0;
+  options->txtime_lead_us = 0;
+}
+
+int hue_dtls_socket_options_apply(const struct hue_dtls_socket_options *options, int fd)
+{
+  if (options->dscp >= 0)
+  {
+    int tos = (options->dscp & 0x3f) << 2; /* the ECN bits are left clear */
+    if (setsockopt(fd, IPPROTO_IP, IP_TOS, &tos, sizeof(tos)))
+      return -1;
+  }
+
+  if (options->priority >= 0)
+  {
+#ifdef SO_PRIORITY
+    if (setsockopt(fd, SOL_SOCKET, SO_PRIORITY, &options->priority, sizeof(options->priority)))
+      return -1;
+#else
+    errno = ENOPROTOOPT;
+    return -1;
+#endif
+  }
+
+  if (options->sndbuf > 0)
+  {
+    if (setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &options->sndbuf, sizeof(options->sndbuf)))
+      return -1;
   }
 
+  if (options->txtime_lead_us > 0)
+  {
+#ifdef SO_TXTIME
+    /* fq schedules on CLOCK_MONOTONIC, the clock the stream deadlines are on (etf would need CLOCK_TAI) */
+    struct { clockid_t clockid; uint32_t flags; } txtime = { CLOCK_MONOTONIC, 0 }; /* struct sock_txtime */
+    if (setsockopt(fd, SOL_SOCKET, SO_TXTIME, &txtime, sizeof(txtime)))
+      return -1;
+#else
+    errno = ENOPROTOOPT;
+    return -1;
+#endif
+  }
+
+  return 0;
+}
+
+/* Apply the ctx's socket options to its own socket */
+static int apply_socket_options(struct hue_dtls_ctx *ctx)
+{
+  struct hue_dtls_socket_options options = ctx->socket_options;
+
+  /* Datagrams written by SSL_write can't carry a launch time */
+  options.txtime_lead_us = 0;
+
+  if (hue_dtls_socket_options_apply(&options, ctx->fd))
+  {
+    debug(ctx, HUE_MSG_ERR, "Failed to set socket options: %s", strerror(errno));
+    return -1;
+  }
+
+  return 0;
+}
+
+int hue_dtls_set_socket_options(struct hue_dtls_ctx *ctx, const struct hue_dtls_socket_options *options)
+{
+  ctx->socket_options = *options;
+
+  if (ctx->fd >= 0)
+    return apply_socket_options(ctx);
+
+  return 0;
+}
+
+int hue_dtls_bind_shared(int fd, int port)
+{
+  struct sockaddr_in addr;
+  socklen_t addr_len = sizeof(addr);
+  int one = 1;
+
+  /* Linux lets UDP sockets share a port with SO_REUSEADDR, and delivers each datagram to the socket that
+   * matches it best, i.e. a connected socket gets its own peer's. The BSDs need SO_REUSEPORT for unicast */
+#ifdef __linux__
+  if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)))
+    return -1;
+#else
+  if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)))
+    return -1;
+#endif
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_ANY);
+  addr.sin_port = htons(port);
+  if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) ||
+      getsockname(fd, (struct sockaddr *) &addr, &addr_len))
+    return -1;
+
+  return ntohs(addr.sin_port);
+}
+
+/* Create the socket, bound to the shared local port if there is one */
+static int open_socket(struct hue_dtls_ctx *ctx)
+{
   ctx->fd = socket(ctx->remote_addr.sin_family, SOCK_DGRAM, 0);
   if (ctx->fd < 0)
   {
@@ -234,17 +629,30 @@ int hue_dtls_connect(struct hue_dtls_ctx *ctx, const char *address, int port)
     return -1;
   }
 
-  ctx->ssl_ctx = SSL_CTX_new(DTLS_client_method());
-  SSL_CTX_set_min_proto_version(ctx->ssl_ctx, DTLS1_2_VERSION);
-  SSL_CTX_set_psk_client_callback(ctx->ssl_ctx, psk_cb);
+  if (ctx->local_port && hue_dtls_bind_shared(ctx->fd, ctx->local_port) < 0)
+  {
+    debug(ctx, HUE_MSG_ERR, "Failed to bind to local port %d: %s", ctx->local_port, strerror(errno));
+    close(ctx->fd);
+    ctx->fd = -1;
+    return -1;
+  }
 
-#if OPENSSL_VERSION_NUMBER >= 0x10101000L
-  SSL_CTX_set_ciphersuites(ctx->ssl_ctx, "TLS_PSK_WITH_AES_128_GCM_SHA256");
-#endif
+  /* Not fatal; the connection still works without them */
+  apply_socket_options(ctx);
 
-#ifdef __APPLE__
-  SSL_CTX_set_options(ctx->ssl_ctx, SSL_OP_NO_QUERY_MTU);
-#endif
+  return 0;
+}
+
+/* DTLS transport: set up the socket and SSL session, and start the handshake */
+static int dtls_connect_start(struct hue_dtls_ctx *ctx)
+{
+  if (open_socket(ctx))
+    return -1;
+
+  /* Nothing ever blocks: retransmissions and the overall timeout are driven by hue_dtls_connect_continue,
+   * and once connected, a read in hue_dtls_poll of a datagram OpenSSL discards (a replayed or bad record, or a
+   * retransmitted handshake flight) mustn't wait for the next one, as the bridge sends nothing while streaming */
+  fcntl(ctx->fd, F_SETFL, fcntl(ctx->fd, F_GETFL, 0) | O_NONBLOCK);
 
   ctx->ssl = SSL_new(ctx->ssl_ctx);
 
@@ -255,8 +663,10 @@ int hue_dtls_connect(struct hue_dtls_ctx *ctx, const char *address, int port)
   SSL_set_mtu(ctx->ssl, HUE_DTLS_MAX_PAYLOAD_SIZE);
 #endif
 
-  /* Create BIO, connect and set to already connected */
-  ctx->bio = BIO_new_dgram(ctx->fd, BIO_CLOSE);
+  /* The socket is closed by free_connection (if it's ours), not the BIO */
+  ctx->bio = BIO_new_dgram(ctx->fd, BIO_NOCLOSE);
+
+  /* Connect and set BIO to already connected */
   connect(ctx->fd, (struct sockaddr *) &ctx->remote_addr, sizeof(struct sockaddr_in));
   BIO_ctrl(ctx->bio, BIO_CTRL_DGRAM_SET_CONNECTED, 0, &ctx->remote_addr);
 #ifdef __APPLE__
@@ -264,19 +674,69 @@ int hue_dtls_connect(struct hue_dtls_ctx *ctx, const char *address, int port)
 #endif
   SSL_set_bio(ctx->ssl, ctx->bio, ctx->bio);
 
+  /* Offer the session from the last connection to the same bridge. If the bridge doesn't resume it,
+   * OpenSSL falls back to a full handshake */
+  ctx->session_offered = 0;
+  if (ctx->session)
+  {
+    if (ctx->session_addr.sin_addr.s_addr == ctx->remote_addr.sin_addr.s_addr &&
+        ctx->session_addr.sin_port == ctx->remote_addr.sin_port &&
+        SSL_set_session(ctx->ssl, ctx->session))
+      ctx->session_offered = 1;
+    else
+      forget_session(ctx);
+  }
+
+  ctx->state = HUE_DTLS_STATE_CONNECTING;
+
+  return hue_dtls_connect_continue(ctx);
+}
+
+int hue_dtls_connect_continue(struct hue_dtls_ctx *ctx)
+{
+  if (ctx->state != HUE_DTLS_STATE_CONNECTING)
+  {
+    debug(ctx, HUE_MSG_ERR, "hue_dtls_connect_continue> hue_dtls_ctx wrong state (%d vs expected %d)", ctx->state, HUE_DTLS_STATE_CONNECTING);
+    return -1;
+  }
+
+  if (ctx->connect_deadline_ms && now_ms() >= ctx->connect_deadline_ms)
+  {
+    debug(ctx, HUE_MSG_ERR, "Handshake timed out after %d ms", ctx->connect_timeout_ms);
+    return connect_failed(ctx, 0);
+  }
+
+  return ctx->transport->connect_continue(ctx);
+}
+
+static int dtls_connect_continue(struct hue_dtls_ctx *ctx)
+{
+  int retval;
+  struct timeval timeout;
+  char err_buf[200];
+
+  /* Retransmit the last flight if the bridge hasn't answered in time */
+  if (DTLSv1_get_timeout(ctx->ssl, &timeout) && timeout.tv_sec == 0 && timeout.tv_usec == 0)
+  {
+    if (DTLSv1_handle_timeout(ctx->ssl) < 0)
+    {
+      debug(ctx, HUE_MSG_ERR, "Handshake failed after too many retransmissions");
+      return connect_failed(ctx, 0);
+    }
+  }
+
   retval = SSL_connect(ctx->ssl);
   if (retval <= 0)
   {
-    switch (SSL_get_error(ctx->ssl, retval)) 
+    int err = SSL_get_error(ctx->ssl, retval);
+    switch (err)
     {
-      case SSL_ERROR_ZERO_RETURN:
-        debug(ctx, HUE_MSG_ERR, "SSL_connect failed with SSL_ERROR_ZERO_RETURN");
-        break;
       case SSL_ERROR_WANT_READ:
-        debug(ctx, HUE_MSG_ERR, "SSL_connect failed with SSL_ERROR_WANT_READ");
-        break;
+        return HUE_DTLS_CONNECT_WANT_READ;
       case SSL_ERROR_WANT_WRITE:
-        debug(ctx, HUE_MSG_ERR, "SSL_connect failed with SSL_ERROR_WANT_WRITE");
+        return HUE_DTLS_CONNECT_WANT_WRITE;
+      case SSL_ERROR_ZERO_RETURN:
+        debug(ctx, HUE_MSG_ERR, "SSL_connect failed with SSL_ERROR_ZERO_RETURN");
         break;
       case SSL_ERROR_WANT_CONNECT:
         debug(ctx, HUE_MSG_ERR, "SSL_connect failed with SSL_ERROR_WANT_CONNECT");
@@ -299,10 +759,489 @@ int hue_dtls_connect(struct hue_dtls_ctx *ctx, const char *address, int port)
     }
     debug(ctx, HUE_MSG_ERR, "%s (%d)", ERR_error_string(ERR_get_error(), err_buf), SSL_get_error(ctx->ssl, sizeof(err_buf)));
     debug(ctx, HUE_MSG_ERR, "errno = %d (%s)", errno, strerror(errno));
-    return -1;
+    return connect_failed(ctx, err == SSL_ERROR_SYSCALL);
   }
 
+  connect_done(ctx);
+
   debug(ctx, HUE_MSG_DEBUG, "Connected; Cipher: %s", SSL_CIPHER_get_name(SSL_get_current_cipher(ctx->ssl)));
   ctx->state = HUE_DTLS_STATE_CONNECTED;
+  return HUE_DTLS_CONNECT_DONE;
+}
+
+void hue_dtls_get_handshake_stats(struct hue_dtls_ctx *ctx, struct hue_dtls_handshake_stats *out_stats)
+{
+  struct hue_dtls_handshake_counters *c = &ctx->handshake_stats;
+  uint64_t full_total_us = counter_get(&c->full_total_us);
+  uint64_t resumed_total_us = counter_get(&c->resumed_total_us);
+
+  memset(out_stats, 0, sizeof(struct hue_dtls_handshake_stats));
+  out_stats->full_handshakes    = counter_get(&c->full_handshakes);
+  out_stats->resumed_handshakes = counter_get(&c->resumed_handshakes);
+  out_stats->last_handshake_us  = counter_get(&c->last_handshake_us);
+
+  if (out_stats->full_handshakes)
+    out_stats->avg_full_us = full_total_us / out_stats->full_handshakes;
+  if (out_stats->resumed_handshakes)
+    out_stats->avg_resumed_us = resumed_total_us / out_stats->resumed_handshakes;
+
+  /* Estimate: each resumption saved the difference from an average full handshake */
+  if (out_stats->full_handshakes && out_stats->resumed_handshakes && out_stats->avg_full_us > out_stats->avg_resumed_us)
+    out_stats->time_saved_us = (out_stats->avg_full_us - out_stats->avg_resumed_us) * out_stats->resumed_handshakes;
+}
+
+void hue_dtls_get_stats(struct hue_dtls_ctx *ctx, struct hue_dtls_stats *out_stats)
+{
+  struct hue_dtls_send_counters *c = &ctx->send_stats;
+
+  memset(out_stats, 0, sizeof(struct hue_dtls_stats));
+  out_stats->frames_sent = counter_get(&c->frames_sent);
+  out_stats->bytes_sent  = counter_get(&c->bytes_sent);
+  out_stats->want_write  = counter_get(&c->want_write);
+  out_stats->want_read   = counter_get(&c->want_read);
+  out_stats->errors      = counter_get(&c->errors);
+  histogram_summarise(&c->write_ns, &out_stats->write);
+  histogram_summarise(&c->interval_ns, &out_stats->interval);
+  hue_dtls_get_handshake_stats(ctx, &out_stats->handshake);
+}
+
+int hue_dtls_get_fd(struct hue_dtls_ctx *ctx)
+{
+  return ctx->fd;
+}
+
+int hue_dtls_get_connect_timeout(struct hue_dtls_ctx *ctx)
+{
+  struct timeval timeout;
+  int64_t timeout_ms = -1;
+
+  if (ctx->state != HUE_DTLS_STATE_CONNECTING)
+    return -1;
+
+  /* Whichever is sooner of the next retransmission and the overall deadline */
+  if (DTLSv1_get_timeout(ctx->ssl, &timeout))
+    timeout_ms = ((int64_t)timeout.tv_sec * 1000) + ((timeout.tv_usec + 999) / 1000);
+
+  if (ctx->connect_deadline_ms)
+  {
+    int64_t remaining_ms = ctx->connect_deadline_ms - now_ms();
+    if (remaining_ms < 0)
+      remaining_ms = 0;
+    if (timeout_ms < 0 || remaining_ms < timeout_ms)
+      timeout_ms = remaining_ms;
+  }
+
+  return (int)timeout_ms;
+}
+
+/* Drive the non-blocking handshake to completion */
+static int connect_wait(struct hue_dtls_ctx *ctx, int status)
+{
+  struct pollfd pfd;
+
+  while (status == HUE_DTLS_CONNECT_WANT_READ || status == HUE_DTLS_CONNECT_WANT_WRITE)
+  {
+    pfd.fd = ctx->fd;
+    pfd.events = status == HUE_DTLS_CONNECT_WANT_READ ? POLLIN : POLLOUT;
+    pfd.revents = 0;
+    if (poll(&pfd, 1, hue_dtls_get_connect_timeout(ctx)) < 0 && errno != EINTR)
+    {
+      debug(ctx, HUE_MSG_ERR, "poll failed: %s", strerror(errno));
+      return connect_failed(ctx, 1);
+    }
+
+    status = hue_dtls_connect_continue(ctx);
+  }
+
+  return status;
+}
+
+int hue_dtls_connect(struct hue_dtls_ctx *ctx, const char *address, int port)
+{
+  return connect_wait(ctx, hue_dtls_connect_start(ctx, address, port));
+}
+
+/* Send (or with out_record, write the record for) a message, and record how long it took */
+static int timed_send(struct hue_dtls_ctx *ctx, void *buf, int length, const void **out_record, int *out_record_len)
+{
+  struct hue_dtls_send_counters *c = &ctx->send_stats;
+  int64_t start;
+  int retval;
+
+  start = now_ns();
+  if (out_record)
+    retval = ctx->transport->write_record(ctx, buf, length, out_record, out_record_len);
+  else
+    retval = ctx->transport->send(ctx, buf, length);
+  histogram_record(&c->write_ns, now_ns() - start);
+
+  if (c->last_send_ns)
+    histogram_record(&c->interval_ns, start - c->last_send_ns);
+  c->last_send_ns = start;
+
+  /* Not sent, but not an error either; the transport wants to be called again later */
+  if (retval > 0)
+    return 0;
+
+  if (retval)
+  {
+    counter_add(&c->errors, 1);
+    return retval;
+  }
+
+  counter_add(&c->frames_sent, 1);
+  counter_add(&c->bytes_sent, length);
+  return 0;
+}
+
+int hue_dtls_set_write_buffered(struct hue_dtls_ctx *ctx)
+{
+  if (ctx->state != HUE_DTLS_STATE_CONNECTED)
+  {
+    debug(ctx, HUE_MSG_ERR, "hue_dtls_set_write_buffered> hue_dtls_ctx wrong state (%d vs expected %d)", ctx->state, HUE_DTLS_STATE_CONNECTED);
+    return -1;
+  }
+
+  if (ctx->write_buffered)
+    return 0;
+
+  if (!ctx->transport->set_write_buffered)
+  {
+    debug(ctx, HUE_MSG_ERR, "hue_dtls_set_write_buffered> not supported by %s transport", ctx->transport->name);
+    return -1;
+  }
+
+  if (ctx->transport->set_write_buffered(ctx))
+    return -1;
+
+  ctx->write_buffered = 1;
+  return 0;
+}
+
+int hue_dtls_write_record(struct hue_dtls_ctx *ctx, void *buf, int length, const void **out_record, int *out_record_len)
+{
+  if (!ctx->write_buffered)
+  {
+    debug(ctx, HUE_MSG_ERR, "hue_dtls_write_record> writes are not buffered");
+    return -1;
+  }
+
+  if (ctx->state != HUE_DTLS_STATE_CONNECTED)
+  {
+    debug(ctx, HUE_MSG_ERR, "hue_dtls_write_record> hue_dtls_ctx wrong state (%d vs expected %d)", ctx->state, HUE_DTLS_STATE_CONNECTED);
+    return -1;
+  }
+
+  return timed_send(ctx, buf, length, out_record, out_record_len);
+}
+
+int hue_dtls_send_data(struct hue_dtls_ctx *ctx, void *buf, int length)
+{
+  if (ctx->state != HUE_DTLS_STATE_CONNECTED)
+  {
+    debug(ctx, HUE_MSG_ERR, "dtls_send_data> hue_dtls_ctx wrong state (%d vs expected %d)", ctx->state, HUE_DTLS_STATE_CONNECTED);
+    return -1;
+  }
+
+  return timed_send(ctx, buf, length, NULL, NULL);
+}
+
+int hue_dtls_set_transport(struct hue_dtls_ctx *ctx, const struct hue_dtls_transport *transport)
+{
+  if (ctx->state != HUE_DTLS_STATE_INIT)
+  {
+    debug(ctx, HUE_MSG_ERR, "hue_dtls_set_transport> hue_dtls_ctx wrong state (%d vs expected %d)", ctx->state, HUE_DTLS_STATE_INIT);
+    return -1;
+  }
+
+  ctx->transport = transport;
+  return 0;
+}
+
+void hue_dtls_set_sink_callback(struct hue_dtls_ctx *ctx, hue_dtls_sink_cb_t callback, void *user_data)
+{
+  ctx->sink.callback = callback;
+  ctx->sink.user_data = user_data;
+}
+
+/* Report (and clear) a pending socket error, e.g. from an ICMP port unreachable */
+static int socket_error(struct hue_dtls_ctx *ctx)
+{
+  int sock_err;
+  socklen_t sock_err_len = sizeof(sock_err);
+
+  if (getsockopt(ctx->fd, SOL_SOCKET, SO_ERROR, &sock_err, &sock_err_len) == 0 && sock_err)
+  {
+    debug(ctx, HUE_MSG_ERR, "Socket error: %s", strerror(sock_err));
+    return -1;
+  }
+
+  return 0;
+}
+
+/* Check for something to read (or a socket error) without blocking. Nothing waiting, the usual
+ * case, costs just the one system call */
+static int socket_readable(struct hue_dtls_ctx *ctx, int *out_error)
+{
+  struct pollfd pfd;
+
+  *out_error = 0;
+  pfd.fd = ctx->fd;
+  pfd.events = POLLIN;
+  pfd.revents = 0;
+  if (poll(&pfd, 1, 0) <= 0)
+    return 0;
+
+  if ((pfd.revents & POLLERR) && socket_error(ctx))
+  {
+    *out_error = 1;
+    return 0;
+  }
+
+  return pfd.revents & POLLIN;
+}
+
+static int dtls_poll(struct hue_dtls_ctx *ctx)
+{
+  char buf[HUE_DTLS_MAX_PAYLOAD_SIZE];
+  int len;
+  int error;
+
+  while (socket_readable(ctx, &error))
+  {
+    len = SSL_read(ctx->ssl, buf, sizeof(buf));
+    if (len > 0)
+    {
+      /* The bridge doesn't send application data; ignore it */
+      debug(ctx, HUE_MSG_DEBUG, "Ignoring %d bytes received", len);
+      continue;
+    }
+
+    switch (SSL_get_error(ctx->ssl, len))
+    {
+      case SSL_ERROR_WANT_READ:
+      case SSL_ERROR_WANT_WRITE:
+        /* Record handled internally (or discarded) */
+        continue;
+
+      case SSL_ERROR_ZERO_RETURN:
+        debug(ctx, HUE_MSG_INFO, "Bridge closed the connection");
+        ctx->state = HUE_DTLS_STATE_CLOSED;
+        return HUE_DTLS_POLL_CLOSED;
+
+      case SSL_ERROR_SSL:
+        debug(ctx, HUE_MSG_ERR, "Fatal alert received: %s", ERR_error_string(ERR_get_error(), buf));
+        ctx->state = HUE_DTLS_STATE_CLOSED;
+        return HUE_DTLS_POLL_CLOSED;
+
+      case SSL_ERROR_SYSCALL:
+        debug(ctx, HUE_MSG_ERR, "Socket read error: %s", strerror(errno));
+        return -1;
+
+      default:
+        debug(ctx, HUE_MSG_ERR, "Unexpected error while reading!");
+        return -1;
+    }
+  }
+
+  return error ? -1 : HUE_DTLS_POLL_OK;
+}
+
+static int dtls_set_write_buffered(struct hue_dtls_ctx *ctx)
+{
+  BIO *mem;
+
+  mem = BIO_new(BIO_s_mem());
+  if (!mem)
+    return -1;
+
+  /* The datagram BIO is currently both the read and write BIO, and SSL_set_bio took a reference for
+   * each; replacing the write BIO drops one, leaving the read BIO's */
+  SSL_set0_wbio(ctx->ssl, mem);
+  ctx->wbio = mem;
+
+  return 0;
+}
+
+static int dtls_write_record(struct hue_dtls_ctx *ctx, void *buf, int length, const void **out_record, int *out_record_len)
+{
+  char *record;
+  long record_len;
+
+  /* Only ever hold the one record */
+  BIO_reset(ctx->wbio);
+  if (dtls_send(ctx, buf, length))
+    return -1;
+
+  record_len = BIO_get_mem_data(ctx->wbio, &record);
+  if (record_len <= 0)
+  {
+    debug(ctx, HUE_MSG_ERR, "hue_dtls_write_record> no record written");
+    return -1;
+  }
+
+  *out_record = record;
+  *out_record_len = record_len;
+  return 0;
+}
+
+static void dtls_close(struct hue_dtls_ctx *ctx)
+{
+  if (ctx->ssl)
+  {
+    /* Send the close notify on the socket rather than into the memory BIO. The datagram BIO goes back
+     * to being both read and write BIO, so needs a reference for each again */
+    if (ctx->wbio)
+    {
+      BIO_up_ref(ctx->bio);
+      SSL_set0_wbio(ctx->ssl, ctx->bio);
+    }
+
+    if (ctx->state == HUE_DTLS_STATE_CONNECTED)
+      SSL_shutdown(ctx->ssl);
+    SSL_free(ctx->ssl);
+    ctx->ssl = NULL;
+  }
+
+  ctx->bio = NULL;
+  ctx->wbio = NULL;
+}
+
+const struct hue_dtls_transport hue_dtls_transport_dtls =
+{
+  "dtls",
+  dtls_connect_start,
+  dtls_connect_continue,
+  dtls_send,
+  dtls_poll,
+  dtls_set_write_buffered,
+  dtls_write_record,
+  dtls_close
+};
+
+/* Plaintext UDP transport: the same messages, unencrypted, e.g. to measure the cost of the crypto */
+static int udp_connect_start(struct hue_dtls_ctx *ctx)
+{
+  if (open_socket(ctx))
+    return -1;
+
+  if (connect(ctx->fd, (struct sockaddr *) &ctx->remote_addr, sizeof(struct sockaddr_in)))
+  {
+    debug(ctx, HUE_MSG_ERR, "connect failed: %s", strerror(errno));
+    return connect_failed(ctx, 1);
+  }
+
+  ctx->state = HUE_DTLS_STATE_CONNECTED;
+  return HUE_DTLS_CONNECT_DONE;
+}
+
+static int udp_send(struct hue_dtls_ctx *ctx, void *buf, int length)
+{
+  if (send(ctx->fd, buf, length, 0) < 0)
+  {
+    debug(ctx, HUE_MSG_ERR, "Socket write error: %s", strerror(errno));
+    return -1;
+  }
+
+  return 0;
+}
+
+static int udp_poll(struct hue_dtls_ctx *ctx)
+{
+  char buf[HUE_DTLS_MAX_PAYLOAD_SIZE];
+  int error;
+
+  while (socket_readable(ctx, &error))
+  {
+    if (recv(ctx->fd, buf, sizeof(buf), MSG_DONTWAIT) < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+    {
+      debug(ctx, HUE_MSG_ERR, "Socket read error: %s", strerror(errno));
+      return -1;
+    }
+  }
+
+  return error ? -1 : HUE_DTLS_POLL_OK;
+}
+
+static int udp_set_write_buffered(struct hue_dtls_ctx *ctx)
+{
+  (void)ctx;
   return 0;
 }
+
+static int udp_write_record(struct hue_dtls_ctx *ctx, void *buf, int length, const void **out_record, int *out_record_len)
+{
+  (void)ctx;
+
+  /* The message is the record */
+  *out_record = buf;
+  *out_record_len = length;
+  return 0;
+}
+
+static void udp_close(struct hue_dtls_ctx *ctx)
+{
+  (void)ctx;
+}
+
+const struct hue_dtls_transport hue_dtls_transport_udp =
+{
+  "udp",
+  udp_connect_start,
+  NULL,
+  udp_send,
+  udp_poll,
+  udp_set_write_buffered,
+  udp_write_record,
+  udp_close
+};
+
+/* In-memory transport: no socket; messages are counted, the last one kept, and each passed to the
+ * sink callback (if set) */
+static int memory_connect_start(struct hue_dtls_ctx *ctx)
+{
+  ctx->state = HUE_DTLS_STATE_CONNECTED;
+  return HUE_DTLS_CONNECT_DONE;
+}
+
+static int memory_send(struct hue_dtls_ctx *ctx, void *buf, int length)
+{
+  if (length > HUE_DTLS_MAX_PAYLOAD_SIZE)
+  {
+    debug(ctx, HUE_MSG_ERR, "Message too long (%d bytes)", length);
+    return -1;
+  }
+
+  memcpy(ctx->sink.last, buf, length);
+  ctx->sink.last_len = length;
+  ctx->sink.frames++;
+  ctx->sink.bytes += length;
+
+  if (ctx->sink.callback)
+    ctx->sink.callback(buf, length, ctx->sink.user_data);
+
+  return 0;
+}
+
+static int memory_poll(struct hue_dtls_ctx *ctx)
+{
+  (void)ctx;
+  return HUE_DTLS_POLL_OK;
+}
+
+static void memory_close(struct hue_dtls_ctx *ctx)
+{
+  (void)ctx;
+}
+
+const struct hue_dtls_transport hue_dtls_transport_memory =
+{
+  "memory",
+  memory_connect_start,
+  NULL,
+  memory_send,
+  memory_poll,
+  NULL,
+  NULL,
+  memory_close
+};
@@ -26,69 +26,739 @@
 
 #include "hue_entertainment.h"
 
-int hue_ent_init(struct hue_ent_ctx *ctx, int light_count)
+#include <stddef.h> /* for offsetof */
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+/* Largest number of lights in a context, so batch conversions can be done on the stack */
+#define MAX_LIGHTS (HUE_ENT_MAX_LIGHTS_V1 > HUE_ENT_MAX_CHANNELS_V2 ? HUE_ENT_MAX_LIGHTS_V1 : HUE_ENT_MAX_CHANNELS_V2)
+
+/* Planes in ctx->xy_planes, each light_count floats long */
+enum xy_plane { XY_R, XY_G, XY_B, XY_RX, XY_RY, XY_GX, XY_GY, XY_BX, XY_BY, XY_X, XY_Y, XY_BRI, XY_PLANE_COUNT };
+
+#define XY_PLANE(ctx, plane) ((ctx)->xy_planes + ((plane) * (ctx)->light_count))
+
+/* Colour values for a light, within the message buffer */
+static inline struct hue_ent_message_colour *light_colour(struct hue_ent_ctx *ctx, int index)
+{
+  return (struct hue_ent_message_colour *)(ctx->lights + (index * ctx->light_size) + ctx->colour_offset);
+}
+
+/* Red, green and blue corners of each gamut triangle (x, y) */
+static const float gamut_triangles[3][6] =
+{
+  { 0.7040f, 0.2960f, 0.2151f, 0.7106f, 0.1380f, 0.0800f }, /* HUE_ENT_GAMUT_A */
+  { 0.6750f, 0.3220f, 0.4090f, 0.5180f, 0.1670f, 0.0400f }, /* HUE_ENT_GAMUT_B */
+  { 0.6920f, 0.3080f, 0.1700f, 0.7000f, 0.1530f, 0.0480f }  /* HUE_ENT_GAMUT_C */
+};
+
+static inline float clampf(float v, float lo, float hi)
+{
+  return v < lo ? lo : (v > hi ? hi : v);
+}
+
+static inline float cross2(float ax, float ay, float bx, float by)
+{
+  return (ax * by) - (ay * bx);
+}
+
+/* Project (px, py) onto the line segment a->b, and return the squared distance to it */
+static inline float closest_on_edge(float px, float py, float ax, float ay, float bx, float by, float *out_x, float *out_y)
+{
+  float ex = bx - ax;
+  float ey = by - ay;
+  float t  = clampf(((px - ax) * ex + (py - ay) * ey) / (ex * ex + ey * ey), 0.0f, 1.0f);
+
+  *out_x = ax + t * ex;
+  *out_y = ay + t * ey;
+  return (px - *out_x) * (px - *out_x) + (py - *out_y) * (py - *out_y);
+}
+
+/* Convert linear R/G/B (0..1) of count lights to gamut corrected x/y/brightness. No branches or calls
+ * that can't be inlined, so the compiler is free to vectorize the loop across lights. */
+static void rgb_to_xy(int count,
+                      const float *restrict r, const float *restrict g, const float *restrict b,
+                      const float *restrict rx, const float *restrict ry,
+                      const float *restrict gx, const float *restrict gy,
+                      const float *restrict bx, const float *restrict by,
+                      float *restrict out_x, float *restrict out_y, float *restrict out_bri)
+{
+  for (int n = 0; n < count; n++)
+  {
+    /* Wide gamut D65 conversion */
+    float X = r[n] * 0.664511f + g[n] * 0.154324f + b[n] * 0.162028f;
+    float Y = r[n] * 0.283881f + g[n] * 0.668433f + b[n] * 0.047685f;
+    float Z = r[n] * 0.000088f + g[n] * 0.072310f + b[n] * 0.986039f;
+    float sum = X + Y + Z;
+
+    /* Black has no chromaticity; use the D65 white point */
+    float inv_sum = 1.0f / (sum > 0.0f ? sum : 1.0f);
+    float x = sum > 0.0f ? X * inv_sum : 0.3127f;
+    float y = sum > 0.0f ? Y * inv_sum : 0.3290f;
+
+    /* Is the point inside the (anti-clockwise) gamut triangle? */
+    int inside = (cross2(gx[n] - rx[n], gy[n] - ry[n], x - rx[n], y - ry[n]) >= 0.0f) &
+                 (cross2(bx[n] - gx[n], by[n] - gy[n], x - gx[n], y - gy[n]) >= 0.0f) &
+                 (cross2(rx[n] - bx[n], ry[n] - by[n], x - bx[n], y - by[n]) >= 0.0f);
+
+    /* If not, use the closest point on the edge of the triangle */
+    float rg_x, rg_y, gb_x, gb_y, br_x, br_y;
+    float d_rg = closest_on_edge(x, y, rx[n], ry[n], gx[n], gy[n], &rg_x, &rg_y);
+    float d_gb = closest_on_edge(x, y, gx[n], gy[n], bx[n], by[n], &gb_x, &gb_y);
+    float d_br = closest_on_edge(x, y, bx[n], by[n], rx[n], ry[n], &br_x, &br_y);
+
+    float edge_x = d_rg <= d_gb ? rg_x : gb_x;
+    float edge_y = d_rg <= d_gb ? rg_y : gb_y;
+    float d_edge = d_rg <= d_gb ? d_rg : d_gb;
+    edge_x = d_edge <= d_br ? edge_x : br_x;
+    edge_y = d_edge <= d_br ? edge_y : br_y;
+
+    out_x[n]   = inside ? x : edge_x;
+    out_y[n]   = inside ? y : edge_y;
+    out_bri[n] = clampf(Y, 0.0f, 1.0f);
+  }
+}
+
+/* Convert the R/G/B values of all lights to XY and write them into the message buffer */
+static void update_xy_message(struct hue_ent_ctx *ctx)
+{
+  float *x   = XY_PLANE(ctx, XY_X);
+  float *y   = XY_PLANE(ctx, XY_Y);
+  float *bri = XY_PLANE(ctx, XY_BRI);
+
+  rgb_to_xy(ctx->light_count,
+            XY_PLANE(ctx, XY_R) , XY_PLANE(ctx, XY_G) , XY_PLANE(ctx, XY_B),
+            XY_PLANE(ctx, XY_RX), XY_PLANE(ctx, XY_RY),
+            XY_PLANE(ctx, XY_GX), XY_PLANE(ctx, XY_GY),
+            XY_PLANE(ctx, XY_BX), XY_PLANE(ctx, XY_BY),
+            x, y, bri);
+
+  for (int n = 0; n < ctx->light_count; n++)
+  {
+    struct hue_ent_message_colour *colour = light_colour(ctx, n);
+    colour->R = htons((uint16_t)(x[n]   * 65535.0f + 0.5f));
+    colour->G = htons((uint16_t)(y[n]   * 65535.0f + 0.5f));
+    colour->B = htons((uint16_t)(bri[n] * 65535.0f + 0.5f));
+  }
+}
+
+static void set_xy_gamut(struct hue_ent_ctx *ctx, int index, int gamut)
+{
+  for (int corner = 0; corner < 6; corner++)
+    XY_PLANE(ctx, XY_RX + corner)[index] = gamut_triangles[gamut][corner];
+}
+
+/* Transfer curve lookup tables, converting input values to linear light. Built once per process, the first
+ * time a context selects the curve */
+static uint16_t  curve_lut8[HUE_ENT_CURVE_COUNT][256];
+static uint16_t *curve_lut16[HUE_ENT_CURVE_COUNT];
+static pthread_once_t curve_once[HUE_ENT_CURVE_COUNT] = { PTHREAD_ONCE_INIT, PTHREAD_ONCE_INIT, PTHREAD_ONCE_INIT };
+
+static double curve_to_linear(int curve, double v)
+{
+  switch (curve)
+  {
+    case HUE_ENT_CURVE_SRGB:
+      return v <= 0.04045 ? v / 12.92 : pow((v + 0.055) / 1.055, 2.4);
+
+    case HUE_ENT_CURVE_GAMMA22:
+      return pow(v, 2.2);
+
+    default:
+      return v;
+  }
+}
+
+static void build_curve(int curve)
+{
+  curve_lut16[curve] = malloc(65536 * sizeof(uint16_t));
+  if (curve_lut16[curve])
+  {
+    for (int n = 0; n < 65536; n++)
+      curve_lut16[curve][n] = (uint16_t)(curve_to_linear(curve, n / 65535.0) * 65535.0 + 0.5);
+  }
+
+  for (int n = 0; n < 256; n++)
+    curve_lut8[curve][n] = (uint16_t)(curve_to_linear(curve, n / 255.0) * 65535.0 + 0.5);
+}
+
+static void build_curve_srgb(void)    { build_curve(HUE_ENT_CURVE_SRGB);    }
+static void build_curve_gamma22(void) { build_curve(HUE_ENT_CURVE_GAMMA22); }
+
+/* Apply the input transfer curve (if any) to a 16-bit value */
+static inline uint16_t curve16(struct hue_ent_ctx *ctx, uint16_t v)
+{
+  return ctx->curve_lut16 ? ctx->curve_lut16[v] : v;
+}
+
+static uint64_t monotonic_us(void)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return ((uint64_t)now.tv_sec * 1000000) + (now.tv_nsec / 1000);
+}
+
+/* Flag a light as changed, keeping count for the info of the frame being built. The frame is
+ * timestamped by its first change */
+static inline void mark_changed(struct hue_ent_ctx *ctx, int index)
+{
+  if (!ctx->pending.created_us)
+    ctx->pending.created_us = monotonic_us();
+
+  if (!ctx->light_changed[index])
+  {
+    ctx->light_changed[index] = 1;
+    ctx->pending.lights_changed++;
+  }
+  ctx->changed = 1;
+}
+
+/* Common initialisation for v1 & v2 contexts. The message layout is fixed here, so the set
+ * functions only ever have to write the values for a single light */
+static int init_ctx(struct hue_ent_ctx *ctx, int version, int light_count, int header_size, int light_size, int colour_offset)
 {
   memset(ctx, 0, sizeof(struct hue_ent_ctx));
+  ctx->version = version;
   ctx->light_count = light_count;
+  ctx->light_size = light_size;
+  ctx->colour_offset = colour_offset;
 
-  /* Allocate memory for light data */
-  ctx->data = calloc(light_count, sizeof(struct hue_ent_message_data));
-  if (!ctx->data)
+  /* Allocate memory for full message. This is the only copy of the light data - the set
+   * functions write directly into it */
+  ctx->buf_size = header_size + (light_count * light_size);
+  ctx->msg_buf = calloc(1, ctx->buf_size);
+  if (!ctx->msg_buf)
     return -1;
 
-  memcpy(ctx->header.protocol_name, "HueStream", sizeof("HueStream")-1);
-  ctx->header.version_major = 1;
-  ctx->header.version_minor = 0;
+  ctx->header = ctx->msg_buf;
+  ctx->lights = (uint8_t*)ctx->msg_buf + header_size;
 
-  /* Allocate memory for full message */
-  ctx->buf_size = sizeof(struct hue_ent_message_header) + (light_count * sizeof(struct hue_ent_message_data));
-  ctx->msg_buf = malloc(ctx->buf_size);
-  if (!ctx->msg_buf)
+  /* Allocate memory for changed flags */
+  ctx->light_changed = calloc(light_count, sizeof(uint8_t));
+  if (!ctx->light_changed)
+    return -1;
+
+  memcpy(ctx->header->protocol_name, "HueStream", sizeof("HueStream")-1);
+  ctx->header->version_major = version;
+  ctx->header->version_minor = 0;
+
+  /* Nothing has been sent yet */
+  ctx->changed = 1;
+
+  return 0;
+}
+
+int hue_ent_init(struct hue_ent_ctx *ctx, int light_count)
+{
+  if (light_count < 0 || light_count > HUE_ENT_MAX_LIGHTS_V1)
+    return -1;
+
+  return init_ctx(ctx, HUE_ENT_VERSION_1, light_count,
+                  sizeof(struct hue_ent_message_header),
+                  sizeof(struct hue_ent_message_data),
+                  offsetof(struct hue_ent_message_data, colour));
+}
+
+int hue_ent_init_v2(struct hue_ent_ctx *ctx, const char *ent_config_id, int channel_count)
+{
+  if (channel_count < 0 || channel_count > HUE_ENT_MAX_CHANNELS_V2)
+    return -1;
+
+  if (!ent_config_id || strlen(ent_config_id) != HUE_ENT_CONFIG_ID_LEN)
     return -1;
 
-  memset(ctx->msg_buf, 0, ctx->buf_size);
+  /* v2 header is followed by the entertainment configuration id */
+  if (init_ctx(ctx, HUE_ENT_VERSION_2, channel_count,
+               sizeof(struct hue_ent_message_header) + HUE_ENT_CONFIG_ID_LEN,
+               sizeof(struct hue_ent_message_data_v2),
+               offsetof(struct hue_ent_message_data_v2, colour)))
+    return -1;
+
+  memcpy((uint8_t*)ctx->msg_buf + sizeof(struct hue_ent_message_header), ent_config_id, HUE_ENT_CONFIG_ID_LEN);
+
+  for (int n = 0; n < channel_count; n++)
+    ((struct hue_ent_message_data_v2 *)(ctx->lights + (n * ctx->light_size)))->channel_id = n;
 
   return 0;
 }
 
 int hue_ent_set_light_id(struct hue_ent_ctx *ctx, int index, uint16_t hue_light_id)
 {
-  struct hue_ent_message_data *data;
+  if (index < 0 || index >= ctx->light_count)
+    return -1;
+
+  if (ctx->version == HUE_ENT_VERSION_2)
+  {
+    struct hue_ent_message_data_v2 *data = (struct hue_ent_message_data_v2 *)(ctx->lights + (index * ctx->light_size));
+
+    if (hue_light_id > 255)
+      return -1;
+
+    if (data->channel_id == hue_light_id)
+      return 0;
+
+    data->channel_id = hue_light_id;
+  }
+  else
+  {
+    struct hue_ent_message_data *data = (struct hue_ent_message_data *)(ctx->lights + (index * ctx->light_size));
+
+    if (data->id == htons(hue_light_id))
+      return 0;
+
+    data->id = htons(hue_light_id);
+  }
+
+  mark_changed(ctx, index);
+  return 0;
+}
+
+int hue_ent_set_colour_space(struct hue_ent_ctx *ctx, int colour_space)
+{
+  if (colour_space == ctx->colour_space)
+    return 0;
+
+  if (colour_space == HUE_ENT_COLOUR_SPACE_XY)
+  {
+    ctx->xy_planes = calloc(XY_PLANE_COUNT * ctx->light_count, sizeof(float));
+    if (!ctx->xy_planes)
+      return -1;
+
+    /* Carry over the current R/G/B values, and default to gamut C */
+    for (int n = 0; n < ctx->light_count; n++)
+    {
+      struct hue_ent_message_colour *colour = light_colour(ctx, n);
+      XY_PLANE(ctx, XY_R)[n] = ntohs(colour->R) / 65535.0f;
+      XY_PLANE(ctx, XY_G)[n] = ntohs(colour->G) / 65535.0f;
+      XY_PLANE(ctx, XY_B)[n] = ntohs(colour->B) / 65535.0f;
+      set_xy_gamut(ctx, n, HUE_ENT_GAMUT_C);
+    }
+  }
+  else if (colour_space == HUE_ENT_COLOUR_SPACE_RGB)
+  {
+    /* Put the R/G/B values back into the message */
+    for (int n = 0; n < ctx->light_count; n++)
+    {
+      struct hue_ent_message_colour *colour = light_colour(ctx, n);
+      colour->R = htons((uint16_t)(XY_PLANE(ctx, XY_R)[n] * 65535.0f + 0.5f));
+      colour->G = htons((uint16_t)(XY_PLANE(ctx, XY_G)[n] * 65535.0f + 0.5f));
+      colour->B = htons((uint16_t)(XY_PLANE(ctx, XY_B)[n] * 65535.0f + 0.5f));
+    }
+
+    free(ctx->xy_planes);
+    ctx->xy_planes = NULL;
+  }
+  else
+  {
+    return -1;
+  }
+
+  ctx->colour_space = colour_space;
+  ctx->header->colour_space = colour_space;
+  for (int n = 0; n < ctx->light_count; n++)
+    mark_changed(ctx, n);
+
+  return 0;
+}
+
+int hue_ent_set_light_gamut(struct hue_ent_ctx *ctx, int index, int gamut)
+{
+  if (index < 0 || index >= ctx->light_count)
+    return -1;
+
+  if (gamut < HUE_ENT_GAMUT_A || gamut > HUE_ENT_GAMUT_C)
+    return -1;
+
+  if (ctx->colour_space != HUE_ENT_COLOUR_SPACE_XY)
+    return -1;
+
+  set_xy_gamut(ctx, index, gamut);
+  mark_changed(ctx, index);
+
+  return 0;
+}
+
+/* Set the values of a light, flagging it as changed if they differ. index must be valid */
+static void set_light_values(struct hue_ent_ctx *ctx, int index, uint16_t R, uint16_t G, uint16_t B)
+{
+  struct hue_ent_message_colour *colour;
+
+  if (ctx->colour_space == HUE_ENT_COLOUR_SPACE_XY)
+  {
+    /* Conversion to XY is done for all lights at once in hue_ent_get_message */
+    float r = R / 65535.0f;
+    float g = G / 65535.0f;
+    float b = B / 65535.0f;
+
+    if (XY_PLANE(ctx, XY_R)[index] == r && XY_PLANE(ctx, XY_G)[index] == g && XY_PLANE(ctx, XY_B)[index] == b)
+      return; /* No change */
+
+    XY_PLANE(ctx, XY_R)[index] = r;
+    XY_PLANE(ctx, XY_G)[index] = g;
+    XY_PLANE(ctx, XY_B)[index] = b;
+    mark_changed(ctx, index);
+    return;
+  }
+
+  colour = light_colour(ctx, index);
+  if (colour->R == htons(R) && colour->G == htons(G) && colour->B == htons(B))
+    return; /* No change */
+
+  colour->R = htons(R);
+  colour->G = htons(G);
+  colour->B = htons(B);
+  mark_changed(ctx, index);
+}
+
+/* Get the current R/G/B values of a light. index must be valid */
+static void get_light_values(struct hue_ent_ctx *ctx, int index, uint16_t *out_rgb)
+{
+  if (ctx->colour_space == HUE_ENT_COLOUR_SPACE_XY)
+  {
+    out_rgb[0] = (uint16_t)(XY_PLANE(ctx, XY_R)[index] * 65535.0f + 0.5f);
+    out_rgb[1] = (uint16_t)(XY_PLANE(ctx, XY_G)[index] * 65535.0f + 0.5f);
+    out_rgb[2] = (uint16_t)(XY_PLANE(ctx, XY_B)[index] * 65535.0f + 0.5f);
+  }
+  else
+  {
+    struct hue_ent_message_colour *colour = light_colour(ctx, index);
+    out_rgb[0] = ntohs(colour->R);
+    out_rgb[1] = ntohs(colour->G);
+    out_rgb[2] = ntohs(colour->B);
+  }
+}
 
-  if (index >= ctx->light_count)
+static void cancel_fade(struct hue_ent_ctx *ctx, int index)
+{
+  if (ctx->fades && ctx->fades[index].active)
+  {
+    ctx->fades[index].active = 0;
+    ctx->fades_active--;
+  }
+}
+
+int hue_ent_set_input_curve(struct hue_ent_ctx *ctx, int curve)
+{
+  switch (curve)
+  {
+    case HUE_ENT_CURVE_LINEAR:
+      ctx->curve_lut8  = NULL;
+      ctx->curve_lut16 = NULL;
+      return 0;
+
+    case HUE_ENT_CURVE_SRGB:
+      pthread_once(&curve_once[curve], build_curve_srgb);
+      break;
+
+    case HUE_ENT_CURVE_GAMMA22:
+      pthread_once(&curve_once[curve], build_curve_gamma22);
+      break;
+
+    default:
+      return -1;
+  }
+
+  if (!curve_lut16[curve])
     return -1;
 
-  data = &ctx->data[index];
-  data->id = htons(hue_light_id);
+  ctx->curve_lut8  = curve_lut8[curve];
+  ctx->curve_lut16 = curve_lut16[curve];
   return 0;
 }
 
 int hue_ent_set_light(struct hue_ent_ctx *ctx, int index, uint16_t R, uint16_t G, uint16_t B)
 {
-  struct hue_ent_message_data *data;
+  if (index < 0 || index >= ctx->light_count)
+    return -1;
+
+  cancel_fade(ctx, index);
+  set_light_values(ctx, index, curve16(ctx, R), curve16(ctx, G), curve16(ctx, B));
+
+  return 0;
+}
+
+int hue_ent_set_light_8bit(struct hue_ent_ctx *ctx, int index, uint8_t R, uint8_t G, uint8_t B)
+{
+  if (index < 0 || index >= ctx->light_count)
+    return -1;
+
+  cancel_fade(ctx, index);
+  if (ctx->curve_lut8)
+    set_light_values(ctx, index, ctx->curve_lut8[R], ctx->curve_lut8[G], ctx->curve_lut8[B]);
+  else
+    set_light_values(ctx, index, R * 257, G * 257, B * 257);
+
+  return 0;
+}
+
+/* Quantise a float (0.0 - 1.0) to 16-bit */
+static inline uint16_t float_to_16(float v)
+{
+  return (uint16_t)(clampf(v, 0.0f, 1.0f) * 65535.0f + 0.5f);
+}
+
+int hue_ent_set_light_float(struct hue_ent_ctx *ctx, int index, float R, float G, float B)
+{
+  return hue_ent_set_light(ctx, index, float_to_16(R), float_to_16(G), float_to_16(B));
+}
+
+/* Convert count 16-bit host order values to network byte order */
+static void swap16_block(const uint16_t *in, uint16_t *out, int count)
+{
+  int n = 0;
+
+#if defined(__SSE2__)
+  for (; n + 8 <= count; n += 8)
+  {
+    __m128i v = _mm_loadu_si128((const __m128i *)(in + n));
+    _mm_storeu_si128((__m128i *)(out + n), _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8)));
+  }
+#elif defined(__ARM_NEON) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  for (; n + 8 <= count; n += 8)
+    vst1q_u16(out + n, vreinterpretq_u16_u8(vrev16q_u8(vreinterpretq_u8_u16(vld1q_u16(in + n)))));
+#endif
+
+  for (; n < count; n++)
+    out[n] = htons(in[n]);
+}
+
+/* Convert count 8-bit values to 16-bit network byte order values. v * 257 maps 0..255 onto 0..65535,
+ * and is just the byte repeated - so no byte swapping needed */
+static void expand8_block(const uint8_t *in, uint16_t *out, int count)
+{
+  int n = 0;
+
+#if defined(__SSE2__)
+  for (; n + 16 <= count; n += 16)
+  {
+    __m128i v = _mm_loadu_si128((const __m128i *)(in + n));
+    _mm_storeu_si128((__m128i *)(out + n)    , _mm_unpacklo_epi8(v, v));
+    _mm_storeu_si128((__m128i *)(out + n + 8), _mm_unpackhi_epi8(v, v));
+  }
+#elif defined(__ARM_NEON)
+  for (; n + 16 <= count; n += 16)
+  {
+    uint8x16_t v = vld1q_u8(in + n);
+    vst2q_u8((uint8_t *)(out + n), (uint8x16x2_t){ { v, v } });
+  }
+#endif
+
+  for (; n < count; n++)
+    out[n] = in[n] * 257;
+}
+
+/* Copy network byte order R/G/B values for count lights into the message, flagging the lights that change */
+static void set_lights_network_order(struct hue_ent_ctx *ctx, int first, int count, const uint16_t *rgb)
+{
+  for (int n = 0; n < count; n++)
+  {
+    struct hue_ent_message_colour *colour = light_colour(ctx, first + n);
+
+    cancel_fade(ctx, first + n);
+    if (memcmp(colour, rgb + (n * 3), sizeof(struct hue_ent_message_colour)))
+    {
+      memcpy(colour, rgb + (n * 3), sizeof(struct hue_ent_message_colour));
+      mark_changed(ctx, first + n);
+    }
+  }
+}
+
+int hue_ent_set_lights(struct hue_ent_ctx *ctx, int first, int count, const uint16_t *rgb)
+{
+  uint16_t rgb_curved[MAX_LIGHTS * 3];
+  uint16_t rgb_be[MAX_LIGHTS * 3];
+
+  if (first < 0 || count < 0 || first + count > ctx->light_count)
+    return -1;
+
+  if (ctx->colour_space == HUE_ENT_COLOUR_SPACE_XY)
+  {
+    /* Values aren't written to the message until it's converted to XY */
+    for (int n = 0; n < count; n++)
+      hue_ent_set_light(ctx, first + n, rgb[n * 3], rgb[(n * 3) + 1], rgb[(n * 3) + 2]);
+    return 0;
+  }
+
+  if (ctx->curve_lut16)
+  {
+    for (int n = 0; n < count * 3; n++)
+      rgb_curved[n] = ctx->curve_lut16[rgb[n]];
+    rgb = rgb_curved;
+  }
+
+  swap16_block(rgb, rgb_be, count * 3);
+  set_lights_network_order(ctx, first, count, rgb_be);
+
+  return 0;
+}
+
+int hue_ent_set_lights_8bit(struct hue_ent_ctx *ctx, int first, int count, const uint8_t *rgb)
+{
+  uint16_t rgb16[MAX_LIGHTS * 3];
+  uint16_t rgb_be[MAX_LIGHTS * 3];
 
-  if (index >= ctx->light_count)
+  if (first < 0 || count < 0 || first + count > ctx->light_count)
     return -1;
 
-  data = &ctx->data[index];
-  data->R = htons(R);
-  data->G = htons(G);
-  data->B = htons(B);
+  if (ctx->colour_space == HUE_ENT_COLOUR_SPACE_XY)
+  {
+    /* Values aren't written to the message until it's converted to XY */
+    for (int n = 0; n < count; n++)
+      hue_ent_set_light_8bit(ctx, first + n, rgb[n * 3], rgb[(n * 3) + 1], rgb[(n * 3) + 2]);
+    return 0;
+  }
+
+  if (ctx->curve_lut8)
+  {
+    for (int n = 0; n < count * 3; n++)
+      rgb16[n] = ctx->curve_lut8[rgb[n]];
+    swap16_block(rgb16, rgb_be, count * 3);
+    set_lights_network_order(ctx, first, count, rgb_be);
+  }
+  else
+  {
+    /* Expanded values are the same in either byte order */
+    expand8_block(rgb, rgb16, count * 3);
+    set_lights_network_order(ctx, first, count, rgb16);
+  }
 
   return 0;
 }
 
+int hue_ent_set_lights_float(struct hue_ent_ctx *ctx, int first, int count, const float *rgb)
+{
+  uint16_t rgb16[MAX_LIGHTS * 3];
+
+  if (first < 0 || count < 0 || first + count > ctx->light_count)
+    return -1;
+
+  for (int n = 0; n < count * 3; n++)
+    rgb16[n] = float_to_16(rgb[n]);
+
+  return hue_ent_set_lights(ctx, first, count, rgb16);
+}
+
+int hue_ent_fade_light(struct hue_ent_ctx *ctx, int index, uint16_t R, uint16_t G, uint16_t B, uint64_t now_us, uint32_t duration_ms)
+{
+  struct hue_ent_fade *fade;
+
+  if (index < 0 || index >= ctx->light_count)
+    return -1;
+
+  if (duration_ms == 0)
+    return hue_ent_set_light(ctx, index, R, G, B);
+
+  if (!ctx->fades)
+  {
+    ctx->fades = calloc(ctx->light_count, sizeof(struct hue_ent_fade));
+    if (!ctx->fades)
+      return -1;
+  }
+
+  fade = &ctx->fades[index];
+  get_light_values(ctx, index, fade->from);
+  fade->to[0] = curve16(ctx, R);
+  fade->to[1] = curve16(ctx, G);
+  fade->to[2] = curve16(ctx, B);
+  fade->start_us = now_us;
+  fade->end_us = now_us + ((uint64_t)duration_ms * 1000);
+
+  if (!fade->active)
+  {
+    fade->active = 1;
+    ctx->fades_active++;
+  }
+
+  return 0;
+}
+
+int hue_ent_update_fades(struct hue_ent_ctx *ctx, uint64_t now_us)
+{
+  if (!ctx->fades_active)
+    return 0;
+
+  for (int n = 0; n < ctx->light_count; n++)
+  {
+    struct hue_ent_fade *fade = &ctx->fades[n];
+    uint16_t rgb[3];
+
+    if (!fade->active)
+      continue;
+
+    if (now_us >= fade->end_us)
+    {
+      /* Finished */
+      set_light_values(ctx, n, fade->to[0], fade->to[1], fade->to[2]);
+      fade->active = 0;
+      ctx->fades_active--;
+      continue;
+    }
+
+    /* Linear interpolation from the start values */
+    uint64_t elapsed  = now_us > fade->start_us ? now_us - fade->start_us : 0;
+    uint64_t duration = fade->end_us - fade->start_us;
+    for (int c = 0; c < 3; c++)
+      rgb[c] = fade->from[c] + (int32_t)(((int64_t)(fade->to[c] - fade->from[c]) * (int64_t)elapsed) / (int64_t)duration);
+
+    set_light_values(ctx, n, rgb[0], rgb[1], rgb[2]);
+  }
+
+  return ctx->fades_active;
+}
+
 int hue_ent_get_message(struct hue_ent_ctx *ctx, void **out_msg_buf, int *out_buf_len)
 {
-  memcpy(ctx->msg_buf, &ctx->header, sizeof(struct hue_ent_message_header));
-  memcpy((uint8_t*)ctx->msg_buf+sizeof(struct hue_ent_message_header), ctx->data,  (ctx->light_count * sizeof(struct hue_ent_message_data))); 
-  
   *out_msg_buf = ctx->msg_buf;
   *out_buf_len = ctx->buf_size;
 
+  /* Caller is about to send the message, so reset the changed flags and start a new frame */
+  if (ctx->changed)
+  {
+    if (ctx->colour_space == HUE_ENT_COLOUR_SPACE_XY)
+      update_xy_message(ctx);
+
+    memset(ctx->light_changed, 0, ctx->light_count);
+    ctx->changed = 0;
+
+    ctx->frame = ctx->pending;
+    memset(&ctx->pending, 0, sizeof(struct hue_ent_frame_info));
+  }
+
+  /* Every message gets a new sequence number (including resends of an unchanged frame), so gaps
+   * show lost messages */
+  ctx->sequence++;
+  ctx->header->sequence_number = ctx->sequence;
+  ctx->frame.sequence = ctx->sequence;
+  ctx->frame.send_attempts++;
+
   return 0;
 }
 
+void hue_ent_get_frame_info(struct hue_ent_ctx *ctx, struct hue_ent_frame_info *out_info)
+{
+  *out_info = ctx->frame;
+}
+
+int hue_ent_is_changed(struct hue_ent_ctx *ctx)
+{
+  return ctx->changed;
+}
+
+int hue_ent_is_light_changed(struct hue_ent_ctx *ctx, int index)
+{
+  if (index < 0 || index >= ctx->light_count)
+    return 0;
+
+  return ctx->light_changed[index];
+}
+
 void hue_ent_cleanup(struct hue_ent_ctx *ctx)
 {
   if (ctx->msg_buf)
@@ -97,9 +767,178 @@ void hue_ent_cleanup(struct hue_ent_ctx *ctx)
     ctx->msg_buf = NULL;
   }
 
-  if (ctx->data)
+  if (ctx->light_changed)
+  {
+    free(ctx->light_changed);
+    ctx->light_changed = NULL;
+  }
+
+  if (ctx->xy_planes)
+  {
+    free(ctx->xy_planes);
+    ctx->xy_planes = NULL;
+  }
+
+  if (ctx->fades)
+  {
+    free(ctx->fades);
+    ctx->fades = NULL;
+  }
+  ctx->fades_active = 0;
+
+  ctx->header = NULL;
+  ctx->lights = NULL;
+}
+
+#define FRAME(fb, frame) ((fb)->frames + ((frame) * (fb)->light_count))
+
+int hue_ent_frame_buffer_init(struct hue_ent_frame_buffer *fb, int light_count, int producer_count)
+{
+  memset(fb, 0, sizeof(struct hue_ent_frame_buffer));
+
+  if (light_count <= 0 || producer_count <= 0)
+    return -1;
+
+  fb->light_count = light_count;
+  fb->producer_count = producer_count;
+
+  /* One back buffer per producer, plus the latest and front frames, then one frame per producer
+   * for the producer to fill */
+  fb->frames = calloc(((producer_count * 2) + 2) * light_count, sizeof(struct hue_ent_frame_light));
+  if (!fb->frames)
+    return -1;
+
+  fb->frame_us = calloc((producer_count * 2) + 2, sizeof(uint64_t));
+  if (!fb->frame_us)
+    return -1;
+
+  fb->back = calloc(producer_count, sizeof(int));
+  if (!fb->back)
+    return -1;
+
+  for (int n = 0; n < producer_count; n++)
+    fb->back[n] = n;
+  atomic_init(&fb->latest, producer_count);
+  fb->front = producer_count + 1;
+
+  return 0;
+}
+
+struct hue_ent_frame_light *hue_ent_frame_buffer_back(struct hue_ent_frame_buffer *fb, int producer)
+{
+  if (producer < 0 || producer >= fb->producer_count)
+    return NULL;
+
+  return FRAME(fb, fb->producer_count + 2 + producer);
+}
+
+int hue_ent_frame_buffer_set_light(struct hue_ent_frame_buffer *fb, int producer, int index, uint16_t R, uint16_t G, uint16_t B)
+{
+  struct hue_ent_frame_light *light;
+
+  if (producer < 0 || producer >= fb->producer_count)
+    return -1;
+
+  if (index < 0 || index >= fb->light_count)
+    return -1;
+
+  /* Latency is measured from the first change to the frame */
+  if (!fb->frame_us[fb->producer_count + 2 + producer])
+    fb->frame_us[fb->producer_count + 2 + producer] = monotonic_us();
+
+  light = FRAME(fb, fb->producer_count + 2 + producer) + index;
+  light->R = R;
+  light->G = G;
+  light->B = B;
+  light->fade_ms = 0;
+
+  return 0;
+}
+
+int hue_ent_frame_buffer_fade_light(struct hue_ent_frame_buffer *fb, int producer, int index, uint16_t R, uint16_t G, uint16_t B, uint16_t fade_ms)
+{
+  if (hue_ent_frame_buffer_set_light(fb, producer, index, R, G, B))
+    return -1;
+
+  FRAME(fb, fb->producer_count + 2 + producer)[index].fade_ms = fade_ms;
+  return 0;
+}
+
+void hue_ent_frame_buffer_publish(struct hue_ent_frame_buffer *fb, int producer)
+{
+  int published;
+  unsigned int old;
+
+  if (producer < 0 || producer >= fb->producer_count)
+    return;
+
+  /* The producer keeps filling its own frame; only the back buffer changes hands */
+  published = fb->back[producer];
+  memcpy(FRAME(fb, published), FRAME(fb, fb->producer_count + 2 + producer), fb->light_count * sizeof(struct hue_ent_frame_light));
+  fb->frame_us[published] = fb->frame_us[fb->producer_count + 2 + producer] ? fb->frame_us[fb->producer_count + 2 + producer] : monotonic_us();
+  fb->frame_us[fb->producer_count + 2 + producer] = 0;
+
+  old = atomic_exchange_explicit(&fb->latest, published | HUE_ENT_FRAME_FRESH, memory_order_acq_rel);
+  fb->back[producer] = old & ~HUE_ENT_FRAME_FRESH;
+}
+
+int hue_ent_frame_buffer_apply(struct hue_ent_frame_buffer *fb, struct hue_ent_ctx *ctx, uint64_t now_us)
+{
+  struct hue_ent_frame_light *frame;
+  int count;
+
+  if (!(atomic_load_explicit(&fb->latest, memory_order_acquire) & HUE_ENT_FRAME_FRESH))
+    return 0;
+
+  fb->front = atomic_exchange_explicit(&fb->latest, fb->front, memory_order_acq_rel) & ~HUE_ENT_FRAME_FRESH;
+
+  frame = FRAME(fb, fb->front);
+  count = fb->light_count < ctx->light_count ? fb->light_count : ctx->light_count;
+  for (int n = 0; n < count; n++)
+  {
+    if (frame[n].fade_ms)
+    {
+      uint16_t target[3];
+
+      /* Frames keep their values once published, so only start a fade if the target is new */
+      if (ctx->fades && ctx->fades[n].active)
+        memcpy(target, ctx->fades[n].to, sizeof(target));
+      else
+        get_light_values(ctx, n, target);
+
+      if (target[0] != curve16(ctx, frame[n].R) || target[1] != curve16(ctx, frame[n].G) || target[2] != curve16(ctx, frame[n].B))
+        hue_ent_fade_light(ctx, n, frame[n].R, frame[n].G, frame[n].B, now_us, frame[n].fade_ms);
+    }
+    else
+    {
+      hue_ent_set_light(ctx, n, frame[n].R, frame[n].G, frame[n].B);
+    }
+  }
+
+  /* Backdate the message frame to when the producer started on it */
+  if (ctx->changed && fb->frame_us[fb->front] && fb->frame_us[fb->front] < ctx->pending.created_us)
+    ctx->pending.created_us = fb->frame_us[fb->front];
+
+  return 1;
+}
+
+void hue_ent_frame_buffer_cleanup(struct hue_ent_frame_buffer *fb)
+{
+  if (fb->frames)
+  {
+    free(fb->frames);
+    fb->frames = NULL;
+  }
+
+  if (fb->frame_us)
+  {
+    free(fb->frame_us);
+    fb->frame_us = NULL;
+  }
+
+  if (fb->back)
   {
-    free(ctx->data);
-    ctx->data = NULL;
+    free(fb->back);
+    fb->back = NULL;
   }
 }
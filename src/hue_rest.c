@@ -27,35 +27,31 @@
 #include "hue_rest.h"
 
 #include <curl/curl.h>
+#include <limits.h>
+#include <openssl/sha.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <sys/stat.h>
 
 #include <string.h>
 #include <stdlib.h>
+#include <time.h>
 
 enum req_type { REQTYPE_GET, REQTYPE_PUT, REQTYPE_POST, REQTYPE_DELETE };
 
-void hue_debug(struct hue_rest_ctx *ctx, int level, char *fmt, ...)
+/* Asynchronous requests; what to do with the response */
+enum request { REQUEST_NONE, REQUEST_ACTIVATE_STREAM, REQUEST_GET_ENT_GROUPS, REQUEST_VALIDATE_APIVERSION };
+
+static void hue_debug_message(struct hue_rest_ctx *ctx, char *fmt, ...)
 {
   va_list args;
   va_start(args, fmt);
-  if (ctx->debug_level >= level)
-  {
-    if (ctx->debug_callback)
-    {
-      char buffer[1024];
-      vsnprintf(buffer, sizeof(buffer)-1, fmt, args);
-      buffer[sizeof(buffer)-1] = '\0';
-      ctx->debug_callback(buffer, ctx->user_data);
-    }
-    else
-    {
-      printf("[hue_rest] ");
-      vprintf(fmt, args);
-      puts("");
-    }
-  }
+  hue_debug_vmessage(ctx->debug_callback, ctx->user_data, "[hue_rest] ", fmt, args);
   va_end(args);
 }
 
+#define hue_debug(ctx, level, ...) HUE_DEBUG_CALL(hue_debug_message, ctx, level, __VA_ARGS__)
+
 void free_if_not_null(void **ptr)
 {
   if (*ptr)
@@ -106,21 +102,91 @@ void hue_rest_cleanup()
   curl_global_cleanup();
 }
 
-static void free_whitelist(struct hue_rest_ctx *ctx)
+#define ARENA_MIN_CHUNK 4096
+
+struct hue_rest_arena_chunk
+{
+  struct hue_rest_arena_chunk *next;
+  size_t size;
+  size_t used;
+  _Alignas(max_align_t) char data[];
+};
+
+/* Allocate len bytes (zeroed) from arena. There's no free; see arena_reset */
+static void *arena_alloc(struct hue_rest_arena *arena, size_t len)
+{
+  struct hue_rest_arena_chunk *chunk = arena->chunks;
+  size_t size;
+  void *ptr;
+
+  len = (len + _Alignof(max_align_t) - 1) & ~(_Alignof(max_align_t) - 1);
+
+  if (chunk == NULL || chunk->size - chunk->used < len)
+  {
+    /* Double each time, so a reset arena soon settles on one chunk big enough for a whole response */
+    size = chunk ? chunk->size * 2 : ARENA_MIN_CHUNK;
+    if (size < len)
+      size = len;
+
+    if (!(chunk = malloc(sizeof(struct hue_rest_arena_chunk) + size)))
+      return NULL;
+    chunk->next = arena->chunks;
+    chunk->size = size;
+    chunk->used = 0;
+    arena->chunks = chunk;
+  }
+
+  ptr = chunk->data + chunk->used;
+  chunk->used += len;
+  memset(ptr, 0, len);
+
+  return ptr;
+}
+
+/* Copy str into arena. Returns NULL if str is NULL, or out of memory */
+static char *arena_strdup(struct hue_rest_arena *arena, const char *str)
+{
+  char *copy;
+
+  if (str == NULL)
+    return NULL;
+
+  if ((copy = arena_alloc(arena, strlen(str)+1)))
+    strcpy(copy, str);
+
+  return copy;
+}
+
+/* Release everything allocated from arena, keeping the newest (largest) chunk for reuse */
+static void arena_reset(struct hue_rest_arena *arena)
+{
+  struct hue_rest_arena_chunk *chunk;
+
+  if (arena->chunks == NULL)
+    return;
+
+  while ((chunk = arena->chunks->next))
+  {
+    arena->chunks->next = chunk->next;
+    free(chunk);
+  }
+  arena->chunks->used = 0;
+}
+
+static void arena_free(struct hue_rest_arena *arena)
 {
-  if (ctx->whitelist == NULL || ctx->whitelist_count == 0)
-    return; /* Nothing to do, just exit */
+  struct hue_rest_arena_chunk *chunk;
 
-  for (uint i=0; i < ctx->whitelist_count; i++)
+  while ((chunk = arena->chunks))
   {
-    struct hue_whitelist_entry *cur = ctx->whitelist+i;
-    if (cur->username)      free(cur->username);
-    if (cur->last_use_date) free(cur->last_use_date);
-    if (cur->created_date)  free(cur->created_date);
-    if (cur->name)          free(cur->name);
+    arena->chunks = chunk->next;
+    free(chunk);
   }
+}
 
-  free(ctx->whitelist);
+static void free_whitelist(struct hue_rest_ctx *ctx)
+{
+  arena_reset(&ctx->whitelist_arena);
   ctx->whitelist = NULL;
   ctx->whitelist_count = 0;
 }
@@ -150,20 +216,42 @@ int hue_rest_init_ctx(struct hue_rest_ctx *ctx, hue_debug_cb_t debug_callback, c
 
   ctx->ent_areas = NULL;
 
+  /* One handle for all requests, so its connection to the bridge is reused */
+  if (!(ctx->curl = curl_easy_init()))
+  {
+    hue_debug(ctx, HUE_MSG_ERR, "curl_easy_init() failed");
+    return -1;
+  }
+
   return 0;
 }
 
 void hue_rest_cleanup_ctx(struct hue_rest_ctx *ctx)
 {
+  hue_rest_cancel(ctx);
+
   free_if_not_null((void **)&ctx->username);
   free_if_not_null((void **)&ctx->address);
   free_if_not_null((void **)&ctx->received_data);
   free_if_not_null((void **)&ctx->upload_data);
-  free_if_not_null((void **)&ctx->ent_areas);
   free_if_not_null((void **)&ctx->apiversion);
   free_if_not_null((void **)&ctx->clientkey);
+  free_if_not_null((void **)&ctx->cache_path);
+  free_if_not_null((void **)&ctx->datastoreversion);
 
-  free_whitelist(ctx);
+  arena_free(&ctx->ent_areas_arena);
+  ctx->ent_areas = NULL;
+  ctx->ent_areas_count = 0;
+
+  arena_free(&ctx->whitelist_arena);
+  ctx->whitelist = NULL;
+  ctx->whitelist_count = 0;
+
+  if (ctx->curl)
+  {
+    curl_easy_cleanup(ctx->curl);
+    ctx->curl = NULL;
+  }
 }
 
 /* Called by cURL for PUT requests to get the data we want to send */
@@ -227,11 +315,17 @@ static size_t curl_write_cb(void *contents, size_t size, size_t nmemb, void *use
   return nmemb;
 }
 
-static int configure_curl(struct hue_rest_ctx *ctx, enum req_type rt, const char *url)
+/* Set up ctx->curl for a request */
+static int setup_request(struct hue_rest_ctx *ctx, enum req_type rt, const char *url)
 {
-  CURLcode res;
   CURL *curl = ctx->curl;
-  curl = curl_easy_init();
+
+  if (ctx->pending)
+  {
+    hue_debug(ctx, HUE_MSG_ERR, "setup_request> asynchronous request already in progress");
+    return -1;
+  }
+
   if (ctx->received_data)
     free(ctx->received_data);
 
@@ -240,6 +334,9 @@ static int configure_curl(struct hue_rest_ctx *ctx, enum req_type rt, const char
 
   if (curl)
   {
+    /* Clear the last request's options; the open connection, TLS session and DNS cache are kept */
+    curl_easy_reset(curl);
+
     curl_easy_setopt(curl, CURLOPT_DEBUGFUNCTION, curl_trace_cb);
     curl_easy_setopt(curl, CURLOPT_DEBUGDATA, ctx);
     curl_easy_setopt(curl, CURLOPT_VERBOSE, 1L);
@@ -257,6 +354,12 @@ static int configure_curl(struct hue_rest_ctx *ctx, enum req_type rt, const char
     /* wait a maximum of 10 seconds before giving up */
     curl_easy_setopt(curl, CURLOPT_TIMEOUT, 10L);
 
+    /* Keep the connection alive between (e.g. periodic) requests */
+    curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE, 1L);
+
+    /* The bodies are tiny; don't wait (up to a second) for a 100 Continue before sending them */
+    curl_easy_setopt(curl, CURLOPT_EXPECT_100_TIMEOUT_MS, 0L);
+
     if (rt == REQTYPE_PUT)
     {
       /* enable uploading */
@@ -285,31 +388,37 @@ static int configure_curl(struct hue_rest_ctx *ctx, enum req_type rt, const char
        name, not only a directory */
     curl_easy_setopt(curl, CURLOPT_URL, url);
 
-    /* Now run off and do what you've been told! */
-    res = curl_easy_perform(curl);
-
-    /* Check for errors */
-    if (res != CURLE_OK)
-      hue_debug(ctx, HUE_MSG_ERR, "curl_easy_perform() failed: %s", curl_easy_strerror(res));
-    else
-      hue_debug(ctx, HUE_MSG_INFO, " < %.*s", ctx->received_data_length, ctx->received_data);
-
-    /* always cleanup */
-    curl_easy_cleanup(curl);
-
-    return (res == CURLE_OK ? 0 : -1);
+    return 0;
   }
   else
   {
-    hue_debug(ctx, HUE_MSG_ERR, "curl_easy_init() failed");
+    hue_debug(ctx, HUE_MSG_ERR, "setup_request> no curl handle (hue_rest_init_ctx failed?)");
     return -1;
   }
 }
 
-int hue_rest_activate_stream(struct hue_rest_ctx *ctx, int group)
+static int request_done(struct hue_rest_ctx *ctx, CURLcode res)
+{
+  /* Check for errors */
+  if (res != CURLE_OK)
+    hue_debug(ctx, HUE_MSG_ERR, "curl request failed: %s", curl_easy_strerror(res));
+  else
+    hue_debug(ctx, HUE_MSG_INFO, " < %.*s", ctx->received_data_length, ctx->received_data);
+
+  return (res == CURLE_OK ? 0 : -1);
+}
+
+static int configure_curl(struct hue_rest_ctx *ctx, enum req_type rt, const char *url)
+{
+  if (setup_request(ctx, rt, url))
+    return -1;
+
+  /* Now run off and do what you've been told! */
+  return request_done(ctx, curl_easy_perform(ctx->curl));
+}
+
+static int prepare_activate_stream(struct hue_rest_ctx *ctx, int group, char *url, int url_len)
 {
-  char url[254];
-  int retval;
   const char *activate_stream = "{\"stream\":{\"active\":true}}";
 
   ctx->upload_data_length = strlen(activate_stream)+1;
@@ -318,164 +427,123 @@ int hue_rest_activate_stream(struct hue_rest_ctx *ctx, int group)
   strcpy(ctx->upload_data, activate_stream);
 
   /* build up URL */
-  snprintf(url, sizeof(url), "https://%s:%d/api/%s/groups/%d",
+  snprintf(url, url_len, "https://%s:%d/api/%s/groups/%d",
            ctx->address, ctx->port, ctx->username, group);
-  url[sizeof(url)-1] = '\0';
+  url[url_len-1] = '\0';
   hue_debug(ctx, HUE_MSG_INFO, "URL = %s", url);
 
-  /* make PUT request */
-  retval = configure_curl(ctx, REQTYPE_PUT, url);
+  return 0;
+}
 
+static void free_upload_data(struct hue_rest_ctx *ctx)
+{
   if (ctx->upload_data)
   {
     free(ctx->upload_data);
     ctx->upload_data = NULL;
     ctx->upload_data_length = 0;
   }
+}
 
+static int finish_activate_stream(struct hue_rest_ctx *ctx, int retval)
+{
+  free_upload_data(ctx);
   return retval;
 }
 
-/* Returns:
- * -1 Parse error (or other "bad" error)
- *  0 Not an error message
- *  1 Error messsage - out_type set
- */
-static int parse_error_message(struct hue_rest_ctx *ctx, const char* msg, int *out_type)
+int hue_rest_activate_stream(struct hue_rest_ctx *ctx, int group)
 {
-  char *error_msg;
-
-  hue_debug(ctx, HUE_MSG_DEBUG, "parse_error_message> %s", msg);
-
-  json_object *jobj = json_tokener_parse(msg);
-  if (jobj == NULL)
-  {
-    hue_debug(ctx, HUE_MSG_ERR, "Failed to parse JSON received: %s", msg);
-    return -1;
-  }
-  *out_type = 0;
-
-  if (!json_object_is_type(jobj, json_type_array))
-  {
-     hue_debug(ctx, HUE_MSG_DEBUG, "Not an error message (not an array)");
-     json_object_put(jobj);
-     return 0;
-  }
-
-  if (json_object_array_length(jobj) <= 0)
-  {
-    hue_debug(ctx, HUE_MSG_DEBUG, "Not an error");
-    json_object_put(jobj);
-    return 0;
-  }
-
-  json_object *obj = json_object_array_get_idx(jobj, 0);
-
-  json_object *obj_param = NULL;
-  json_object_object_get_ex(obj, "error", &obj_param);
-  if (obj_param == NULL)
-  {
-    hue_debug(ctx, HUE_MSG_DEBUG, "Not an error message");
-    json_object_put(jobj);
-    return 0;
-  }
+  char url[254];
 
-  error_msg = malloc(strlen(json_object_get_string(obj_param)) + 1);
-  if (error_msg == NULL)
+  /* Before touching upload_data, which an asynchronous request could be using */
+  if (ctx->pending)
   {
-    hue_debug(ctx, HUE_MSG_ERR, "parse_error_message> Failed to allocate memory!");
-    json_object_put(jobj);
+    hue_debug(ctx, HUE_MSG_ERR, "hue_rest_activate_stream> asynchronous request already in progress");
     return -1;
   }
-  strcpy(error_msg, json_object_get_string(obj_param));
-
-  json_object_put(jobj);
-  jobj = json_tokener_parse(error_msg);
-
-  json_object_object_get_ex(jobj, "type", &obj_param);
 
-  if (obj_param == NULL)
-  {
-    hue_debug(ctx, HUE_MSG_ERR, "Failed to find type in error message");
-    json_object_put(jobj);
-    free(error_msg);
+  if (prepare_activate_stream(ctx, group, url, sizeof(url)))
     return -1;
-  }
-
-  *out_type = json_object_get_int(obj_param);
-  hue_debug(ctx, HUE_MSG_DEBUG, "error type: %d", *out_type);
-  json_object_put(jobj);
-  free(error_msg);
 
-  return 1;
+  /* make PUT request */
+  return finish_activate_stream(ctx, configure_curl(ctx, REQTYPE_PUT, url));
 }
 
-/* If not null, free the return value when finished with it.
- * 
- * Expects to find a JSON config message from the bridge in
- * ctx->received_data, and returns the "whitelist" part
- * (still JSON).
+/* Parse the response in ctx->received_data. Each response is tokenized once, here, and the parse_*
+ * functions below walk the tree. The bridge reports failures as
+ * [{"error":{"type":1,"address":"/","description":"unauthorized user"}}], which is picked out on the way.
+ *
+ * Returns:
+ * -1 Parse error (or other "bad" error)
+ *  0 Not an error message - *out_jobj set, release with json_object_put
+ * >0 Error type reported by the bridge (HUE_ERR_*)
  */
-static char* extract_json_whitelist_from_config(struct hue_rest_ctx *ctx)
+static int parse_response(struct hue_rest_ctx *ctx, json_object **out_jobj)
 {
-  char *retval = NULL;
-  struct json_object_iterator it;
-  struct json_object_iterator itEnd;
+  json_object *jobj;
+  json_object *obj_error = NULL;
+  json_object *obj_type = NULL;
+  int error_type;
 
-  json_object *jobj = json_tokener_parse(ctx->received_data);
+  *out_jobj = NULL;
+  hue_debug(ctx, HUE_MSG_DEBUG, "parse_response> %s", ctx->received_data);
+
+  jobj = json_tokener_parse(ctx->received_data);
   if (jobj == NULL)
   {
     hue_debug(ctx, HUE_MSG_ERR, "Failed to parse JSON received: %s", ctx->received_data);
-    return NULL;
+    return -1;
   }
 
-  if (json_object_get_type(jobj) !=  json_type_object)
+  if (!json_object_is_type(jobj, json_type_array) || json_object_array_length(jobj) <= 0 ||
+      !json_object_object_get_ex(json_object_array_get_idx(jobj, 0), "error", &obj_error))
   {
-    hue_debug(ctx, HUE_MSG_INFO, "Unexpected JSON received");
-    json_object_put(jobj);
-    return NULL;
+    *out_jobj = jobj;
+    return 0;
   }
 
-  it = json_object_iter_begin(jobj);
-  itEnd = json_object_iter_end(jobj);
-  while (!json_object_iter_equal(&it, &itEnd))
+  if (!json_object_object_get_ex(obj_error, "type", &obj_type))
   {
-    if (!strcmp("whitelist", json_object_iter_peek_name(&it)))
-    {
-      const char *whitelist_json = json_object_get_string(json_object_iter_peek_value(&it));
-      retval = malloc(strlen(whitelist_json)+1);
-      strcpy(retval, whitelist_json);
-      json_object_put(jobj);
-      return retval;
-    }
-    json_object_iter_next(&it);
+    hue_debug(ctx, HUE_MSG_ERR, "Failed to find type in error message");
+    json_object_put(jobj);
+    return -1;
   }
 
+  error_type = json_object_get_int(obj_type);
+  hue_debug(ctx, HUE_MSG_DEBUG, "error type: %d", error_type);
   json_object_put(jobj);
-  return NULL;
+
+  return error_type > 0 ? error_type : -1;
 }
 
 /* For a JSON string with key/value pairs, extract the value given a key.
  * On failure, NULL is returned, otherwise the return value is a pointer
- * to the value, which must be free'd when finished with.
+ * into jobj, valid until jobj is released.
  */
-static char *get_value_from_jobj(struct hue_rest_ctx *ctx, json_object *jobj, const char *key)
+static const char *get_string_from_jobj(struct hue_rest_ctx *ctx, json_object *jobj, const char *key)
 {
-  char *value = NULL;
-
   json_object *obj_param = NULL;
   if (!json_object_object_get_ex(jobj, key, &obj_param))
   {
-    hue_debug(ctx, HUE_MSG_ERR, "get_value_from_jobj> Failed to get [%s] from JSON", key);
+    hue_debug(ctx, HUE_MSG_ERR, "get_string_from_jobj> Failed to get [%s] from JSON", key);
     return NULL;
   }
 
   const char *param_val = json_object_get_string(obj_param);
   if (param_val == NULL)
-  {
-    hue_debug(ctx, HUE_MSG_ERR, "get_value_from_jobj> failed to get value for [%s]", key);
+    hue_debug(ctx, HUE_MSG_ERR, "get_string_from_jobj> failed to get value for [%s]", key);
+
+  return param_val;
+}
+
+/* As get_string_from_jobj(), but the return value is a copy, which must be free'd when finished with */
+static char *get_value_from_jobj(struct hue_rest_ctx *ctx, json_object *jobj, const char *key)
+{
+  char *value = NULL;
+  const char *param_val;
+
+  if (!(param_val = get_string_from_jobj(ctx, jobj, key)))
     return NULL;
-  }
 
   value = calloc(strlen(param_val)+1, 1);
   if (value)
@@ -487,45 +555,33 @@ static char *get_value_from_jobj(struct hue_rest_ctx *ctx, json_object *jobj, co
 }
 
 // {"name":"Hue Bridge","datastoreversion":"99","swversion":"1943185030","apiversion":"1.43.0","mac":"00:17:88:2d:30:81","bridgeid":"001788FFFE2D3081","factorynew":false,"replacesbridgeid":null,"modelid":"BSB002","starterkitid":""}
-static int parse_unauth_configuration_response_json(struct hue_rest_ctx *ctx)
+static int parse_unauth_configuration_response_json(struct hue_rest_ctx *ctx, json_object *jobj)
 {
-  const char *apiversion;
-  hue_debug(ctx, HUE_MSG_DEBUG, "parse_unauth_configuration_response> %s", ctx->received_data);
-
-  json_object *jobj = json_tokener_parse(ctx->received_data);
-  if (jobj == NULL)
-  {
-    hue_debug(ctx, HUE_MSG_ERR, "parse_unauth_configuration_response> Failed to parse JSON received: %s", ctx->received_data);
-    return -1;
-  }
+  json_object *obj_param = NULL;
 
   free_if_not_null((void **)&ctx->apiversion);
   ctx->apiversion = get_value_from_jobj(ctx, jobj, "apiversion");
-  json_object_put(jobj);
+
+  /* Older bridges don't report a datastoreversion; the topology cache just isn't written for them */
+  free_if_not_null((void **)&ctx->datastoreversion);
+  if (json_object_object_get_ex(jobj, "datastoreversion", &obj_param) && json_object_get_string(obj_param))
+  {
+    if ((ctx->datastoreversion = malloc(strlen(json_object_get_string(obj_param))+1)))
+      strcpy(ctx->datastoreversion, json_object_get_string(obj_param));
+  }
 
   return 0;
 }
 
 // [{"success":{"username":"xM7Kno9zv7J8vIiM0rTjPU1NJsMjJpafXG4q8yqQ","clientkey":"B95676C8F5E21AEAD54E5D8A38844A21"}}]
-static int parse_register_response(struct hue_rest_ctx *ctx)
+static int parse_register_response(struct hue_rest_ctx *ctx, json_object *jobj)
 {
-  hue_debug(ctx, HUE_MSG_DEBUG, "parse_register_response> %s", ctx->received_data);
-
-  json_object *jobj = json_tokener_parse(ctx->received_data);
-  if (jobj == NULL)
-  {
-    hue_debug(ctx, HUE_MSG_ERR, "parse_register_response> Failed to parse JSON received: %s", ctx->received_data);
-    return -1;
-  }
-
-  json_object *obj = json_object_array_get_idx(jobj, 0);
-  // TODO: obj type check
   json_object *obj_param = NULL;
-  json_object_object_get_ex(obj, "success", &obj_param);
-  if (obj_param == NULL)
+
+  if (!json_object_is_type(jobj, json_type_array) || json_object_array_length(jobj) <= 0 ||
+      !json_object_object_get_ex(json_object_array_get_idx(jobj, 0), "success", &obj_param))
   {
     hue_debug(ctx, HUE_MSG_ERR, "parse_register_response> Not an success message");
-    json_object_put(jobj);
     return -1;
   }
 
@@ -533,150 +589,89 @@ static int parse_register_response(struct hue_rest_ctx *ctx)
   free_if_not_null((void **)&ctx->clientkey);
   ctx->username  = get_value_from_jobj(ctx, obj_param, "username");
   ctx->clientkey = get_value_from_jobj(ctx, obj_param, "clientkey");
-  json_object_put(jobj);
 
   return 0;
 }
 
-/* Populate entry_ptr with username, and last use date / created date / name extracted from data.
- * Note that memory is allocted for entry_ptr->last_use_date, ->created_date, etc. so must be free'd
- * when finished with (dealt with by free_whitelist())
+/* Populate entry_ptr with username, and last use date / created date / name extracted from jobj.
+ * Note that the strings are allocated from ctx->whitelist_arena, so are released by free_whitelist()
  */
-static int add_whitelist_entry(struct hue_rest_ctx *ctx, struct hue_whitelist_entry *entry_ptr, const char *username, const char *data)
+static void add_whitelist_entry(struct hue_rest_ctx *ctx, struct hue_whitelist_entry *entry_ptr, const char *username, json_object *jobj)
 {
-  /* Extract last use date, created date & name from data and save into entry_ptr */
-
-  json_object *jobj = json_tokener_parse(data);
-  if (jobj == NULL)
-  {
-    hue_debug(ctx, HUE_MSG_ERR, "Failed to parse JSON: %s", data);
-    return -1;
-  }
-
-  entry_ptr->last_use_date = get_value_from_jobj(ctx, jobj, "last use date");
-  entry_ptr->created_date  = get_value_from_jobj(ctx, jobj, "create date");
-  entry_ptr->name          = get_value_from_jobj(ctx, jobj, "name");
+  struct hue_rest_arena *arena = &ctx->whitelist_arena;
 
-  if ((entry_ptr->username = calloc(strlen(username)+1, 1)))
-    strcpy(entry_ptr->username, username);
-
-  json_object_put(jobj);
-  return 0;
+  entry_ptr->last_use_date = arena_strdup(arena, get_string_from_jobj(ctx, jobj, "last use date"));
+  entry_ptr->created_date  = arena_strdup(arena, get_string_from_jobj(ctx, jobj, "create date"));
+  entry_ptr->name          = arena_strdup(arena, get_string_from_jobj(ctx, jobj, "name"));
+  entry_ptr->username      = arena_strdup(arena, username);
 }
 
-/* Extract the app whitelist from the passed in whitelist extracted from a config api request,
- * and store in ctx->whitelist
- */
-static int extract_json_entries_from_whitelist(struct hue_rest_ctx *ctx, char *json_whitelist)
+/* Extract the app whitelist from a config api response (jobj), and store in ctx->whitelist */
+static int parse_whitelist(struct hue_rest_ctx *ctx, json_object *jobj)
 {
   struct json_object_iterator it;
   struct json_object_iterator itEnd;
+  json_object *whitelist = NULL;
+  int count;
 
   free_whitelist(ctx);
 
-  if (json_whitelist == NULL)
+  if (!json_object_object_get_ex(jobj, "whitelist", &whitelist) || !json_object_is_type(whitelist, json_type_object))
   {
     hue_debug(ctx, HUE_MSG_INFO, "Empty/NULL whitelist!");
     return -1;
   }
 
-  json_object *jobj = json_tokener_parse(json_whitelist);
-  if (jobj == NULL)
+  count = json_object_object_length(whitelist);
+  if (count <= 0)
+    return 0;
+
+  ctx->whitelist = arena_alloc(&ctx->whitelist_arena, count * sizeof(struct hue_whitelist_entry));
+  if (ctx->whitelist == NULL)
   {
-    hue_debug(ctx, HUE_MSG_ERR, "Failed to parse JSON whitelist: %s", json_whitelist);
+    hue_debug(ctx, HUE_MSG_ERR, "parse_whitelist> failed to allocate memory!");
     return -1;
   }
 
-  it = json_object_iter_begin(jobj);
-  itEnd = json_object_iter_end(jobj);
+  it = json_object_iter_begin(whitelist);
+  itEnd = json_object_iter_end(whitelist);
   while (!json_object_iter_equal(&it, &itEnd))
   {
+    add_whitelist_entry(ctx, ctx->whitelist + ctx->whitelist_count, json_object_iter_peek_name(&it), json_object_iter_peek_value(&it));
     ctx->whitelist_count++;
     json_object_iter_next(&it);
   }
 
-  ctx->whitelist = calloc(sizeof(struct hue_whitelist_entry), ctx->whitelist_count);
-
-  it = json_object_iter_begin(jobj);
-  itEnd = json_object_iter_end(jobj);
-  struct hue_whitelist_entry *entry_ptr = ctx->whitelist;
-  while (!json_object_iter_equal(&it, &itEnd))
-  {
-    add_whitelist_entry(ctx, entry_ptr, json_object_iter_peek_name(&it), json_object_get_string(json_object_iter_peek_value(&it)));
-    entry_ptr++;
-    json_object_iter_next(&it);
-  }
-
-  json_object_put(jobj);
   return 0;
 }
 
-/* Extract entertainement areas from "/groups" api request, and return in out_areas/out_areas_count.
- * Note: On success, memory is allocated for out_areas, this must be free'd by the caller.
+/* Extract entertainement areas from a "/groups" api response (jobj), and return in out_areas/out_areas_count.
+ * Note: out_areas is allocated from ctx->ent_areas_arena.
  */
-static int parse_entertainment_groups_json(struct hue_rest_ctx *ctx, struct hue_entertainment_area **out_areas, int *out_areas_count)
+static int parse_entertainment_groups_json(struct hue_rest_ctx *ctx, json_object *jobj, struct hue_entertainment_area **out_areas, int *out_areas_count)
 {
-  int retval = 0;
-  int error_type;
   struct json_object_iterator it;
   struct json_object_iterator itEnd;
   struct hue_entertainment_area *areas;
+  int groups;
   *out_areas_count = 0;
 
-  json_object *jobj = json_tokener_parse(ctx->received_data);
-  if (jobj == NULL)
-  {
-    hue_debug(ctx, HUE_MSG_DEBUG, "Failed to parse JSON received: %s", ctx->received_data);
-    return -1;
-  }
-
-  if ((retval = parse_error_message(ctx, ctx->received_data, &error_type)))
-  {
-    if (retval < 0)
-    {
-      /* Parse error, or something bad */
-      hue_debug(ctx, HUE_MSG_ERR, "Failed to parse groups response");
-    }
-    else
-    {
-      /* Error has been reported by the bridge */
-      if (error_type == HUE_ERR_UNAUTHORIZED)
-        hue_debug(ctx, HUE_MSG_ERR, "Get groups failed: Unauthorized."); /* Link button on the bridge hasn't been pressed in the last 30s */
-      else
-        hue_debug(ctx, HUE_MSG_ERR, "Get groups failed: Unexpected error type (%d) received from bridge", error_type);
-
-      retval = error_type;
-    }
-    json_object_put(jobj);
-    return retval;
-  }
-
   if (json_object_get_type(jobj) !=  json_type_object)
   {
     hue_debug(ctx, HUE_MSG_DEBUG, "Unexpected JSON received");
-    json_object_put(jobj);
     return -1;
   }
 
-  /* Count the number of entertainment areas returned (probably only ever one?) */
-  it = json_object_iter_begin(jobj);
-  itEnd = json_object_iter_end(jobj);
-  while (!json_object_iter_equal(&it, &itEnd))
+  /* Room for every group, so the areas can be filled in as they're found; most won't be entertainment areas,
+   * but that costs less than walking the groups twice */
+  groups = json_object_object_length(jobj);
+  areas = arena_alloc(&ctx->ent_areas_arena, (groups > 0 ? groups : 1) * sizeof(struct hue_entertainment_area));
+  if (areas == NULL)
   {
-    json_object *obj_param = NULL;
-    json_object_object_get_ex(json_object_iter_peek_value (&it), "type", &obj_param);
-
-    if (!strcmp("Entertainment", json_object_get_string(obj_param)))
-      (*out_areas_count)++;
-    json_object_iter_next(&it);
+    hue_debug(ctx, HUE_MSG_ERR, "parse_entertainment_groups_json> failed to allocate memory!");
+    return -1;
   }
-
-  hue_debug(ctx, HUE_MSG_DEBUG, "found %d ent. area(s)", *out_areas_count);
-
-  /* Allocate memory for areas */
-  *out_areas = malloc(*out_areas_count * sizeof(struct hue_entertainment_area));
-  memset(*out_areas, 0, *out_areas_count * sizeof(struct hue_entertainment_area));
-  areas = *out_areas;
+  *out_areas = areas;
 
   /* Add areas found with ligts to out_areas */
   it = json_object_iter_begin(jobj);
@@ -684,78 +679,92 @@ static int parse_entertainment_groups_json(struct hue_rest_ctx *ctx, struct hue_
 
   while (!json_object_iter_equal(&it, &itEnd))
   {
-    const char *area_name;
+    const char *type = NULL;
     struct json_object *j1;
     j1 = json_object_iter_peek_value (&it);
     json_object *obj_param = NULL;
-    json_object_object_get_ex(j1, "type", &obj_param);
+    if (json_object_object_get_ex(j1, "type", &obj_param))
+      type = json_object_get_string(obj_param);
 
     /* Only interested in "Entertainment" type groups */
-    if (!strcmp("Entertainment", json_object_get_string(obj_param)))
+    if (type && !strcmp("Entertainment", type))
     {
       /* Get area name */
-      json_object_object_get_ex(j1, "name", &obj_param);
-      area_name = json_object_get_string(obj_param);
-      strncpy((*areas).area_name, area_name, AREA_NAME_LEN);
+      if (json_object_object_get_ex(j1, "name", &obj_param) && json_object_get_string(obj_param))
+        strncpy((*areas).area_name, json_object_get_string(obj_param), AREA_NAME_LEN);
 
       /* Get area id */
       (*areas).area_id = atoi(json_object_iter_peek_name(&it));
 
       /* Get light IDs */
-      json_object_object_get_ex(j1, "lights", &obj_param);
-      area_name = json_object_get_string(obj_param);
-
-      for (int n = 0; n < json_object_array_length(obj_param) && n < MAX_LIGHTS_PER_AREA; n++)
+      if (json_object_object_get_ex(j1, "lights", &obj_param))
       {
-        json_object *obj = json_object_array_get_idx(obj_param, n);
-        (*areas).light_ids[n] = json_object_get_int(obj);
+        for (int n = 0; n < json_object_array_length(obj_param) && n < MAX_LIGHTS_PER_AREA; n++)
+        {
+          json_object *obj = json_object_array_get_idx(obj_param, n);
+          (*areas).light_ids[n] = json_object_get_int(obj);
+        }
       }
       areas++;
+      (*out_areas_count)++;
     }
 
     json_object_iter_next(&it);
   }
 
-  json_object_put(jobj);
+  hue_debug(ctx, HUE_MSG_DEBUG, "found %d ent. area(s)", *out_areas_count);
+
   return 0;
 }
 
-int hue_rest_get_ent_groups(struct hue_rest_ctx *ctx, struct hue_entertainment_area **out_areas, int *out_areas_count)
+static void prepare_get_ent_groups(struct hue_rest_ctx *ctx, char *url, int url_len)
 {
-  char url[254];
-  int retval;
-  *out_areas_count = 0;
-  *out_areas = NULL;
-
   /* build up URL */
-  snprintf(url, sizeof(url), "https://%s:%d/api/%s/groups",
+  snprintf(url, url_len, "https://%s:%d/api/%s/groups",
            ctx->address, ctx->port, ctx->username);
-  url[sizeof(url)-1] = '\0';
+  url[url_len-1] = '\0';
   hue_debug(ctx, HUE_MSG_INFO, "URL = %s", url);
+}
 
-  /* make GET request */
-  retval = configure_curl(ctx, REQTYPE_GET, url);
+static int finish_get_ent_groups(struct hue_rest_ctx *ctx, int retval, struct hue_entertainment_area **out_areas, int *out_areas_count)
+{
+  json_object *jobj;
 
-  if (ctx->ent_areas)
-  {
-    free(ctx->ent_areas);
-    ctx->ent_areas = NULL;
-  }
+  *out_areas_count = 0;
+  *out_areas = NULL;
 
-  if (retval)
+  arena_reset(&ctx->ent_areas_arena);
+  ctx->ent_areas = NULL;
+  ctx->ent_areas_count = 0;
+
+  if (retval)
   {
-    hue_debug(ctx, HUE_MSG_DEBUG, "GET request failed.", url);
+    hue_debug(ctx, HUE_MSG_DEBUG, "GET request failed.");
     return -1;
   }
 
-  if (parse_entertainment_groups_json(ctx, out_areas, out_areas_count))
+  if ((retval = parse_response(ctx, &jobj)))
+  {
+    if (retval < 0)
+      hue_debug(ctx, HUE_MSG_ERR, "Failed to parse groups response"); /* Parse error, or something bad */
+    else if (retval == HUE_ERR_UNAUTHORIZED)
+      hue_debug(ctx, HUE_MSG_ERR, "Get groups failed: Unauthorized.");
+    else
+      hue_debug(ctx, HUE_MSG_ERR, "Get groups failed: Unexpected error type (%d) received from bridge", retval);
+    return -1;
+  }
+
+  retval = parse_entertainment_groups_json(ctx, jobj, out_areas, out_areas_count);
+  json_object_put(jobj);
+  if (retval)
   {
-    hue_debug(ctx, HUE_MSG_DEBUG, "Failed to get entertainment group", url);
+    hue_debug(ctx, HUE_MSG_DEBUG, "Failed to get entertainment group");
     return -1;
   }
 
-  /* Keep track of memory so it can be freeded in hue_rest_cleanup_ctx */
+  /* Keep track of the areas, which stay valid until the next request or hue_rest_cleanup_ctx */
   ctx->ent_areas = *out_areas;
+  ctx->ent_areas_count = *out_areas_count;
 
   return retval;
 }
@@ -765,6 +774,7 @@ static int get_config(struct hue_rest_ctx *ctx)
 {
   char url[254];
   int retval;
+  json_object *jobj;
 
   free_whitelist(ctx);
 
@@ -784,9 +794,14 @@ static int get_config(struct hue_rest_ctx *ctx)
     return -1;
   }
 
-  char *whitelist_json = extract_json_whitelist_from_config(ctx);
-  extract_json_entries_from_whitelist(ctx, whitelist_json);
-  free(whitelist_json);
+  if (parse_response(ctx, &jobj))
+  {
+    hue_debug(ctx, HUE_MSG_DEBUG, "Failed to get config");
+    return -1;
+  }
+
+  parse_whitelist(ctx, jobj);
+  json_object_put(jobj);
 
   return retval;
 }
@@ -844,46 +859,57 @@ int hue_rest_delete_user(struct hue_rest_ctx *ctx, const char *username)
   return retval;
 }
 
-int get_unauth_config(struct hue_rest_ctx *ctx)
+static void prepare_unauth_config(struct hue_rest_ctx *ctx, char *url, int url_len)
 {
-  int retval;
-  char url[254];
-
   /* build up URL*/
-  snprintf(url, sizeof(url), "https://%s:%d/api/config", ctx->address, ctx->port);
-  url[sizeof(url)-1] = '\0';
+  snprintf(url, url_len, "https://%s:%d/api/config", ctx->address, ctx->port);
+  url[url_len-1] = '\0';
   hue_debug(ctx, HUE_MSG_INFO, "URL = %s", url);
+}
 
+static int finish_unauth_config(struct hue_rest_ctx *ctx, int retval)
+{
+  json_object *jobj;
 
-  /* make GET request */
-  retval = configure_curl(ctx, REQTYPE_GET, url);
-
-  if (ctx->apiversion)
-    ctx->apiversion = NULL;
+  free_if_not_null((void **)&ctx->apiversion);
+  free_if_not_null((void **)&ctx->datastoreversion);
 
   if (retval)
   {
-    hue_debug(ctx, HUE_MSG_DEBUG, "GET request failed.", url);
+    hue_debug(ctx, HUE_MSG_DEBUG, "GET request failed.");
     return -1;
   }
 
-  if (parse_unauth_configuration_response_json(ctx))
+  if (parse_response(ctx, &jobj))
   {
-    hue_debug(ctx, HUE_MSG_DEBUG, "Failed to get unauth config", url);
+    hue_debug(ctx, HUE_MSG_DEBUG, "Failed to get unauth config");
     return -1;
   }
 
+  retval = parse_unauth_configuration_response_json(ctx, jobj);
+  json_object_put(jobj);
+
   return retval;
 }
 
-int hue_rest_validate_apiversion(struct hue_rest_ctx *ctx)
+int get_unauth_config(struct hue_rest_ctx *ctx)
+{
+  char url[254];
+
+  prepare_unauth_config(ctx, url, sizeof(url));
+
+  /* make GET request */
+  return finish_unauth_config(ctx, configure_curl(ctx, REQTYPE_GET, url));
+}
+
+static int finish_validate_apiversion(struct hue_rest_ctx *ctx, int unauth_config_retval)
 {
   int retval;
   char api_version_needed[] = HUE_ENTERTAINMENT_API_NEEDED;
 
-  if(get_unauth_config(ctx))
+  if (unauth_config_retval || !ctx->apiversion)
   {
-    hue_debug(ctx, HUE_MSG_DEBUG, "Failed to compare version string", NULL);
+    hue_debug(ctx, HUE_MSG_DEBUG, "Failed to compare version string");
     return -1;
   }
 
@@ -897,16 +923,347 @@ int hue_rest_validate_apiversion(struct hue_rest_ctx *ctx)
   return 0;
 }
 
+/* Topology cache (see hue_rest_set_cache). A short text file, readable only by its owner; the username (the
+ * bridge API key) is stored as its SHA-256, so the file can't be used to talk to the bridge:
+ *
+ *   hue_rest_cache 2
+ *   address 192.168.1.2
+ *   user 9f86d081884c7d659a2feaa0c55ad015a3bf4f1b2b0b822cd15d6c15b0f00a08
+ *   datastoreversion 99
+ *   apiversion 1.43.0
+ *   areas 1
+ *   area <area id> <light count> <light id>... <area name>
+ */
+#define CACHE_VERSION    "2"
+#define CACHE_LINE_LEN   256
+#define CACHE_TMP_SUFFIX ".XXXXXX"
+
+/* Hex SHA-256 of ctx->username, which is what the cache stores in its place */
+static void cache_user_hash(struct hue_rest_ctx *ctx, char out_hash[SHA256_DIGEST_LENGTH*2+1])
+{
+  unsigned char digest[SHA256_DIGEST_LENGTH];
+
+  SHA256((const unsigned char *)ctx->username, strlen(ctx->username), digest);
+  for (int i = 0; i < SHA256_DIGEST_LENGTH; i++)
+    sprintf(out_hash + i*2, "%02x", digest[i]);
+}
+
+/* Read the next line of f, which should be "<key> <value>", into out_value */
+static int cache_read_value(FILE *f, const char *key, char *out_value, int value_len)
+{
+  char line[CACHE_LINE_LEN];
+  size_t key_len = strlen(key);
+
+  if (!fgets(line, sizeof(line), f))
+    return -1;
+  line[strcspn(line, "\n")] = '\0';
+
+  if (strncmp(line, key, key_len) || line[key_len] != ' ')
+    return -1;
+
+  snprintf(out_value, value_len, "%s", line + key_len + 1);
+  return 0;
+}
+
+static int cache_parse_area(struct hue_entertainment_area *area, char *value)
+{
+  char *end;
+  long light_count;
+
+  area->area_id = strtol(value, &end, 10);
+  if (end == value)
+    return -1;
+  value = end;
+
+  light_count = strtol(value, &end, 10);
+  if (end == value || light_count < 0 || light_count > MAX_LIGHTS_PER_AREA)
+    return -1;
+  value = end;
+
+  for (int n = 0; n < light_count; n++)
+  {
+    area->light_ids[n] = strtol(value, &end, 10);
+    if (end == value)
+      return -1;
+    value = end;
+  }
+
+  if (*value == ' ')
+    value++;
+  snprintf(area->area_name, AREA_NAME_LEN, "%s", value);
+
+  return 0;
+}
+
+static int cache_parse_header(struct hue_rest_ctx *ctx, FILE *f, char *out_datastoreversion, int datastoreversion_len,
+                              char *out_apiversion, int apiversion_len)
+{
+  char value[CACHE_LINE_LEN];
+  char user_hash[SHA256_DIGEST_LENGTH*2+1];
+
+  cache_user_hash(ctx, user_hash);
+
+  /* Must have been written for this bridge and user, by this version of the code */
+  if (cache_read_value(f, "hue_rest_cache", value, sizeof(value)) || strcmp(value, CACHE_VERSION) ||
+      cache_read_value(f, "address", value, sizeof(value))        || strcmp(value, ctx->address) ||
+      cache_read_value(f, "user", value, sizeof(value))           || strcmp(value, user_hash) ||
+      cache_read_value(f, "datastoreversion", out_datastoreversion, datastoreversion_len) ||
+      cache_read_value(f, "apiversion", out_apiversion, apiversion_len))
+    return -1;
+
+  return 0;
+}
+
+static int cache_parse(struct hue_rest_ctx *ctx, FILE *f, char *out_datastoreversion, int datastoreversion_len,
+                       char *out_apiversion, int apiversion_len)
+{
+  char value[CACHE_LINE_LEN];
+  struct hue_entertainment_area *areas;
+  int count;
+
+  if (cache_parse_header(ctx, f, out_datastoreversion, datastoreversion_len, out_apiversion, apiversion_len) ||
+      cache_read_value(f, "areas", value, sizeof(value)) || (count = atoi(value)) < 0)
+    return -1;
+
+  if (!(areas = arena_alloc(&ctx->ent_areas_arena, (count > 0 ? count : 1) * sizeof(struct hue_entertainment_area))))
+    return -1;
+
+  for (int n = 0; n < count; n++)
+  {
+    if (cache_read_value(f, "area", value, sizeof(value)) || cache_parse_area(areas + n, value))
+      return -1;
+  }
+
+  ctx->ent_areas = areas;
+  ctx->ent_areas_count = count;
+  return 0;
+}
+
+/* Load the cached areas into ctx->ent_areas. Returns 0 if the cache exists and was written for this bridge */
+static int cache_read(struct hue_rest_ctx *ctx, char *out_datastoreversion, int datastoreversion_len,
+                      char *out_apiversion, int apiversion_len)
+{
+  FILE *f;
+  int retval;
+
+  arena_reset(&ctx->ent_areas_arena);
+  ctx->ent_areas = NULL;
+  ctx->ent_areas_count = 0;
+
+  if (!(f = fopen(ctx->cache_path, "r")))
+  {
+    hue_debug(ctx, HUE_MSG_DEBUG, "No topology cache at %s", ctx->cache_path);
+    return -1;
+  }
+
+  retval = cache_parse(ctx, f, out_datastoreversion, datastoreversion_len, out_apiversion, apiversion_len);
+  fclose(f);
+
+  if (retval)
+  {
+    hue_debug(ctx, HUE_MSG_INFO, "Ignoring topology cache %s (for another bridge, or corrupt)", ctx->cache_path);
+    arena_reset(&ctx->ent_areas_arena);
+    ctx->ent_areas = NULL;
+    ctx->ent_areas_count = 0;
+  }
+
+  return retval;
+}
+
+/* Read just the apiversion from the cache, leaving ctx->ent_areas (and the arena they're in) alone */
+static int cache_read_apiversion(struct hue_rest_ctx *ctx, char *out_apiversion, int apiversion_len)
+{
+  char datastoreversion[CACHE_LINE_LEN];
+  FILE *f;
+  int retval;
+
+  if (!(f = fopen(ctx->cache_path, "r")))
+    return -1;
+
+  retval = cache_parse_header(ctx, f, datastoreversion, sizeof(datastoreversion), out_apiversion, apiversion_len);
+  fclose(f);
+
+  return retval;
+}
+
+/* Write ctx->ent_areas to the cache, keyed by ctx->datastoreversion. Written to a uniquely named temporary file
+ * and renamed into place, so a reader never sees half a cache, and two writers sharing it can't mix theirs up */
+static int cache_write(struct hue_rest_ctx *ctx)
+{
+  char tmp_path[PATH_MAX];
+  char user_hash[SHA256_DIGEST_LENGTH*2+1];
+  FILE *f;
+  int fd;
+  int n;
+
+  if (!ctx->datastoreversion)
+  {
+    hue_debug(ctx, HUE_MSG_DEBUG, "Not writing topology cache: bridge datastoreversion unknown");
+    return -1;
+  }
+
+  snprintf(tmp_path, sizeof(tmp_path), "%s" CACHE_TMP_SUFFIX, ctx->cache_path);
+  if ((fd = mkstemp(tmp_path)) < 0)
+  {
+    hue_debug(ctx, HUE_MSG_ERR, "Failed to write topology cache %s", tmp_path);
+    return -1;
+  }
+
+  if (fchmod(fd, 0600) || !(f = fdopen(fd, "w")))
+  {
+    hue_debug(ctx, HUE_MSG_ERR, "Failed to write topology cache %s", tmp_path);
+    close(fd);
+    unlink(tmp_path);
+    return -1;
+  }
+
+  cache_user_hash(ctx, user_hash);
+  fprintf(f, "hue_rest_cache %s\naddress %s\nuser %s\ndatastoreversion %s\napiversion %s\nareas %d\n",
+          CACHE_VERSION, ctx->address, user_hash, ctx->datastoreversion,
+          ctx->apiversion ? ctx->apiversion : "", ctx->ent_areas_count);
+
+  for (int i = 0; i < ctx->ent_areas_count; i++)
+  {
+    struct hue_entertainment_area *area = ctx->ent_areas + i;
+
+    for (n = 0; n < MAX_LIGHTS_PER_AREA && area->light_ids[n]; n++)
+      ;
+    fprintf(f, "area %d %d", area->area_id, n);
+    for (int j = 0; j < n; j++)
+      fprintf(f, " %d", area->light_ids[j]);
+    fprintf(f, " %.*s\n", (int)strnlen(area->area_name, AREA_NAME_LEN-1), area->area_name);
+  }
+
+  if (fclose(f) || rename(tmp_path, ctx->cache_path))
+  {
+    hue_debug(ctx, HUE_MSG_ERR, "Failed to write topology cache %s", ctx->cache_path);
+    unlink(tmp_path);
+    return -1;
+  }
+
+  hue_debug(ctx, HUE_MSG_DEBUG, "Wrote topology cache %s (datastoreversion %s)", ctx->cache_path, ctx->datastoreversion);
+  return 0;
+}
+
+/* Try to get the entertainment areas from the cache, into ctx->ent_areas. Returns 0 on a hit */
+static int cache_lookup(struct hue_rest_ctx *ctx)
+{
+  char datastoreversion[CACHE_LINE_LEN];
+  char apiversion[CACHE_LINE_LEN];
+  int cached;
+
+  cached = !cache_read(ctx, datastoreversion, sizeof(datastoreversion), apiversion, sizeof(apiversion));
+  if (cached && ctx->cache_mode == HUE_REST_CACHE_TRUST)
+  {
+    hue_debug(ctx, HUE_MSG_INFO, "Using topology cache %s without checking the bridge", ctx->cache_path);
+    return 0;
+  }
+
+  /* The one cheap request; on a miss, the datastoreversion is still needed to write the cache */
+  if (!ctx->datastoreversion && get_unauth_config(ctx))
+    cached = 0;
+
+  if (cached && ctx->datastoreversion && !strcmp(ctx->datastoreversion, datastoreversion))
+  {
+    hue_debug(ctx, HUE_MSG_INFO, "Using topology cache %s (datastoreversion %s)", ctx->cache_path, datastoreversion);
+    return 0;
+  }
+
+  if (cached)
+    hue_debug(ctx, HUE_MSG_INFO, "Topology cache %s is stale", ctx->cache_path);
+
+  arena_reset(&ctx->ent_areas_arena);
+  ctx->ent_areas = NULL;
+  ctx->ent_areas_count = 0;
+
+  return -1;
+}
+
+int hue_rest_set_cache(struct hue_rest_ctx *ctx, const char *path, int mode)
+{
+  free_if_not_null((void **)&ctx->cache_path);
+  ctx->cache_mode = mode;
+
+  if (path == NULL)
+    return 0;
+
+  if (mode != HUE_REST_CACHE_VALIDATE && mode != HUE_REST_CACHE_TRUST)
+  {
+    hue_debug(ctx, HUE_MSG_ERR, "hue_rest_set_cache> invalid mode (%d)", mode);
+    return -1;
+  }
+
+  if (strlen(path) + sizeof(CACHE_TMP_SUFFIX) > PATH_MAX || !(ctx->cache_path = malloc(strlen(path)+1)))
+    return -1;
+  strcpy(ctx->cache_path, path);
+
+  return 0;
+}
+
+int hue_rest_get_ent_groups(struct hue_rest_ctx *ctx, struct hue_entertainment_area **out_areas, int *out_areas_count)
+{
+  char url[254];
+  int retval;
+
+  if (ctx->cache_path && !cache_lookup(ctx))
+  {
+    *out_areas = ctx->ent_areas;
+    *out_areas_count = ctx->ent_areas_count;
+    retval = 0;
+  }
+  else
+  {
+    prepare_get_ent_groups(ctx, url, sizeof(url));
+
+    /* make GET request */
+    retval = finish_get_ent_groups(ctx, configure_curl(ctx, REQTYPE_GET, url), out_areas, out_areas_count);
+
+    if (!retval && ctx->cache_path)
+      cache_write(ctx);
+  }
+
+  /* Only used once, so a long running app doesn't keep trusting an old datastoreversion */
+  free_if_not_null((void **)&ctx->datastoreversion);
+
+  return retval;
+}
+
+int hue_rest_validate_apiversion(struct hue_rest_ctx *ctx)
+{
+  char apiversion[CACHE_LINE_LEN];
+
+  /* Offline start: take the apiversion from the cache too */
+  if (ctx->cache_path && ctx->cache_mode == HUE_REST_CACHE_TRUST &&
+      !cache_read_apiversion(ctx, apiversion, sizeof(apiversion)) && apiversion[0])
+  {
+    free_if_not_null((void **)&ctx->apiversion);
+    if ((ctx->apiversion = malloc(strlen(apiversion)+1)))
+    {
+      strcpy(ctx->apiversion, apiversion);
+      return finish_validate_apiversion(ctx, 0);
+    }
+  }
+
+  return finish_validate_apiversion(ctx, get_unauth_config(ctx));
+}
+
 int hue_rest_register(struct hue_rest_ctx *ctx, char **out_username, char **out_clientkey)
 {
   char url[254];
   int retval;
   const char *devicetype;
-  int error_type;
+  json_object *jobj;
 
   *out_username  = NULL;
   *out_clientkey = NULL;
 
+  /* Before touching upload_data, which an asynchronous request could be using */
+  if (ctx->pending)
+  {
+    hue_debug(ctx, HUE_MSG_ERR, "hue_rest_register> asynchronous request already in progress");
+    return -1;
+  }
+
   /* build up URL */
   snprintf(url, sizeof(url), "https://%s:%d/api", ctx->address, ctx->port);
   url[sizeof(url)-1] = '\0';
@@ -935,7 +1292,7 @@ int hue_rest_register(struct hue_rest_ctx *ctx, char **out_username, char **out_
     return -1;
   }
 
-  if ((retval = parse_error_message(ctx, ctx->received_data, &error_type)))
+  if ((retval = parse_response(ctx, &jobj)))
   {
     if (retval < 0)
     {
@@ -945,26 +1302,311 @@ int hue_rest_register(struct hue_rest_ctx *ctx, char **out_username, char **out_
     else
     {
       /* Error has been reported by the bridge */
-      if (error_type == HUE_ERR_LINK_BUTTON_NOT_PUSHED)
+      if (retval == HUE_ERR_LINK_BUTTON_NOT_PUSHED)
         hue_debug(ctx, HUE_MSG_ERR, "Register failed: Link button on the bridge not pressed within last 30 seconds"); /* Link button on the bridge hasn't been pressed in the last 30s */
       else
-        hue_debug(ctx, HUE_MSG_ERR, "Register failed: Unexpected error type (%d) received from bridge", error_type); /* ??? Why else is registration likely to fail? */
-
-      retval = error_type;
+        hue_debug(ctx, HUE_MSG_ERR, "Register failed: Unexpected error type (%d) received from bridge", retval); /* ??? Why else is registration likely to fail? */
     }
   }
   else
   {
     /* Not an error message, so assume it worked */
-    if (parse_register_response(ctx))
+    retval = parse_register_response(ctx, jobj);
+    json_object_put(jobj);
+    if (retval)
       return -2;
-    else
+
+    *out_username  = ctx->username;
+    *out_clientkey = ctx->clientkey;
+  }
+
+  return retval;
+}
+
+static int64_t monotonic_ms(void)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return ((int64_t)now.tv_sec * 1000) + (now.tv_nsec / 1000000);
+}
+
+/* Called by cURL when it wants us to (stop) waiting on a socket */
+static int multi_socket_cb(CURL *easy, curl_socket_t fd, int what, void *userp, void *socketp)
+{
+  struct hue_rest_multi *multi = userp;
+  int n;
+
+  for (n = 0; n < multi->fd_count; n++)
+    if (multi->fds[n].fd == fd)
+      break;
+
+  if (what == CURL_POLL_REMOVE)
+  {
+    if (n < multi->fd_count)
+      multi->fds[n] = multi->fds[--multi->fd_count];
+    return 0;
+  }
+
+  if (n == multi->fd_count)
+  {
+    if (multi->fd_count >= HUE_REST_MULTI_MAX_FDS)
+      return -1;
+    multi->fd_count++;
+  }
+
+  multi->fds[n].fd = fd;
+  multi->fds[n].events = ((what & CURL_POLL_IN) ? POLLIN : 0) | ((what & CURL_POLL_OUT) ? POLLOUT : 0);
+  multi->fds[n].revents = 0;
+  return 0;
+}
+
+/* Called by cURL to set (or clear, with -1) the time it next needs to be called, regardless of sockets */
+static int multi_timer_cb(CURLM *curlm, long timeout_ms, void *userp)
+{
+  struct hue_rest_multi *multi = userp;
+
+  multi->timer_deadline_ms = timeout_ms < 0 ? -1 : monotonic_ms() + timeout_ms;
+  return 0;
+}
+
+int hue_rest_multi_init(struct hue_rest_multi *multi)
+{
+  memset(multi, 0, sizeof(struct hue_rest_multi));
+  multi->timer_deadline_ms = -1;
+
+  multi->multi = curl_multi_init();
+  if (!multi->multi)
+    return -1;
+
+  curl_multi_setopt(multi->multi, CURLMOPT_SOCKETFUNCTION, multi_socket_cb);
+  curl_multi_setopt(multi->multi, CURLMOPT_SOCKETDATA, multi);
+  curl_multi_setopt(multi->multi, CURLMOPT_TIMERFUNCTION, multi_timer_cb);
+  curl_multi_setopt(multi->multi, CURLMOPT_TIMERDATA, multi);
+
+  return 0;
+}
+
+/* Take ctx's request out of its multi */
+static void remove_request(struct hue_rest_ctx *ctx)
+{
+  struct hue_rest_multi *multi = ctx->multi;
+
+  for (struct hue_rest_ctx **link = &multi->pending; *link; link = &(*link)->pending_next)
+  {
+    if (*link == ctx)
     {
-      *out_username  = ctx->username;
-      *out_clientkey = ctx->clientkey;
-      retval = 0;
+      *link = ctx->pending_next;
+      break;
     }
   }
 
-  return retval;
+  curl_multi_remove_handle(multi->multi, ctx->curl);
+  multi->requests--;
+  ctx->pending_next = NULL;
+  ctx->multi = NULL;
+  ctx->pending = REQUEST_NONE;
+}
+
+void hue_rest_cancel(struct hue_rest_ctx *ctx)
+{
+  if (!ctx->pending)
+    return;
+
+  remove_request(ctx);
+  free_upload_data(ctx);
+}
+
+void hue_rest_multi_cleanup(struct hue_rest_multi *multi)
+{
+  if (!multi->multi)
+    return;
+
+  /* Cancel anything still in progress */
+  while (multi->pending)
+    hue_rest_cancel(multi->pending);
+
+  curl_multi_cleanup(multi->multi);
+  multi->multi = NULL;
+}
+
+int hue_rest_multi_fds(struct hue_rest_multi *multi, struct pollfd *out_fds, int max_fds, int *out_timeout_ms)
+{
+  int count = multi->fd_count < max_fds ? multi->fd_count : max_fds;
+  int64_t remaining_ms;
+
+  memcpy(out_fds, multi->fds, count * sizeof(struct pollfd));
+
+  if (multi->timer_deadline_ms < 0)
+  {
+    *out_timeout_ms = -1;
+  }
+  else
+  {
+    remaining_ms = multi->timer_deadline_ms - monotonic_ms();
+    *out_timeout_ms = remaining_ms < 0 ? 0 : (int)remaining_ms;
+  }
+
+  return count;
+}
+
+/* Finish off a completed request, and tell the caller */
+static void complete_request(struct hue_rest_ctx *ctx, CURLcode res)
+{
+  struct hue_entertainment_area *areas;
+  int areas_count;
+  hue_rest_cb_t callback = ctx->callback;
+  void *callback_data = ctx->callback_data;
+  int request = ctx->pending;
+  int retval;
+
+  /* Clear first, so the callback can start another request */
+  remove_request(ctx);
+
+  retval = request_done(ctx, res);
+  switch (request)
+  {
+    case REQUEST_ACTIVATE_STREAM:
+      retval = finish_activate_stream(ctx, retval);
+      break;
+
+    case REQUEST_GET_ENT_GROUPS:
+      retval = finish_get_ent_groups(ctx, retval, &areas, &areas_count);
+      break;
+
+    case REQUEST_VALIDATE_APIVERSION:
+      retval = finish_validate_apiversion(ctx, finish_unauth_config(ctx, retval));
+      break;
+  }
+
+  if (callback)
+    callback(ctx, retval, callback_data);
+}
+
+int hue_rest_multi_process(struct hue_rest_multi *multi, const struct pollfd *fds, int count)
+{
+  struct hue_rest_ctx *ctx;
+  CURLMsg *msg;
+  CURL *easy;
+  CURLcode res;
+  int running;
+  int left;
+
+  for (int n = 0; n < count; n++)
+  {
+    int events = 0;
+
+    if (fds[n].revents & POLLIN)
+      events |= CURL_CSELECT_IN;
+    if (fds[n].revents & POLLOUT)
+      events |= CURL_CSELECT_OUT;
+    if (fds[n].revents & (POLLERR | POLLHUP))
+      events |= CURL_CSELECT_ERR;
+
+    if (events)
+      curl_multi_socket_action(multi->multi, fds[n].fd, events, &running);
+  }
+
+  if (multi->timer_deadline_ms >= 0 && monotonic_ms() >= multi->timer_deadline_ms)
+  {
+    multi->timer_deadline_ms = -1;
+    curl_multi_socket_action(multi->multi, CURL_SOCKET_TIMEOUT, 0, &running);
+  }
+
+  while ((msg = curl_multi_info_read(multi->multi, &left)))
+  {
+    if (msg->msg != CURLMSG_DONE)
+      continue;
+
+    /* msg is invalid once the handle is removed */
+    easy = msg->easy_handle;
+    res = msg->data.result;
+
+    if (curl_easy_getinfo(easy, CURLINFO_PRIVATE, (char **)&ctx) == CURLE_OK && ctx)
+      complete_request(ctx, res);
+  }
+
+  return multi->requests;
+}
+
+int hue_rest_multi_wait(struct hue_rest_multi *multi, int timeout_ms)
+{
+  struct pollfd fds[HUE_REST_MULTI_MAX_FDS];
+  int curl_timeout_ms;
+  int count;
+
+  count = hue_rest_multi_fds(multi, fds, HUE_REST_MULTI_MAX_FDS, &curl_timeout_ms);
+  if (curl_timeout_ms >= 0 && curl_timeout_ms < timeout_ms)
+    timeout_ms = curl_timeout_ms;
+
+  if (poll(fds, count, timeout_ms) < 0)
+    count = 0;
+
+  return hue_rest_multi_process(multi, fds, count);
+}
+
+/* Hand the request set up in ctx->curl to multi */
+static int start_request(struct hue_rest_ctx *ctx, struct hue_rest_multi *multi, enum request request, enum req_type rt,
+                         const char *url, hue_rest_cb_t callback, void *user_data)
+{
+  if (setup_request(ctx, rt, url))
+    return -1;
+
+  curl_easy_setopt(ctx->curl, CURLOPT_PRIVATE, ctx);
+  if (curl_multi_add_handle(multi->multi, ctx->curl) != CURLM_OK)
+  {
+    hue_debug(ctx, HUE_MSG_ERR, "start_request> curl_multi_add_handle failed");
+    return -1;
+  }
+
+  multi->requests++;
+  ctx->pending_next = multi->pending;
+  multi->pending = ctx;
+  ctx->multi = multi;
+  ctx->pending = request;
+  ctx->callback = callback;
+  ctx->callback_data = user_data;
+  return 0;
+}
+
+int hue_rest_activate_stream_async(struct hue_rest_ctx *ctx, struct hue_rest_multi *multi, int group, hue_rest_cb_t callback, void *user_data)
+{
+  char url[254];
+
+  if (ctx->pending)
+  {
+    hue_debug(ctx, HUE_MSG_ERR, "hue_rest_activate_stream_async> request already in progress");
+    return -1;
+  }
+
+  if (prepare_activate_stream(ctx, group, url, sizeof(url)))
+    return -1;
+
+  /* make PUT request */
+  if (start_request(ctx, multi, REQUEST_ACTIVATE_STREAM, REQTYPE_PUT, url, callback, user_data))
+  {
+    finish_activate_stream(ctx, -1);
+    return -1;
+  }
+
+  return 0;
+}
+
+int hue_rest_get_ent_groups_async(struct hue_rest_ctx *ctx, struct hue_rest_multi *multi, hue_rest_cb_t callback, void *user_data)
+{
+  char url[254];
+
+  prepare_get_ent_groups(ctx, url, sizeof(url));
+
+  /* make GET request */
+  return start_request(ctx, multi, REQUEST_GET_ENT_GROUPS, REQTYPE_GET, url, callback, user_data);
+}
+
+int hue_rest_validate_apiversion_async(struct hue_rest_ctx *ctx, struct hue_rest_multi *multi, hue_rest_cb_t callback, void *user_data)
+{
+  char url[254];
+
+  prepare_unauth_config(ctx, url, sizeof(url));
+
+  /* make GET request */
+  return start_request(ctx, multi, REQUEST_VALIDATE_APIVERSION, REQTYPE_GET, url, callback, user_data);
 }
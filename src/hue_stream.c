@@ -0,0 +1,895 @@
+/*
+ * Copyright (c) 2019, Daniel Swann <github@dswann.co.uk>
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE /* for sendmmsg */
+#endif
+
+#include "hue_stream.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <stdarg.h>
+
+#define NSEC_PER_SEC 1000000000L
+
+static void debug_message(struct hue_stream *stream, char *fmt, ...)
+{
+  va_list args;
+  va_start(args, fmt);
+  hue_debug_vmessage(stream->debug_callback, stream->user_data, "[stream] ", fmt, args);
+  va_end(args);
+}
+
+#define debug(stream, level, ...) HUE_DEBUG_CALL(debug_message, stream, level, __VA_ARGS__)
+
+static void timespec_add_ns(struct timespec *ts, long ns)
+{
+  ts->tv_nsec += ns;
+  while (ts->tv_nsec >= NSEC_PER_SEC)
+  {
+    ts->tv_nsec -= NSEC_PER_SEC;
+    ts->tv_sec++;
+  }
+}
+
+static uint64_t timespec_to_us(const struct timespec *ts)
+{
+  return ((uint64_t)ts->tv_sec * 1000000) + (ts->tv_nsec / 1000);
+}
+
+static int64_t timespec_diff_ns(const struct timespec *a, const struct timespec *b)
+{
+  return ((int64_t)(a->tv_sec - b->tv_sec) * NSEC_PER_SEC) + (a->tv_nsec - b->tv_nsec);
+}
+
+/* Sleep until the absolute (CLOCK_MONOTONIC) deadline */
+static void sleep_until(const struct timespec *deadline)
+{
+#ifdef __APPLE__
+  /* No clock_nanosleep, so sleep for whatever is left until the deadline */
+  struct timespec now;
+  struct timespec remaining;
+  int64_t ns;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  ns = timespec_diff_ns(deadline, &now);
+  if (ns <= 0)
+    return;
+
+  remaining.tv_sec  = ns / NSEC_PER_SEC;
+  remaining.tv_nsec = ns % NSEC_PER_SEC;
+  while (nanosleep(&remaining, &remaining) == -1 && errno == EINTR);
+#else
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, deadline, NULL) == EINTR);
+#endif
+}
+
+/* Sleep until the next tick. If a whole period (or more) has been missed, don't try to catch up by
+ * sending a burst of messages - just start again from now. Returns the number of ticks missed */
+static int64_t wait_for_tick(struct timespec *deadline, long period_ns, struct timespec *now,
+                             atomic_ullong *missed_deadlines, atomic_ullong *max_lateness_us)
+{
+  int64_t lateness_ns;
+
+  timespec_add_ns(deadline, period_ns);
+  sleep_until(deadline);
+
+  clock_gettime(CLOCK_MONOTONIC, now);
+  lateness_ns = timespec_diff_ns(now, deadline);
+  if (lateness_ns > 0 && (uint64_t)(lateness_ns / 1000) > atomic_load(max_lateness_us))
+    atomic_store(max_lateness_us, lateness_ns / 1000);
+
+  if (lateness_ns < period_ns)
+    return 0;
+
+  atomic_fetch_add(missed_deadlines, lateness_ns / period_ns);
+  *deadline = *now;
+  return lateness_ns / period_ns;
+}
+
+/* Pick up the latest published frame (if there is one), and move any fades on. Returns non-zero with
+ * the message if there is something to send */
+static int prepare_message(struct hue_stream *stream, const struct timespec *now, void **msg_buf, int *buf_len)
+{
+  hue_ent_frame_buffer_apply(&stream->frames, &stream->ent, timespec_to_us(now));
+  hue_ent_update_fades(&stream->ent, timespec_to_us(now));
+
+  if (!hue_ent_is_changed(&stream->ent) &&
+      stream->resend_ms > 0 &&
+      timespec_diff_ns(now, &stream->last_send) < ((int64_t)stream->resend_ms * 1000000))
+  {
+    atomic_fetch_add(&stream->frames_skipped, 1);
+    return 0;
+  }
+
+  hue_ent_get_message(&stream->ent, msg_buf, buf_len);
+  return 1;
+}
+
+static void message_sent(struct hue_stream *stream, const struct timespec *now)
+{
+  struct hue_ent_frame_info info;
+
+  stream->last_send = *now;
+  atomic_fetch_add(&stream->frames_sent, 1);
+
+  /* Latency is only meaningful for the first send of a frame; resends are just keepalives */
+  hue_ent_get_frame_info(&stream->ent, &info);
+  atomic_store(&stream->last_sequence, info.sequence);
+  if (info.send_attempts == 1 && info.created_us)
+  {
+    struct timespec sent;
+    uint64_t latency_us;
+
+    clock_gettime(CLOCK_MONOTONIC, &sent);
+    latency_us = timespec_to_us(&sent) - info.created_us;
+    atomic_store(&stream->last_latency_us, latency_us);
+    if (latency_us > atomic_load(&stream->max_latency_us))
+      atomic_store(&stream->max_latency_us, latency_us);
+    atomic_fetch_add(&stream->total_latency_us, latency_us);
+    atomic_fetch_add(&stream->latency_samples, 1);
+  }
+}
+
+#define RECOVER_WAIT      1 /* waiting for the backoff to expire */
+#define RECOVER_HANDSHAKE 2 /* stream re-activated; DTLS handshake in progress */
+#define RECOVER_ACTIVATE  3 /* re-activation request in progress */
+#define RECOVER_ACTIVATED 4 /* re-activation request done; result in activate_result */
+
+/* Drop the connection, and schedule the next attempt at getting it back */
+static void recovery_begin(struct hue_stream *stream, const struct timespec *now)
+{
+  hue_dtls_disconnect(&stream->dtls);
+
+  if (!stream->backoff_ms)
+    stream->backoff_ms = HUE_STREAM_RECOVERY_MIN_BACKOFF_MS;
+
+  debug(stream, HUE_MSG_INFO, "Reconnecting in %d ms", stream->backoff_ms);
+  stream->recover_step = RECOVER_WAIT;
+  stream->recover_at = *now;
+  timespec_add_ns(&stream->recover_at, (long)stream->backoff_ms * 1000000);
+
+  stream->backoff_ms *= 2;
+  if (stream->backoff_ms > HUE_STREAM_RECOVERY_MAX_BACKOFF_MS)
+    stream->backoff_ms = HUE_STREAM_RECOVERY_MAX_BACKOFF_MS;
+
+  atomic_store(&stream->state, HUE_STREAM_STATE_RECOVERING);
+}
+
+static void activate_done(struct hue_rest_ctx *ctx, int result, void *user_data)
+{
+  struct hue_stream *stream = user_data;
+
+  stream->activate_result = result;
+  stream->recover_step = RECOVER_ACTIVATED;
+}
+
+/* Move recovery on; called every tick while the stream is recovering. The re-activation request and the
+ * handshake are non-blocking, so a group can keep its other streams going meanwhile. grouped is set for a
+ * stream whose records are sent by its group. Returns non-zero once the stream is running again */
+static int recovery_step(struct hue_stream *stream, const struct timespec *now, int grouped)
+{
+  int status;
+
+  if (stream->recover_step == RECOVER_WAIT)
+  {
+    if (timespec_diff_ns(now, &stream->recover_at) < 0)
+      return 0;
+
+    /* The bridge drops out of streaming mode if nothing is received for 10 seconds (or it rebooted) */
+    if (hue_rest_activate_stream_async(stream->rest, &stream->rest_multi, stream->area_id, activate_done, stream))
+    {
+      debug(stream, HUE_MSG_ERR, "Failed to re-activate stream");
+      recovery_begin(stream, now);
+      return 0;
+    }
+    stream->recover_step = RECOVER_ACTIVATE;
+  }
+
+  if (stream->recover_step == RECOVER_ACTIVATE)
+  {
+    /* Calls activate_done once the request completes */
+    hue_rest_multi_wait(&stream->rest_multi, 0);
+    if (stream->recover_step == RECOVER_ACTIVATE)
+      return 0;
+  }
+
+  if (stream->recover_step == RECOVER_ACTIVATED)
+  {
+    if (stream->activate_result)
+    {
+      debug(stream, HUE_MSG_ERR, "Failed to re-activate stream");
+      recovery_begin(stream, now);
+      return 0;
+    }
+
+    status = hue_dtls_connect_start(&stream->dtls, stream->address, stream->port);
+    stream->recover_step = RECOVER_HANDSHAKE;
+  }
+  else
+  {
+    status = hue_dtls_connect_continue(&stream->dtls);
+  }
+
+  if (status == HUE_DTLS_CONNECT_WANT_READ || status == HUE_DTLS_CONNECT_WANT_WRITE)
+    return 0;
+
+  if (status != HUE_DTLS_CONNECT_DONE || (grouped && hue_dtls_set_write_buffered(&stream->dtls)))
+  {
+    recovery_begin(stream, now);
+    return 0;
+  }
+
+  debug(stream, HUE_MSG_INFO, "Reconnected");
+  atomic_fetch_add(&stream->reconnects, 1);
+  stream->backoff_ms = 0;
+
+  /* The bridge has forgotten everything, so send the current frame straight away */
+  memset(&stream->last_send, 0, sizeof(struct timespec));
+  atomic_store(&stream->state, HUE_STREAM_STATE_RUNNING);
+  return 1;
+}
+
+static void connection_lost(struct hue_stream *stream, const struct timespec *now)
+{
+  if (stream->rest)
+  {
+    debug(stream, HUE_MSG_ERR, "Connection lost");
+    recovery_begin(stream, now);
+  }
+  else
+  {
+    debug(stream, HUE_MSG_ERR, "Connection lost; stopping");
+    atomic_store(&stream->state, HUE_STREAM_STATE_FAILED);
+  }
+}
+
+static void message_failed(struct hue_stream *stream, const struct timespec *now)
+{
+  debug(stream, HUE_MSG_ERR, "Failed to send message");
+  atomic_fetch_add(&stream->send_errors, 1);
+  connection_lost(stream, now);
+}
+
+static void *sender_thread(void *arg)
+{
+  struct hue_stream *stream = arg;
+  struct timespec deadline;
+  struct timespec now;
+  long period_ns = NSEC_PER_SEC / stream->framerate;
+  int64_t missed;
+  void *msg_buf;
+  int buf_len;
+
+  debug(stream, HUE_MSG_INFO, "Sender thread started (%d fps)", stream->framerate);
+
+  clock_gettime(CLOCK_MONOTONIC, &deadline);
+  stream->last_send = deadline;
+
+  while (!atomic_load(&stream->stop))
+  {
+    missed = wait_for_tick(&deadline, period_ns, &now, &stream->missed_deadlines, &stream->max_lateness_us);
+    if (missed)
+      debug(stream, HUE_MSG_DEBUG, "Missed %ld deadline(s)", (long)missed);
+
+    if (atomic_load(&stream->state) == HUE_STREAM_STATE_RECOVERING && !recovery_step(stream, &now, 0))
+      continue;
+
+    /* Notice the bridge closing the session (or going away) before sending into the void */
+    if (hue_dtls_poll(&stream->dtls) != HUE_DTLS_POLL_OK)
+    {
+      connection_lost(stream, &now);
+      if (atomic_load(&stream->state) == HUE_STREAM_STATE_FAILED)
+        break;
+      continue;
+    }
+
+    if (!prepare_message(stream, &now, &msg_buf, &buf_len))
+      continue;
+
+    if (hue_dtls_send_data(&stream->dtls, msg_buf, buf_len))
+    {
+      message_failed(stream, &now);
+      if (atomic_load(&stream->state) == HUE_STREAM_STATE_FAILED)
+        break;
+    }
+    else
+    {
+      message_sent(stream, &now);
+    }
+  }
+
+  debug(stream, HUE_MSG_INFO, "Sender thread exiting");
+  return NULL;
+}
+
+int hue_stream_init(struct hue_stream *stream, int light_count, const char *ent_config_id, int framerate,
+                    const char *psk_identity, const char *psk_key, hue_debug_cb_t debug_callback, int debug_level)
+{
+  memset(stream, 0, sizeof(struct hue_stream));
+  stream->debug_callback = debug_callback;
+  stream->debug_level = debug_level;
+  stream->dtls.fd = -1;
+  stream->resend_ms = HUE_STREAM_DEFAULT_RESEND_MS;
+  atomic_init(&stream->state, HUE_STREAM_STATE_INIT);
+
+  if (framerate <= 0)
+  {
+    debug(stream, HUE_MSG_ERR, "hue_stream_init> invalid framerate (%d)", framerate);
+    return -1;
+  }
+  stream->framerate = framerate;
+
+  if (ent_config_id)
+  {
+    if (hue_ent_init_v2(&stream->ent, ent_config_id, light_count))
+    {
+      debug(stream, HUE_MSG_ERR, "hue_stream_init> hue_ent_init_v2 failed");
+      return -1;
+    }
+  }
+  else if (hue_ent_init(&stream->ent, light_count))
+  {
+    debug(stream, HUE_MSG_ERR, "hue_stream_init> hue_ent_init failed");
+    return -1;
+  }
+
+  if (hue_ent_frame_buffer_init(&stream->frames, light_count, 1))
+  {
+    debug(stream, HUE_MSG_ERR, "hue_stream_init> hue_ent_frame_buffer_init failed");
+    hue_ent_cleanup(&stream->ent);
+    return -1;
+  }
+
+  if (hue_dtls_init(&stream->dtls, psk_identity, psk_key, debug_callback, debug_level))
+  {
+    debug(stream, HUE_MSG_ERR, "hue_stream_init> hue_dtls_init failed");
+    hue_ent_frame_buffer_cleanup(&stream->frames);
+    hue_ent_cleanup(&stream->ent);
+    return -1;
+  }
+
+  return 0;
+}
+
+int hue_stream_set_light_id(struct hue_stream *stream, int index, uint16_t hue_light_id)
+{
+  if (atomic_load(&stream->state) == HUE_STREAM_STATE_RUNNING)
+    return -1;
+
+  return hue_ent_set_light_id(&stream->ent, index, hue_light_id);
+}
+
+void hue_stream_set_resend_interval(struct hue_stream *stream, int resend_ms)
+{
+  stream->resend_ms = resend_ms;
+}
+
+int hue_stream_set_recovery(struct hue_stream *stream, struct hue_rest_ctx *rest_ctx, int area_id)
+{
+  if (atomic_load(&stream->state) != HUE_STREAM_STATE_INIT && atomic_load(&stream->state) != HUE_STREAM_STATE_CONNECTED)
+  {
+    debug(stream, HUE_MSG_ERR, "hue_stream_set_recovery> wrong state (%d), must be called before hue_stream_start", atomic_load(&stream->state));
+    return -1;
+  }
+
+  /* Created now, rather than on the sender thread when the connection is first lost */
+  if (rest_ctx && !stream->rest_multi.multi && hue_rest_multi_init(&stream->rest_multi))
+  {
+    debug(stream, HUE_MSG_ERR, "hue_stream_set_recovery> failed to create curl multi handle");
+    return -1;
+  }
+
+  stream->rest = rest_ctx;
+  stream->area_id = area_id;
+  return 0;
+}
+
+int hue_stream_connect(struct hue_stream *stream, const char *address, int port)
+{
+  if (atomic_load(&stream->state) != HUE_STREAM_STATE_INIT)
+  {
+    debug(stream, HUE_MSG_ERR, "hue_stream_connect> wrong state (%d vs expected %d)", atomic_load(&stream->state), HUE_STREAM_STATE_INIT);
+    return -1;
+  }
+
+  if (hue_dtls_connect(&stream->dtls, address, port))
+    return -1;
+
+  /* Kept for reconnecting */
+  snprintf(stream->address, sizeof(stream->address), "%s", address);
+  stream->port = port;
+
+  atomic_store(&stream->state, HUE_STREAM_STATE_CONNECTED);
+  return 0;
+}
+
+int hue_stream_start(struct hue_stream *stream)
+{
+  if (atomic_load(&stream->state) != HUE_STREAM_STATE_CONNECTED)
+  {
+    debug(stream, HUE_MSG_ERR, "hue_stream_start> wrong state (%d vs expected %d)", atomic_load(&stream->state), HUE_STREAM_STATE_CONNECTED);
+    return -1;
+  }
+
+  atomic_store(&stream->stop, 0);
+  atomic_store(&stream->state, HUE_STREAM_STATE_RUNNING);
+  if (pthread_create(&stream->thread, NULL, sender_thread, stream))
+  {
+    debug(stream, HUE_MSG_ERR, "hue_stream_start> failed to create sender thread");
+    atomic_store(&stream->state, HUE_STREAM_STATE_CONNECTED);
+    return -1;
+  }
+  stream->thread_started = 1;
+
+  return 0;
+}
+
+int hue_stream_set_light(struct hue_stream *stream, int index, uint16_t R, uint16_t G, uint16_t B)
+{
+  return hue_ent_frame_buffer_set_light(&stream->frames, 0, index, R, G, B);
+}
+
+int hue_stream_fade_light(struct hue_stream *stream, int index, uint16_t R, uint16_t G, uint16_t B, uint16_t fade_ms)
+{
+  return hue_ent_frame_buffer_fade_light(&stream->frames, 0, index, R, G, B, fade_ms);
+}
+
+void hue_stream_publish(struct hue_stream *stream)
+{
+  hue_ent_frame_buffer_publish(&stream->frames, 0);
+}
+
+int hue_stream_get_state(struct hue_stream *stream)
+{
+  return atomic_load(&stream->state);
+}
+
+void hue_stream_get_stats(struct hue_stream *stream, struct hue_stream_stats *out_stats)
+{
+  uint64_t samples;
+
+  out_stats->frames_sent      = atomic_load(&stream->frames_sent);
+  out_stats->frames_skipped   = atomic_load(&stream->frames_skipped);
+  out_stats->missed_deadlines = atomic_load(&stream->missed_deadlines);
+  out_stats->max_lateness_us  = atomic_load(&stream->max_lateness_us);
+  out_stats->send_errors      = atomic_load(&stream->send_errors);
+  out_stats->last_latency_us  = atomic_load(&stream->last_latency_us);
+  out_stats->max_latency_us   = atomic_load(&stream->max_latency_us);
+  out_stats->last_sequence    = atomic_load(&stream->last_sequence);
+  out_stats->reconnects       = atomic_load(&stream->reconnects);
+
+  samples = atomic_load(&stream->latency_samples);
+  out_stats->avg_latency_us   = samples ? atomic_load(&stream->total_latency_us) / samples : 0;
+}
+
+void hue_stream_stop(struct hue_stream *stream)
+{
+  if (!stream->thread_started)
+    return;
+
+  /* The thread will have already exited if the state is FAILED, but still needs joining */
+  atomic_store(&stream->stop, 1);
+  pthread_join(stream->thread, NULL);
+  stream->thread_started = 0;
+
+  if (atomic_load(&stream->state) == HUE_STREAM_STATE_RUNNING || atomic_load(&stream->state) == HUE_STREAM_STATE_RECOVERING)
+    atomic_store(&stream->state, HUE_STREAM_STATE_STOPPED);
+}
+
+void hue_stream_cleanup(struct hue_stream *stream)
+{
+  hue_stream_stop(stream);
+  hue_rest_multi_cleanup(&stream->rest_multi);
+  hue_dtls_cleanup(&stream->dtls);
+  hue_ent_frame_buffer_cleanup(&stream->frames);
+  hue_ent_cleanup(&stream->ent);
+  atomic_store(&stream->state, HUE_STREAM_STATE_STOPPED);
+}
+
+static void group_debug_message(struct hue_stream_group *group, char *fmt, ...)
+{
+  va_list args;
+  va_start(args, fmt);
+  hue_debug_vmessage(group->debug_callback, group->user_data, "[stream group] ", fmt, args);
+  va_end(args);
+}
+
+#define group_debug(group, level, ...) HUE_DEBUG_CALL(group_debug_message, group, level, __VA_ARGS__)
+
+/* One record per stream; struct mmsghdr (and sendmmsg) only exist on Linux, so elsewhere it's a plain msghdr */
+#ifdef __linux__
+typedef struct mmsghdr batch_msg_t;
+#define BATCH_MSG_HDR(msg) (&(msg)->msg_hdr)
+#else
+typedef struct msghdr batch_msg_t;
+#define BATCH_MSG_HDR(msg) (msg)
+#endif
+
+/* Send one record per stream, in as few system calls as possible */
+static void send_batch(struct hue_stream_group *group, batch_msg_t *msgs, struct hue_stream **sending, int count,
+                       const struct timespec *now)
+{
+  struct timespec start;
+  struct timespec done;
+  uint64_t send_us;
+  uint64_t max_us;
+#ifdef __linux__
+  int sent = 0;
+  int ret;
+#endif
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+#ifdef __linux__
+  while (sent < count)
+  {
+    ret = sendmmsg(group->fd, msgs + sent, count - sent, 0);
+    if (ret < 0)
+    {
+      if (errno == EINTR)
+        continue;
+
+      /* Socket buffer full (the socket is non-blocking); drop the rest of this tick's batch */
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        break;
+
+      /* The first message failed; carry on with the rest */
+      message_failed(sending[sent], now);
+      sent++;
+      continue;
+    }
+
+    for (int n = sent; n < sent + ret; n++)
+      message_sent(sending[n], now);
+    sent += ret;
+  }
+#else
+  for (int n = 0; n < count; n++)
+  {
+    if (sendmsg(group->fd, BATCH_MSG_HDR(&msgs[n]), 0) < 0)
+    {
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        break;
+      message_failed(sending[n], now);
+    }
+    else
+      message_sent(sending[n], now);
+  }
+#endif
+
+  clock_gettime(CLOCK_MONOTONIC, &done);
+  send_us = timespec_diff_ns(&done, &start) / 1000;
+  atomic_fetch_add(&group->total_send_us, send_us);
+  max_us = atomic_load(&group->max_send_us);
+  if (send_us > max_us)
+    atomic_store(&group->max_send_us, send_us);
+
+  atomic_fetch_add(&group->batches_sent, 1);
+}
+
+/* Handle anything received from the bridges, and socket errors. Each stream reads its own connected
+ * socket, but they're all checked with one poll call, as the bridges rarely send anything */
+static void poll_streams(struct hue_stream_group *group, const struct timespec *now)
+{
+  struct pollfd pfds[HUE_STREAM_GROUP_MAX_STREAMS];
+  struct hue_stream *polling[HUE_STREAM_GROUP_MAX_STREAMS];
+  int count = 0;
+
+  for (int n = 0; n < group->stream_count; n++)
+  {
+    struct hue_stream *stream = group->streams[n];
+
+    if (atomic_load(&stream->state) != HUE_STREAM_STATE_RUNNING)
+      continue;
+
+    pfds[count].fd = hue_dtls_get_fd(&stream->dtls);
+    pfds[count].events = POLLIN;
+    pfds[count].revents = 0;
+    polling[count++] = stream;
+  }
+
+  if (!count || poll(pfds, count, 0) <= 0)
+    return;
+
+  for (int n = 0; n < count; n++)
+  {
+    /* Notice the bridge closing the session (or going away) before sending into the void */
+    if (pfds[n].revents && hue_dtls_poll(&polling[n]->dtls) != HUE_DTLS_POLL_OK)
+      connection_lost(polling[n], now);
+  }
+}
+
+#ifdef SO_TXTIME
+/* Ask the kernel to send a message at launch_ns (CLOCK_MONOTONIC) */
+static void set_launch_time(struct msghdr *msg, char *control, size_t control_len, uint64_t launch_ns)
+{
+  struct cmsghdr *cmsg;
+
+  msg->msg_control = control;
+  msg->msg_controllen = control_len;
+  cmsg = CMSG_FIRSTHDR(msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_TXTIME;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(uint64_t));
+  memcpy(CMSG_DATA(cmsg), &launch_ns, sizeof(uint64_t));
+}
+#endif
+
+static void *group_thread(void *arg)
+{
+  struct hue_stream_group *group = arg;
+  batch_msg_t msgs[HUE_STREAM_GROUP_MAX_STREAMS];
+  struct iovec iov[HUE_STREAM_GROUP_MAX_STREAMS];
+  struct hue_stream *sending[HUE_STREAM_GROUP_MAX_STREAMS];
+#ifdef SO_TXTIME
+  char control[HUE_STREAM_GROUP_MAX_STREAMS][CMSG_SPACE(sizeof(uint64_t))];
+#endif
+  struct timespec deadline;
+  struct timespec now;
+  long period_ns = NSEC_PER_SEC / group->framerate;
+  int64_t missed;
+  int count;
+  int running;
+
+  group_debug(group, HUE_MSG_INFO, "Sender thread started (%d streams, %d fps)", group->stream_count, group->framerate);
+
+  clock_gettime(CLOCK_MONOTONIC, &deadline);
+  for (int n = 0; n < group->stream_count; n++)
+    group->streams[n]->last_send = deadline;
+
+  while (!atomic_load(&group->stop))
+  {
+    missed = wait_for_tick(&deadline, period_ns, &now, &group->missed_deadlines, &group->max_lateness_us);
+    if (missed)
+      group_debug(group, HUE_MSG_DEBUG, "Missed %ld deadline(s)", (long)missed);
+
+    poll_streams(group, &now);
+
+    /* Encode every stream first, so the records all go out back to back */
+    count = 0;
+    running = 0;
+    memset(msgs, 0, sizeof(msgs));
+    for (int n = 0; n < group->stream_count; n++)
+    {
+      struct hue_stream *stream = group->streams[n];
+      const void *record;
+      int record_len;
+      void *msg_buf;
+      int buf_len;
+
+      if (atomic_load(&stream->state) == HUE_STREAM_STATE_RECOVERING)
+      {
+        running++;
+        if (!recovery_step(stream, &now, 1))
+          continue;
+      }
+
+      if (atomic_load(&stream->state) != HUE_STREAM_STATE_RUNNING)
+        continue;
+      running++;
+
+      if (!prepare_message(stream, &now, &msg_buf, &buf_len))
+        continue;
+
+      if (hue_dtls_write_record(&stream->dtls, msg_buf, buf_len, &record, &record_len))
+      {
+        message_failed(stream, &now);
+        continue;
+      }
+
+      iov[count].iov_base = (void *)record;
+      iov[count].iov_len = record_len;
+      BATCH_MSG_HDR(&msgs[count])->msg_name = &stream->dtls.remote_addr;
+      BATCH_MSG_HDR(&msgs[count])->msg_namelen = sizeof(struct sockaddr_in);
+      BATCH_MSG_HDR(&msgs[count])->msg_iov = &iov[count];
+      BATCH_MSG_HDR(&msgs[count])->msg_iovlen = 1;
+#ifdef SO_TXTIME
+      if (group->socket_options.txtime_lead_us > 0)
+        set_launch_time(BATCH_MSG_HDR(&msgs[count]), control[count], sizeof(control[count]),
+                        ((uint64_t)deadline.tv_sec * NSEC_PER_SEC) + deadline.tv_nsec +
+                        ((uint64_t)group->socket_options.txtime_lead_us * 1000));
+#endif
+      sending[count++] = stream;
+    }
+
+    if (!running)
+    {
+      group_debug(group, HUE_MSG_ERR, "All streams have failed; stopping");
+      atomic_store(&group->state, HUE_STREAM_STATE_FAILED);
+      break;
+    }
+
+    if (count)
+      send_batch(group, msgs, sending, count, &now);
+  }
+
+  group_debug(group, HUE_MSG_INFO, "Sender thread exiting");
+  return NULL;
+}
+
+int hue_stream_group_init(struct hue_stream_group *group, int framerate, hue_debug_cb_t debug_callback, int debug_level)
+{
+  memset(group, 0, sizeof(struct hue_stream_group));
+  group->debug_callback = debug_callback;
+  group->debug_level = debug_level;
+  group->fd = -1;
+  hue_dtls_socket_options_init(&group->socket_options);
+  atomic_init(&group->state, HUE_STREAM_STATE_INIT);
+
+  if (framerate <= 0)
+  {
+    group_debug(group, HUE_MSG_ERR, "hue_stream_group_init> invalid framerate (%d)", framerate);
+    return -1;
+  }
+  group->framerate = framerate;
+
+  group->fd = socket(AF_INET, SOCK_DGRAM, 0);
+  if (group->fd < 0)
+  {
+    group_debug(group, HUE_MSG_ERR, "hue_stream_group_init> failed to create socket");
+    return -1;
+  }
+
+  /* The streams' own sockets are bound to the same port, so the bridges see one address */
+  group->port = hue_dtls_bind_shared(group->fd, 0);
+  if (group->port < 0)
+  {
+    group_debug(group, HUE_MSG_ERR, "hue_stream_group_init> failed to bind socket: %s", strerror(errno));
+    return -1;
+  }
+
+  return 0;
+}
+
+int hue_stream_group_set_socket_options(struct hue_stream_group *group, const struct hue_dtls_socket_options *options)
+{
+  if (atomic_load(&group->state) != HUE_STREAM_STATE_INIT || group->fd < 0)
+  {
+    group_debug(group, HUE_MSG_ERR, "hue_stream_group_set_socket_options> wrong state (%d vs expected %d)", atomic_load(&group->state), HUE_STREAM_STATE_INIT);
+    return -1;
+  }
+
+  if (hue_dtls_socket_options_apply(options, group->fd))
+  {
+    group_debug(group, HUE_MSG_ERR, "hue_stream_group_set_socket_options> %s", strerror(errno));
+    return -1;
+  }
+
+  group->socket_options = *options;
+  return 0;
+}
+
+int hue_stream_group_add(struct hue_stream_group *group, struct hue_stream *stream, const char *address, int port)
+{
+  if (atomic_load(&group->state) != HUE_STREAM_STATE_INIT)
+  {
+    group_debug(group, HUE_MSG_ERR, "hue_stream_group_add> wrong state (%d vs expected %d)", atomic_load(&group->state), HUE_STREAM_STATE_INIT);
+    return -1;
+  }
+
+  if (group->stream_count >= HUE_STREAM_GROUP_MAX_STREAMS)
+  {
+    group_debug(group, HUE_MSG_ERR, "hue_stream_group_add> too many streams (max %d)", HUE_STREAM_GROUP_MAX_STREAMS);
+    return -1;
+  }
+
+  if (atomic_load(&stream->state) != HUE_STREAM_STATE_INIT)
+  {
+    group_debug(group, HUE_MSG_ERR, "hue_stream_group_add> stream in wrong state (%d vs expected %d)", atomic_load(&stream->state), HUE_STREAM_STATE_INIT);
+    return -1;
+  }
+
+  hue_dtls_set_local_port(&stream->dtls, group->port);
+  if (hue_dtls_connect(&stream->dtls, address, port))
+    return -1;
+
+  if (hue_dtls_set_write_buffered(&stream->dtls))
+    return -1;
+
+  snprintf(stream->address, sizeof(stream->address), "%s", address);
+  stream->port = port;
+
+  atomic_store(&stream->state, HUE_STREAM_STATE_CONNECTED);
+  group->streams[group->stream_count++] = stream;
+  return 0;
+}
+
+int hue_stream_group_start(struct hue_stream_group *group)
+{
+  if (atomic_load(&group->state) != HUE_STREAM_STATE_INIT || !group->stream_count)
+  {
+    group_debug(group, HUE_MSG_ERR, "hue_stream_group_start> wrong state (%d vs expected %d), or no streams", atomic_load(&group->state), HUE_STREAM_STATE_INIT);
+    return -1;
+  }
+
+  atomic_store(&group->stop, 0);
+  for (int n = 0; n < group->stream_count; n++)
+    atomic_store(&group->streams[n]->state, HUE_STREAM_STATE_RUNNING);
+  atomic_store(&group->state, HUE_STREAM_STATE_RUNNING);
+
+  if (pthread_create(&group->thread, NULL, group_thread, group))
+  {
+    group_debug(group, HUE_MSG_ERR, "hue_stream_group_start> failed to create sender thread");
+    for (int n = 0; n < group->stream_count; n++)
+      atomic_store(&group->streams[n]->state, HUE_STREAM_STATE_CONNECTED);
+    atomic_store(&group->state, HUE_STREAM_STATE_INIT);
+    return -1;
+  }
+  group->thread_started = 1;
+
+  return 0;
+}
+
+int hue_stream_group_get_state(struct hue_stream_group *group)
+{
+  return atomic_load(&group->state);
+}
+
+void hue_stream_group_get_stats(struct hue_stream_group *group, struct hue_stream_group_stats *out_stats)
+{
+  out_stats->batches_sent     = atomic_load(&group->batches_sent);
+  out_stats->missed_deadlines = atomic_load(&group->missed_deadlines);
+  out_stats->max_lateness_us  = atomic_load(&group->max_lateness_us);
+  out_stats->max_send_us      = atomic_load(&group->max_send_us);
+  out_stats->avg_send_us      = out_stats->batches_sent ? atomic_load(&group->total_send_us) / out_stats->batches_sent : 0;
+}
+
+void hue_stream_group_stop(struct hue_stream_group *group)
+{
+  if (!group->thread_started)
+    return;
+
+  atomic_store(&group->stop, 1);
+  pthread_join(group->thread, NULL);
+  group->thread_started = 0;
+
+  for (int n = 0; n < group->stream_count; n++)
+  {
+    int state = atomic_load(&group->streams[n]->state);
+    if (state == HUE_STREAM_STATE_RUNNING || state == HUE_STREAM_STATE_RECOVERING)
+      atomic_store(&group->streams[n]->state, HUE_STREAM_STATE_STOPPED);
+  }
+
+  if (atomic_load(&group->state) == HUE_STREAM_STATE_RUNNING)
+    atomic_store(&group->state, HUE_STREAM_STATE_STOPPED);
+}
+
+void hue_stream_group_cleanup(struct hue_stream_group *group)
+{
+  hue_stream_group_stop(group);
+
+  if (group->fd != -1)
+  {
+    close(group->fd);
+    group->fd = -1;
+  }
+
+  group->stream_count = 0;
+  atomic_store(&group->state, HUE_STREAM_STATE_STOPPED);
+}